@@ -40,6 +40,35 @@
 
 
     History:
+    2026-10-18 v0.9.4 (in development)
+                    Add -save=<file> port snapshots and -fleet=<dir> parallel
+                    query over a directory of saved snapshots, plus -serial=.
+                    Add Bench build configuration with -microbench option.
+                    Add -port=<name> lookup of a single port.
+                    Add -n names only listing, fast path reads registry DEVICEMAP.
+                    Add USB topology index, with -tree, -hub= and -siblings= options.
+                    Add -metrics= Prometheus text output, repeated by -interval=.
+                    Verbose mode reads device key values in a single pass.
+                    Add -history= log, so -a & -x also list remembered ports.
+                    Add reference counted port tables, published without locks.
+                    Add asynchronous, cancellable enumeration.
+                    Add -timeout= & -devtimeout= budgets, slow devices are listed as incomplete.
+                    Add -trace= timeline of OS calls, in Chrome trace event format.
+                    Add -slowest= report of device enumeration cost by device, bus, id & driver.
+                    Add -batch mode, many queries answered from one enumeration.
+                    Add -owner column, which process has each port open.
+                    Add -stream (or -unsorted) mode, each port is printed as soon as it is found.
+                    Enumerate Ports, Modem & Multiport Serial classes in one device set.
+                    Verbose mode shows FTDI latency timer, add -set-low-latency option.
+                    Add -bench loopback throughput & round trip latency test of matching ports.
+                    Add -counters sampling of port traffic & line error counters.
+                    Add -top full screen live view, only changed cells are redrawn.
+                    Add -export= binary snapshot, with portsnap.c memory mapped reader.
+                    Add -publish= port table in shared memory, read with a sequence lock.
+                    Verbose mode shows USB link speed, hub & root hub, with a USB bandwidth summary.
+                    Add -irq report of port interrupts, sharing devices & processor interrupt rates.
+                    Fix -usb= & -pci= lists longer than 10 entries.
+
     2014-09-07 AMN v0.9.3 Improve recognition of /USB devices.
                     Get port serialnumber in verbose mode.
                     Remove deprecated code for /vid & /pid.
@@ -83,28 +112,138 @@
 // ANSI C headers
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
+#include <wctype.h>
 
 // MS Windows platform headers, compatible with Windows 2000 and through Windows 8.1
 #include <windows.h>
 #include <devguid.h>
 #include <SetupAPI.h>
 #include <cfgmgr32.h>   // for MAX_DEVICE_ID_LEN
+#include <tlhelp32.h>   // process names for -owner
+
+#include "portsnap.h"   // -export binary snapshot layout
+
+#if defined(PORTLIST_BENCH)
+#include <io.h>         // _dup() & _dup2() to discard output during benchmarks
+#include <fcntl.h>
+#endif
 
 
 // #define these to configure Debug prints etc
 #ifdef _DEBUG
 // #define OPTIONS_DEBUG 
 // #define DEBUG_DEV_PROPERTIES
+// #define DEBUG_DEVICE_DELAY
 #endif
 
 // configure development or deprecated code
+// PORTLIST_BENCH is defined by the Bench build configuration, adds -microbench
+#if defined(PORTLIST_BENCH)
+#define DEBUG_DEVICE_DELAY  // PORTLIST_TEST_DELAY=<port>:<ms>[,...] slows named devices, to test -timeout
+#endif
 
 
 typedef unsigned Bool;
 const unsigned False = 0;
 const unsigned True = 1;
 
+// count of failed property & device info calls, reported by -metrics
+unsigned long property_errors = 0;
+
+
+/*
+    -trace records a span for each OS call of interest in a ring buffer that
+    is allocated up front, so recording is a counter read and a few stores.
+    When the ring fills the oldest spans are overwritten.
+ */
+#define TRACE_EVENTS        16384   // power of 2
+
+struct traceevent {
+    const char*     name;           // static string
+    LONGLONG        start;          // QueryPerformanceCounter() ticks
+    LONGLONG        end;
+    DWORD           tid;
+    DWORD           id;             // eg SPDRP_ property
+    DWORD           bytes;
+    DWORD           result;         // Win32 error code
+    wchar_t         port[12];       // port being enumerated
+    wchar_t         detail[20];     // eg registry value name
+};
+
+struct tracebuffer {
+    struct traceevent*  events;
+    LONG volatile       next;       // total events recorded
+    LARGE_INTEGER       freq;
+    LARGE_INTEGER       origin;
+    wchar_t             port[12];   // current port, set when its name is known
+};
+
+struct tracebuffer* tracing = NULL;
+
+
+/*
+    -slowest times every device's getdeviceinfo(), with the time in each
+    OS call attributed to a cost slot, from the same hooks as -trace.
+ */
+enum costslot {
+    COST_NONE = -1,
+    COST_REGKEY = 0,
+    COST_REGVALUES,
+    COST_INSTANCEID,
+    COST_FRIENDLYNAME,
+    COST_HARDWAREID,
+    COST_DEVICEDESC,
+    COST_MFG,
+    COST_CLASS,
+    COST_LOCATION,
+    COST_PHYSDEVOBJ,
+    COST_DEVNODE,
+    COST_OTHER,
+    COST_SLOTS
+};
+
+const wchar_t* costslot_names[COST_SLOTS] = {
+    L"OpenDevRegKey", L"RegValues", L"InstanceId", L"FriendlyName", L"HardwareId", L"DeviceDesc",
+    L"Mfg", L"Class", L"Location", L"PhysDevObj", L"DevNode", L"Other"
+};
+
+struct devicecost {
+    wchar_t*        portname;       // NULL if the device had no port name
+    wchar_t*        busname;
+    wchar_t*        service;        // driver service, eg FTDIBUS
+    Bool            haveids;
+    unsigned        vendorId;
+    unsigned        productId;
+    LONGLONG        total;          // QueryPerformanceCounter() ticks
+    LONGLONG        ticks[COST_SLOTS];
+};
+
+struct costreport {
+    struct devicecost*  devices;
+    unsigned            count;
+    unsigned            max;
+};
+
+/*
+    Device being timed by getdeviceinfo() on this thread, receives the OS
+    call times. Per thread, as an abandoned -timeout worker can still be
+    enumerating while another enumeration runs.
+ */
+__declspec(thread) struct devicecost* profiling = NULL;
+
+// trace span names
+const char* TRACE_LISTCLASS = "listclass";
+const char* TRACE_DEVICE = "device";
+const char* TRACE_PROPERTY = "portstringproperty";
+const char* TRACE_REGKEY = "SetupDiOpenDevRegKey";
+const char* TRACE_REGVALUE = "RegQueryValueEx";
+const char* TRACE_REGENUM = "RegEnumValue";
+const char* TRACE_INSTANCEID = "SetupDiGetDeviceInstanceId";
+const char* TRACE_DEVNODE = "CM_Get_DevNode_Registry_Property";
+const char* TRACE_USBHUB = "IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX";
+
 // common substrings collected for ease of maintenance
 const wchar_t* progname_msg = L"portlist";
 const wchar_t* version_msg = L"0.9.3";
@@ -134,7 +273,22 @@ const wchar_t* long_copyright_msg =
 
 const wchar_t* usage_msgs[] = 
 {
-    L"[-a] [-l] [-usb[=<vid>[:<pid>]] [-v] [-x] [-xc] [-xl]",
+    L"[-a] [-l|-n] [-usb[=<vid>[:<pid>]] [-serial=<sn>] [-v] [-x] [-xc] [-xl] [-save=<file>]",
+    L"-stream [-a] [-l|-n] [-usb[=<vid>[:<pid>]] [-serial=<sn>] [-v] [-x] [-xc] [-xl]",
+    L"-set-low-latency [-usb[=<vid>[:<pid>]] [-serial=<sn>] [-port=<name>] [-l] [-v]",
+    L"-bench [-baud=<n>] -usb[=<vid>[:<pid>]]|-serial=<sn>|-port=<name>, with loopback plugs fitted",
+    L"-port=<name> [-a] [-l] [-v]",
+    L"[-tree] [-hub=<n>|-hub=<location path>] [-siblings=<port>] [-a] [-l] [-v]",
+    L"-fleet=<dir> [-a] [-l] [-usb[=<vid>[:<pid>]] [-serial=<sn>] [-v] [-x] [-xc] [-xl]",
+    L"-history=<file> [-a|-x] [-l] [-v] [-usb[=<vid>[:<pid>]] [-xc] [-xl]",
+    L"-batch[=<file>] [-a] [-l] [-v], one set of filter options per line of stdin or <file>",
+    L"[-owner] [-timeout=<ms>] [-devtimeout=<ms>] [-trace=<file>] [-slowest=<n>] with any of the above",
+    L"[-export=<file>] with any listing, binary snapshot for other programs (see portsnap.h)",
+    L"-metrics=<file> [-interval=<seconds>] [-a] [-usb[=<vid>[:<pid>]] [-x] [-xc] [-xl]",
+    L"-counters [-interval=<seconds>] [-usb[=<vid>[:<pid>]] [-serial=<sn>] [-port=<name>]",
+    L"-top [-interval=<seconds>] [-a] [-owner] [-counters] [-usb[=<vid>[:<pid>]] [-serial=<sn>] [-xc] [-xl]",
+    L"-publish=<name> [-top] [-interval=<seconds>] [-a] [-usb[=<vid>[:<pid>]] [-xc] [-xl]",
+    L"-irq [-interval=<seconds>] [-usb[=<vid>[:<pid>]] [-pci[=<ven>[:<dev>]] [-port=<name>]",
     L"[-c] [-h|-?]",
     NULL
 };
@@ -142,14 +296,48 @@ const wchar_t* usage_msgs[] =
 const wchar_t* option_msgs[] = 
 {
     L"-a                list all: available (default) plus remembered ports",
+    L"-batch[=<file>]   answer a query per line of stdin or <file>, from one enumeration",
+    L"-baud=<n>         -bench line speed, & per adapter for the -v USB bandwidth summary, default 115200",
+    L"-bench            loopback throughput & round trip latency of matching COM ports",
     L"-c                show GPL Copyright and Warranty details",
+    L"-counters         traffic & line error rates of open ports, every -interval (1) seconds",
+    L"-devtimeout=<ms>  stop fetching a device's details after <ms>, list it as incomplete",
+    L"-export=<file>    also write listed ports as a binary snapshot, read with portsnap.c",
+    L"-fleet=<dir>      query all port snapshots saved in <dir>, adds Host column",
     L"-h or -?          show this help text plus examples",
+    L"-hub=<n>          ports under USB hub <n>, as in Location Info Hub_#<n>",
+    L"-hub=<path>       ports under a Location Path, eg PCIROOT(0)#PCI(1400)#USBROOT(0)#USB(3)",
+    L"-history=<file>   log ports seen, -a & -x also list remembered ports",
+    L"-interval=<s>     repeat -metrics, -counters, -top, -publish or -irq every <s> seconds, until Ctrl+C",
+    L"-irq              port interrupts, devices sharing them & processor interrupt rates every -interval (1) s",
     L"-l                long including Bus type, Vendor & Product IDs",
+    L"-metrics=<file>   write port counts & timings in Prometheus text format",
+    L"-n                names only, one port per line without headings",
+    L"-owner            add Owner column, the process that has the port open",
+#if defined(PORTLIST_BENCH)
+    L"-microbench       run helper checks & microbenchmarks, print results as JSON",
+    L"-microbench=<json> also compare with baseline JSON, fail on regression",
+    L"-latency          time to first port & to cancel asynchronous enumeration",
+    L"-stress           port table readers vs refreshes stress test & benchmark",
+    L"-shmstress        -publish shared memory readers vs publisher stress test",
+#endif
     L"-blu              specify that any Bluetooth devices match",
     L"-pci              specify that any PCI devices match",
     L"-pci=<ven>        specify a PCI Vendor ID (in hex) to match",
     L"-pci=<ven>:<dev>  pair of PCI Vendor & Device IDs (in hex) to match",
-    L"-v                verbose multi-line per port list (implies -l)",
+    L"-port=<name>      only look up the named port, eg COM7",
+    L"-publish=<name>   keep the port table in shared memory Local\\portlist.<name>, see portsnap.h",
+    L"-save=<file>      also save listed ports as a snapshot for -fleet",
+    L"-serial=<sn>      only list ports whose device serial number is <sn>",
+    L"-set-low-latency  set FTDI latency timer of matching ports to 1 ms (as Administrator)",
+    L"-siblings=<port>  ports on the same (eg composite USB) device as <port>",
+    L"-slowest=<n>      report the <n> slowest devices, buses, ids & drivers to enumerate",
+    L"-stream           print each port as soon as it is found, unsorted (or -unsorted)",
+    L"-timeout=<ms>     stop enumerating after <ms>, list the ports found so far",
+    L"-top              full screen live view, redrawn every -interval (1) seconds, q to quit",
+    L"-trace=<file>     record OS calls as Chrome trace JSON, for chrome://tracing or Perfetto",
+    L"-tree             list ports by USB / PCI location path",
+    L"-v                verbose multi-line per port list, with USB links & bus bandwidth (implies -l)",
     L"-usb              specify that any USB devices match",
     L"-usb=<vid>        specify a USB Vendor ID (in hex) to match",
     L"-usb=<vid>:<pid>  pair of USB Vendor & Product IDs (in hex) to match",
@@ -167,15 +355,36 @@ const wchar_t* example_msgs[] =
     L" -l                 : longer, detailed list of available ports",
     L" -a                 : all available & remembered ports",
     L" /XL                : exclude printer ports => COM ports only",
+    L" -n -xl             : quick list of available COM port names",
+    L" -a -stream         : all ports, without waiting for the whole list",
+    L" -a -history=%LOCALAPPDATA%\\ports.log : include remembered ports",
+    L" -batch=boards.txt  : eg lines -usb=2341 then -usb=0403 -l, labelled results",
+    L" -metrics=C:\\textfile\\ports.prom -interval=10 : export metrics",
     L" -blu               : match any Bluetooth device",
     L" -pci=11c1          : match Lucent/Agere PCI modems",
     L" /pci=141b          : match Zoom PCI devices (eg modems)",
+    L" -port=COM7 -v      : details of just COM7",
+    L" -set-low-latency -usb=0403 : 1 ms latency timer on all FTDI ports",
+    L" -bench -usb=10c4 -baud=921600 : qualify CP210x adapters on loopback plugs",
+    L" -v -usb -baud=921600 : check USB buses can carry all the adapters at 921600 baud",
+    L" -counters -usb=0403 -interval=5 : FTDI port traffic & errors every 5 seconds",
+    L" -irq -pci          : which processors service the PCI serial card & who shares its IRQ",
+    L" -owner -usb=0403   : which program is holding the FTDI ports",
+    L" -top -a -counters  : live view, ports coming & going & their traffic",
+    L" -tree -l           : ports grouped by hub & device",
+    L" -hub=4             : ports plugged into hub Hub_#0004",
+    L" -siblings=COM7     : all interfaces of the composite device with COM7",
     L" -usb               : match any USB device",
     L" -usb=2341:0001     : match Arduino Uno VID/PID",
     L" /usb=04d8:000A     : match Microchip USB serial port ref",
     L" -usb=1d50:6098     : match Aperture Labs' RFIDler",
     L" /usb=0403          : match FTDI Vendor ID (eg serial bridges)",
     L" -usb=4e8 -usb=421  : match either Samsung or Nokia VIDs",
+    L" -a -v -save=pc1.txt: save a full snapshot for -fleet queries",
+    L" -a -v -export=ports.snap : binary snapshot for other tools",
+    L" -a -publish=rig    : local programs read the port table from shared memory",
+    L" -fleet=snaps -usb=2341 : which hosts have an Arduino attached",
+    L" -fleet=snaps -serial=A6008isP : which host has this serial number",
     NULL
 };
 
@@ -183,6 +392,7 @@ const wchar_t* example_msgs[] =
 #define OPT_FLAG_ALL                0x00000001
 #define OPT_FLAG_LONGFORM           0x00000002
 #define OPT_FLAG_VERBOSE            0x00000004
+#define OPT_FLAG_OWNER              0x00000008
 #define OPT_FLAG_USBMATCH_VID       0x00000010
 #define OPT_FLAG_USBMATCH_PIDVID    0x00000020
 #define OPT_FLAG_USBMATCH_ANY       0x00000040
@@ -190,10 +400,26 @@ const wchar_t* example_msgs[] =
 #define OPT_FLAG_PCIMATCH_ANY       0x00000100
 #define OPT_FLAG_PCIMATCH_VENDOR    0x00000200
 #define OPT_FLAG_PCIMATCH_DEVICE    0x00000400
+#define OPT_FLAG_STREAM             0x00000800
 #define OPT_FLAG_EXCLUDE_COM        0x00001000
 #define OPT_FLAG_EXCLUDE_LPT        0x00002000
 #define OPT_FLAG_EXCLUDE_AVAILABLE  0x00004000
-
+#define OPT_FLAG_SET_LOW_LATENCY    0x00008000
+#define OPT_FLAG_SERIALMATCH        0x00010000
+#define OPT_FLAG_PORTLOOKUP         0x00020000
+#define OPT_FLAG_NAMESONLY          0x00040000
+#define OPT_FLAG_TREE               0x00080000
+#define OPT_FLAG_SAVE_SNAPSHOT      0x00100000
+#define OPT_FLAG_FLEET              0x00200000
+#define OPT_FLAG_HUBQUERY           0x00400000
+#define OPT_FLAG_SIBLINGQUERY       0x00800000
+#define OPT_FLAG_METRICS            0x01000000
+#define OPT_FLAG_HISTORY            0x02000000
+#define OPT_FLAG_BATCH              0x04000000
+
+#define OPT_FLAG_LATENCY            0x08000000
+#define OPT_FLAG_STRESS             0x10000000
+#define OPT_FLAG_MICROBENCH         0x20000000
 #define OPT_FLAG_HELP_COPYRIGHT     0x40000000
 #define OPT_FLAG_HELP               0x80000000
 
@@ -201,6 +427,34 @@ const wchar_t* example_msgs[] =
 #define OPT_FLAG_MATCH_SPECIFIED (OPT_FLAG_USBMATCH_PIDVID | OPT_FLAG_USBMATCH_VID | OPT_FLAG_USBMATCH_ANY | \
                                     OPT_FLAG_BLUMATCH_ANY | OPT_FLAG_PCIMATCH_ANY | OPT_FLAG_PCIMATCH_VENDOR | OPT_FLAG_PCIMATCH_DEVICE)
 
+// if any option restricts the list to "matching" ports
+#define OPT_FLAG_FILTER_SPECIFIED (OPT_FLAG_MATCH_SPECIFIED | OPT_FLAG_SERIALMATCH | OPT_FLAG_PORTLOOKUP | \
+                                    OPT_FLAG_HUBQUERY | OPT_FLAG_SIBLINGQUERY)
+
+// options that need USB topology details
+#define OPT_FLAG_TOPOLOGY (OPT_FLAG_TREE | OPT_FLAG_HUBQUERY | OPT_FLAG_SIBLINGQUERY)
+
+// options that need device properties, so the -n fast path cannot be used
+#define OPT_FLAG_NEED_DEVICEINFO (OPT_FLAG_ALL | OPT_FLAG_MATCH_SPECIFIED | OPT_FLAG_SERIALMATCH | OPT_FLAG_SAVE_SNAPSHOT | \
+                                    OPT_FLAG_TOPOLOGY | OPT_FLAG_METRICS | OPT_FLAG_HISTORY | OPT_FLAG_BATCH | \
+                                    OPT_FLAG_SET_LOW_LATENCY)
+
+// extended option flags, in PortList optXFlags
+#define OPT_XFLAG_BENCH             0x00000001
+#define OPT_XFLAG_COUNTERS          0x00000002
+#define OPT_XFLAG_TOP               0x00000004
+#define OPT_XFLAG_SHMSTRESS         0x00000008  // Bench build only
+#define OPT_XFLAG_IRQ               0x00000010
+
+// options that need the whole port list, so cannot be used with -stream
+#define OPT_FLAG_NEED_PORTLIST (OPT_FLAG_TOPOLOGY | OPT_FLAG_SAVE_SNAPSHOT | OPT_FLAG_HISTORY | OPT_FLAG_OWNER | \
+                                OPT_FLAG_METRICS | OPT_FLAG_BATCH | OPT_FLAG_FLEET)
+
+// options a -batch query line may use
+#define OPT_FLAG_BATCH_QUERY (OPT_FLAG_ALL | OPT_FLAG_LONGFORM | OPT_FLAG_VERBOSE | OPT_FLAG_MATCH_SPECIFIED | \
+                                OPT_FLAG_EXCLUDE_COM | OPT_FLAG_EXCLUDE_LPT | OPT_FLAG_EXCLUDE_AVAILABLE | \
+                                OPT_FLAG_SERIALMATCH | OPT_FLAG_PORTLOOKUP | OPT_FLAG_NAMESONLY)
+
 /*
     Notes on Vendor & Product Ids
     =============================
@@ -241,6 +495,10 @@ const wchar_t* example_msgs[] =
 #define RETRIEVED_INTERRUPT         0x00000020
 #define RETRIEVED_PORTINDEX         0x00000040
 #define RETRIEVED_INDEXED           0x00000080
+#define RETRIEVED_HUBNUMBER         0x00000100
+#define RETRIEVED_HUBPORT           0x00000200
+#define RETRIEVED_LATENCYTIMER      0x00000400
+#define RETRIEVED_USB_LINK          0x00000800
 
 
 ////////////////////////////////////////////////
@@ -263,6 +521,7 @@ enum pnpbus {
     PNP_BUS_USB,
     PNP_BUS_PCI,
     PNP_BUS_BLUETOOTH,
+    PNP_BUS_TYPES       // count
 };
 
 typedef struct portinfo {
@@ -305,13 +564,112 @@ typedef struct portinfo {
     unsigned long       portindex;   // PortIndex (REG_DWORD)
     unsigned long       indexed;     // Indexed (REG_DWORD), bool true if PortIndex is index rather than bitmap
 
+    // verbose details from registry, for FTDI USB serial ports
+    unsigned long       latencytimer;   // LatencyTimer (REG_DWORD), in ms
+    Bool                isLatencySet:1; // changed by -set-low-latency
+
+    // USB topology, for -tree, -hub & -siblings
+    wchar_t*            parentid;       // device instance id of parent, eg composite USB device or hub
+    wchar_t*            locationpath;   // eg PCIROOT(0)#PCI(1400)#USBROOT(0)#USB(3)#USBMI(0)
+    unsigned            hubnumber;      // from location, eg Port_#0001.Hub_#0004
+    unsigned            hubport;
+    Bool                isSelected:1;   // result of a topology index query
+    Bool                isParentComposite:1;    // parent is the usbccgp composite device
+    Bool                isIncomplete:1; // -devtimeout expired before all details were fetched
+
+    // negotiated USB link, for -v
+    unsigned            usbspeed;       // enum usbspeed
+    unsigned            usbmaxpacket;   // largest bulk endpoint, else endpoint 0
+    wchar_t*            usbhub;         // device instance id of the hub the adapter is plugged into
+    wchar_t*            usbtthub;       // high speed hub translating full & low speed traffic
+    wchar_t*            usbroothub;
+    wchar_t*            usbcontroller;  // host controller description
+
+    ULONGLONG           lastseen;       // FILETIME, of a port remembered by -history
+
+    // -owner, process with the port open
+    DWORD               ownerpid;
+    ULONG_PTR           ownerhandle;    // the port's handle in that process
+    Bool                isOwnerHidden:1;    // no owner found, but not every process could be inspected
+    wchar_t*            ownername;      // eg putty.exe
+
     // for linked list
     struct portinfo*     next;
 } PortInfo;
 
 
+/*
+    USB topology index. Every port is entered under its hub number, its
+    parent device and each prefix of its location path, so that "all ports
+    under this hub" or "all interfaces of this device" are a single lookup.
+ */
+enum topokey {
+    TOPO_KEY_HUB = 0,           // Hub_# number from Location Info
+    TOPO_KEY_PATH,              // a prefix of the Location Path
+    TOPO_KEY_PARENT,            // parent device instance id
+};
+
+#define TOPO_BUCKETS                256
+
+struct toponode {
+    enum topokey        kind;
+    const wchar_t*      key;        // points into the port's strings
+    size_t              keylen;
+    unsigned            number;     // hub number
+    PortInfo*           port;
+    struct toponode*    next;       // hash bucket chain
+};
+
+struct topoindex {
+    struct toponode*    buckets[TOPO_BUCKETS];
+    struct toponode*    nodes;      // allocated in one block
+    unsigned            count;
+    unsigned            max;
+};
+
+
+// timed phases of an enumeration, for -metrics
+enum enumphase {
+    ENUM_PHASE_PORTS = 0,
+    ENUM_PHASE_MODEM,
+    ENUM_PHASE_MULTIPORTSERIAL,
+    ENUM_PHASE_TOTAL,
+    ENUM_PHASES
+};
+
+const char* enumphase_names[ENUM_PHASES] = { "ports", "modem", "multiportserial", "total" };
+
+// device setup classes that have ports, and the phase each is timed as
+struct portclass {
+    const GUID*     guid;
+    enum enumphase  phase;
+};
+
+#define PORT_CLASSES    3
+
+// Ports must be first, it is the only class with LPT ports
+const struct portclass portclasses[PORT_CLASSES] = {
+    { &GUID_DEVCLASS_PORTS, ENUM_PHASE_PORTS },
+    { &GUID_DEVCLASS_MODEM, ENUM_PHASE_MODEM },
+    { &GUID_DEVCLASS_MULTIPORTSERIAL, ENUM_PHASE_MULTIPORTSERIAL }
+};
+
+struct enumstats {
+    LONGLONG        ticks[ENUM_PHASES];     // QueryPerformanceCounter() ticks
+    unsigned long   errors;                 // failed property & device info calls
+    FILETIME        finished;
+};
+
+
+// asynchronous enumeration callback, for each port as it is found
+typedef void (*portfound_fn)(void* context, const PortInfo* pInfo);
+
+#define INTERVAL_MAX    86400   // -interval seconds, one day
+
+
 typedef struct portlist {
     unsigned        optFlags;
+    unsigned        optXFlags;      // extended flags, OPT_XFLAG_...
 
     struct u32_list usbPidVidList;  // list of USB VID:PID pairs
     struct u32_list usbVidList;     // list of USB VIDs
@@ -319,10 +677,528 @@ typedef struct portlist {
     struct u32_list pciDeviceList;  // list of PCI Vendor:Device Id pairs
     struct u32_list pciVendorList;  // list of PCI Vendor Ids
 
+    const wchar_t*  serialmatch;    // -serial=<sn> device serial number to match
+    const wchar_t*  portmatch;      // -port=<name> the only port to look up
+    const wchar_t*  hubmatch;       // -hub=<n> or <location path>
+    const wchar_t*  siblingmatch;   // -siblings=<port>
+    const wchar_t*  metricsfile;    // -metrics=<file>
+    const wchar_t*  historyfile;    // -history=<file>
+    const wchar_t*  tracefile;      // -trace=<file>
+    const wchar_t*  batchfile;      // -batch=<file>, else stdin
+    unsigned        slowest;        // -slowest=<n>
+    struct costreport* costs;       // -slowest device timings
+    unsigned        interval;       // -interval=<seconds>, repeat period, at most INTERVAL_MAX
+    unsigned        baud;           // -baud=<n> for -bench & the -v USB bandwidth summary
+
+    struct enumstats stats;         // of the last enumeration
+
+    // asynchronous enumeration, see startenumeration()
+    portfound_fn    onportfound;
+    void*           context;
+    LONG volatile   cancel;         // set to stop enumeration early
+
+    // -timeout & -devtimeout budgets, in ms, and their deadlines in QueryPerformanceCounter() ticks
+    unsigned        runtimeout;
+    unsigned        devtimeout;
+    LONGLONG        rundeadline;
+    LONGLONG        devdeadline;
+    Bool            timedout;       // the run ran out of time, list is partial
+    CRITICAL_SECTION* listlock;     // guards ports while another thread may take them
+    unsigned        streamed;       // -stream ports printed so far
+    unsigned        latencyset;     // -set-low-latency ports changed
+    const wchar_t*  savefile;       // -save=<file> snapshot to write
+    const wchar_t*  exportfile;     // -export=<file> binary snapshot to write
+    const wchar_t*  publishname;    // -publish=<name> shared memory segment
+    const wchar_t*  fleetdir;       // -fleet=<dir> directory of saved snapshots
+#if defined(PORTLIST_BENCH)
+    const wchar_t*  benchbaseline;  // -microbench=<json> results to compare with
+#endif
+
     PortInfo*       ports;       // linked list of brief port info
 } PortList;
 
 
+/*
+    Saved port snapshot, as written by -save and loaded by -fleet.
+    One per host, ports are kept sorted by portcmp().
+ */
+struct snapshot {
+    wchar_t*        filename;
+    wchar_t*        host;           // from snapshot header, else file name
+    PortInfo*       ports;          // linked list of ports that passed the filters
+    unsigned        count;
+    Bool            loaded;
+};
+
+
+// state shared by the -fleet worker threads
+struct fleet {
+    PortList*           portlist;   // options & filters, read only in workers
+    struct snapshot*    snaps;
+    unsigned            count;
+    LONG volatile       next;       // index of next snapshot to be claimed by a worker
+};
+
+
+/*
+    -history log, remembers every port seen. Windows remembers absent
+    devices until they are uninstalled, the history keeps them after that.
+
+    The log has a header line then one line per sighting: last seen time
+    as hex FILETIME, tab, then a snapshot record. It is only appended to,
+    when it has grown to HISTORY_COMPACT_RATIO times the number of ports
+    it knows, it is rewritten with the latest line for each port.
+ */
+const wchar_t* history_magic = L"portlist history 1";
+
+#define HISTORY_BUCKETS         256
+#define HISTORY_COMPACT_RATIO   4
+#define HISTORY_COMPACT_MIN     64      // lines, don't bother compacting small logs
+#define HISTORY_LOCK_MS         10000   // wait for another run to finish with the log
+
+// latest sighting of a port, identified by name, hardware id & serial number
+struct historyentry {
+    wchar_t*        identity;
+    ULONGLONG       lastseen;       // FILETIME
+    const char*     record;         // UTF-8 line in the mapped log, after the time
+    unsigned        length;
+    int             next;           // hash chain, index in entries or -1
+    Bool            present:1;      // found by this enumeration
+    Bool            updated:1;      // and available, so logged with a new time
+};
+
+struct history {
+    const wchar_t*          filename;
+    HANDLE                  hFile;
+    HANDLE                  hMap;
+    const char*             view;
+    Bool                    exists;     // log has a valid header
+    unsigned                lines;      // records in the log, including superseded
+    struct historyentry*    entries;
+    unsigned                count;
+    unsigned                max;
+    int                     buckets[HISTORY_BUCKETS];
+};
+
+
+/*
+    Immutable, reference counted table of ports. Once built a table is never
+    changed, so any number of threads can read it. A refresh builds a new
+    table and publishes it in place of the old one, see porttablepublish().
+ */
+typedef struct porttable {
+    LONG volatile   refs;
+    unsigned        generation;     // of publication
+    unsigned        count;
+    PortInfo*       ports;          // sorted linked list, owned by the table
+    PortInfo**      index;          // the same ports as an array, in list order
+    PortInfo**      bybus[PNP_BUS_TYPES];   // the ports of each bus type, in list order
+    unsigned        buscount[PNP_BUS_TYPES];
+} PortTable;
+
+/*
+    Current table for lock free readers. Readers announce themselves in the
+    reader count for the current epoch while they take a reference, the
+    publisher waits for the old epoch's readers to drain before it drops
+    its reference to the replaced table.
+ */
+struct porttablepub {
+    PortTable* volatile current;
+    LONG volatile       epoch;
+    LONG volatile       readers[2];
+    unsigned            generation;     // publisher only
+};
+
+
+// result of an asynchronous enumeration
+struct enumsummary {
+    unsigned        count;
+    Bool            cancelled;
+    struct enumstats stats;
+};
+
+typedef void (*enumdone_fn)(void* context, const struct enumsummary* summary);
+
+typedef struct asyncenum {
+    PortList*           portlist;
+    enumdone_fn         ondone;
+    HANDLE              thread;
+    struct enumsummary  summary;
+} AsyncEnum;
+
+
+/*
+    -counters reads the serial driver's statistics through the handle of the
+    program that has the port open. IOCTL_SERIAL_GET_STATS & SERIALPERF_STATS
+    are from ntddser.h, a DDK header.
+ */
+#define IOCTL_SERIAL_GET_STATS  CTL_CODE(FILE_DEVICE_SERIAL_PORT, 35, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define COUNTERS_QUERY_MS       100     // longer & the program's handle is busy with synchronous I/O
+#define COUNTERS_RESCAN_MS      10000   // least time between scans for ports that were opened or reopened
+
+// SERIALPERF_STATS, counts since the port was opened
+struct serialstats {
+    ULONG               received;
+    ULONG               transmitted;
+    ULONG               frameerrors;
+    ULONG               serialoverruns;
+    ULONG               bufferoverruns;
+    ULONG               parityerrors;
+};
+
+struct portcounters {
+    PortInfo*           port;
+    DWORD               processid;
+    HANDLE              process;        // owner, opened for PROCESS_DUP_HANDLE
+    ULONG_PTR           handle;         // in the owner process
+    struct serialstats  last;
+    LONGLONG            lasttime;       // QueryPerformanceCounter() ticks
+    Bool                havelast;
+    Bool                stalled;        // a query through this owner's handle is stuck
+    DWORD               error;
+};
+
+/*
+    An ioctl on a handle opened for synchronous I/O waits for any other
+    I/O on it, eg the owner's blocking ReadFile. So the queries are made on
+    a worker thread, which is left behind & replaced if it gets stuck.
+ */
+struct statsworker {
+    LONG volatile       refs;
+    HANDLE              wake;
+    HANDLE              done;
+    HANDLE              handle;         // duplicated, for the next query
+    Bool volatile       quit;
+    Bool                ok;
+    DWORD               error;
+    struct serialstats  stats;
+};
+
+/*
+    A worker abandoned by querycounters() still holds its duplicate of the
+    owner's handle, until the driver completes the ioctl. The handle is not
+    queried again until then, or each query would leave another thread &
+    duplicate behind, and the duplicates keep the port from being closed.
+ */
+struct stuckquery {
+    DWORD               processid;
+    ULONG_PTR           handle;         // in the owner process
+    struct statsworker* worker;         // our reference, released once its query returns
+};
+
+struct stuckqueries {
+    struct stuckquery*  entries;
+    unsigned            count;
+    unsigned            size;
+};
+
+
+/*
+    -v asks the hub a USB adapter is plugged into for the negotiated link.
+    IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX & its structures are from
+    usbioctl.h & usbspec.h, DDK headers.
+ */
+#define IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 274, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+#define USB_PIPES_MAX           32      // open pipes returned, more than a serial adapter has
+#define USB_ANCESTORS_MAX       16      // device tree levels searched for the USB device & root hub
+#define USB_DEVICE_CONNECTED    1       // USB_CONNECTION_STATUS DeviceConnected
+#define USB_ENDPOINT_BULK       2
+#define USB_BUDGET_PERCENT      80      // of a bus's bulk bandwidth adapters may need before it is flagged
+
+// GUID_DEVINTERFACE_USB_HUB
+const GUID usbhubinterface = { 0xf18a0e88, 0xc30c, 0x11d0, { 0x88, 0x15, 0x00, 0xa0, 0xc9, 0x06, 0xbe, 0xd8 } };
+
+// USB_DEVICE_SPEED
+enum usbspeed {
+    USB_SPEED_LOW = 0,
+    USB_SPEED_FULL,
+    USB_SPEED_HIGH,
+    USB_SPEED_SUPER,
+    USB_SPEEDS          // count
+};
+
+#pragma pack(push, 1)
+struct usbdevicedescriptor {
+    UCHAR               bLength;
+    UCHAR               bDescriptorType;
+    USHORT              bcdUSB;
+    UCHAR               bDeviceClass;
+    UCHAR               bDeviceSubClass;
+    UCHAR               bDeviceProtocol;
+    UCHAR               bMaxPacketSize0;    // exponent for SuperSpeed
+    USHORT              idVendor;
+    USHORT              idProduct;
+    USHORT              bcdDevice;
+    UCHAR               iManufacturer;
+    UCHAR               iProduct;
+    UCHAR               iSerialNumber;
+    UCHAR               bNumConfigurations;
+};
+
+struct usbendpointdescriptor {
+    UCHAR               bLength;
+    UCHAR               bDescriptorType;
+    UCHAR               bEndpointAddress;
+    UCHAR               bmAttributes;       // bits 0-1 transfer type
+    USHORT              wMaxPacketSize;     // bits 0-10 size
+    UCHAR               bInterval;
+};
+
+struct usbpipeinfo {
+    struct usbendpointdescriptor endpoint;
+    ULONG               schedule;
+};
+
+// USB_NODE_CONNECTION_INFORMATION_EX, with room for USB_PIPES_MAX pipes
+struct usbconnectioninfo {
+    ULONG               connectionindex;    // hub port
+    struct usbdevicedescriptor device;
+    UCHAR               configuration;
+    UCHAR               speed;              // enum usbspeed
+    BOOLEAN             ishub;
+    USHORT              address;
+    ULONG               openpipes;
+    ULONG               status;             // USB_CONNECTION_STATUS
+    struct usbpipeinfo  pipes[USB_PIPES_MAX];
+};
+#pragma pack(pop)
+
+/*
+    Adapters sharing bus bandwidth, either a root hub or the full & low speed
+    adapters behind one hub's transaction translator.
+ */
+struct usbbus {
+    const wchar_t*      id;             // root hub or hub device instance id
+    const wchar_t*      controller;     // host controller description, for root hubs
+    Bool                isTranslated;   // full & low speed adapters behind a high speed hub
+    unsigned            speed;          // enum usbspeed, a root hub's SuperSpeed & USB 2.0 buses are separate
+    double              capacity;       // bulk bytes/s
+    double              demand;         // bytes/s the adapters need at the line speed
+    unsigned            count;          // adapters
+};
+
+
+/*
+    -irq joins each port's interrupt with the per processor interrupt
+    counts. Windows does not count interrupts per line, so the rates are of
+    the processors the line is routed to. SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION
+    is in winternl.h with its interrupt fields named Reserved, so it is
+    declared here.
+ */
+#define SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION    8
+#define IRQ_DEVICE_IRQS         8       // interrupts kept per device, MSI-X devices can have many more
+#define IRQ_CPUS_MAX            (8 * sizeof(ULONG_PTR))     // of the processor group, as affinity masks are
+#define IRQ_TEXT_MAX            128
+
+struct irqdesc {
+    ULONG               irq;            // message signalled interrupts are negative
+    ULONG_PTR           affinity;       // processors, 0 if not known
+    DWORD               flags;          // fIRQD_Share, fIRQD_Edge
+};
+
+// a device with interrupts, or a matching port & the interrupts it uses
+struct irqdevice {
+    wchar_t*            name;           // other devices
+    PortInfo*           port;
+    DEVINST             devinst;        // whose interrupts these are
+    wchar_t*            via;            // ancestor the port interrupts through, eg multiport board or USB host controller
+    Bool                isRegistry;     // legacy port's Interrupt value, no resource assigned
+    unsigned            count;
+    struct irqdesc      irqs[IRQ_DEVICE_IRQS];
+};
+
+struct cpuperf {
+    LARGE_INTEGER       idle;
+    LARGE_INTEGER       kernel;
+    LARGE_INTEGER       user;
+    LARGE_INTEGER       dpc;            // 100 ns units
+    LARGE_INTEGER       interrupt;
+    ULONG               interrupts;
+};
+
+
+/*
+    -top full screen view. A refresher thread enumerates & publishes port
+    tables, the view reads the latest one. Each frame is drawn into a cell
+    buffer, and only cells that differ from those on screen are written.
+ */
+#define TOP_HIGHLIGHT_MS    10000   // arrivals, removals & availability changes stay highlighted
+#define TOP_RUN_GAP         4       // unchanged cells rewritten rather than splitting a console write
+#define TOP_UNDRAWN         0xFFFF  // attribute of a cell that must be drawn
+#define TOP_LINE_MAX        512
+#define TOP_OWNER_RESCAN_MS 30000   // -owner & -counters handle scans, unless the ports present change
+#define TOP_QUIT_MS         500     // for the refresher to stop, it is abandoned if stuck in a driver
+
+struct topscreen {
+    HANDLE          console;
+    COORD           origin;         // top left of the console window
+    unsigned        width;
+    unsigned        height;
+    wchar_t*        chars;          // frame being drawn
+    WORD*           attrs;
+    wchar_t*        shownchars;     // what the console shows
+    WORD*           shownattrs;
+    WORD            normal;         // console attributes at start
+};
+
+// a port in the -top view, kept from table to table
+struct toprow {
+    wchar_t             portname[16];
+    PortInfo*           port;           // in the current table, NULL once removed
+    Bool                isAvailable;
+    Bool                isNew;          // changed is an arrival rather than an availability change
+    Bool                seen;           // matched in the new table
+    LONGLONG            changed;        // QueryPerformanceCounter() ticks, 0 if not highlighted
+    struct portcounters counters;       // -counters traffic rates
+    double              rxrate;
+    double              txrate;
+    Bool                haverates;
+};
+
+// -publish=<name> shared memory segment, written by this process only
+struct shmpublisher {
+    wchar_t                 name[MAX_PATH];
+    HANDLE                  mapping;
+    HANDLE                  writer;     // named mutex, held while publishing
+    struct portsnap_shm*    shm;
+};
+
+// shared by the view & refresher threads, the last to finish frees it
+struct topstate {
+    LONG volatile       refs;
+    PortList            enumlist;       // options & filters, the refresher's own copy
+    struct porttablepub pub;
+    struct shmpublisher shm;
+    struct shmpublisher* publisher;     // &shm for -publish=, or NULL
+    HANDLE              stop;           // event, ends the refresher
+    DWORD               interval;       // ms
+};
+
+
+// -bench state of one port, all ports are driven from one I/O completion port
+enum loopbackphase {
+    LOOPBACK_LATENCY = 0,   // echo one probe at a time
+    LOOPBACK_THROUGHPUT,    // stream data for a fixed time
+    LOOPBACK_DRAIN,         // wait for the last echoes
+    LOOPBACK_DONE
+};
+
+#define LOOPBACK_PROBES         200     // round trips timed
+#define LOOPBACK_PROBE_SIZE     8
+#define LOOPBACK_PROBE_MS       1000    // no echo by then, the probe is lost
+#define LOOPBACK_LATENCY_MS     5000    // most time for the round trips
+#define LOOPBACK_THROUGHPUT_MS  3000
+#define LOOPBACK_DRAIN_MS       250     // quiet time that ends the test
+#define LOOPBACK_DRAIN_MAX_MS   1000    // most time for the last echoes, a chatty device is never quiet
+#define LOOPBACK_READ_SIZE      4096
+#define LOOPBACK_WRITE_SIZE     1024
+#define LOOPBACK_DEFAULT_BAUD   115200
+
+struct loopback {
+    PortInfo*           port;
+    HANDLE              handle;
+    OVERLAPPED          readov;
+    OVERLAPPED          writeov;
+    Bool                reading;        // read outstanding
+    Bool                writing;        // write outstanding
+    enum loopbackphase  phase;
+    LONGLONG            phasestart;     // QueryPerformanceCounter() ticks
+    LONGLONG            sent;           // of the probe awaiting echo
+    LONGLONG            lastread;
+    DWORD               pending;        // probe bytes still to be echoed
+    unsigned            probes;         // sent
+    unsigned            lost;
+    LONGLONG*           rtt;            // round trip ticks, of echoed probes
+    unsigned            samples;
+    ULONGLONG           received;       // during the throughput phase
+    LONGLONG            streamticks;
+    DWORD               error;
+    BYTE                readbuf[LOOPBACK_READ_SIZE];
+    BYTE                writebuf[LOOPBACK_WRITE_SIZE];
+};
+
+
+/*
+    -owner scans the system handle table. The table, NtQueryObject and
+    NtQueryVolumeInformationFile are not in the Platform SDK, so are looked
+    up in ntdll at run time with these local declarations.
+ */
+#define SYSTEM_EXTENDED_HANDLE_INFORMATION  64
+#define OBJECT_NAME_INFORMATION             1
+#define FILE_FS_DEVICE_INFORMATION          4
+#ifndef STATUS_INFO_LENGTH_MISMATCH
+#define STATUS_INFO_LENGTH_MISMATCH         ((LONG) 0xC0000004L)
+#endif
+#define OWNER_QUERY_MS                      100     // abandon a handle query that blocks
+#define OWNER_STUCK_MAX                     8       // blocked queries before a scan gives up
+#define OWNER_NAME_MAX                      MAX_PATH
+
+typedef LONG (WINAPI *ntquerysysteminformation_fn)(ULONG infoclass, PVOID info, ULONG length, PULONG returned);
+typedef LONG (WINAPI *ntqueryobject_fn)(HANDLE handle, ULONG infoclass, PVOID info, ULONG length, PULONG returned);
+typedef LONG (WINAPI *ntqueryvolumeinformationfile_fn)(HANDLE handle, PVOID iostatus, PVOID info, ULONG length, ULONG infoclass);
+
+// SYSTEM_HANDLE_TABLE_ENTRY_INFO_EX
+struct handleentry {
+    PVOID           object;
+    ULONG_PTR       pid;
+    ULONG_PTR       handle;
+    ULONG           access;
+    USHORT          backtraceindex;
+    USHORT          typeindex;
+    ULONG           attributes;
+    ULONG           reserved;
+};
+
+// SYSTEM_HANDLE_INFORMATION_EX
+struct handletable {
+    ULONG_PTR           count;
+    ULONG_PTR           reserved;
+    struct handleentry  handles[1];
+};
+
+// OBJECT_NAME_INFORMATION, a UNICODE_STRING followed by its text
+struct objectname {
+    USHORT          length;         // in bytes
+    USHORT          maxlength;
+    wchar_t*        buffer;
+    wchar_t         text[OWNER_NAME_MAX];
+};
+
+// kernel device name of a listed port, eg \Device\Serial0 for COM1
+struct ownerindexentry {
+    wchar_t         devicename[OWNER_NAME_MAX];
+    PortInfo*       port;
+};
+
+struct ownerindex {
+    struct ownerindexentry* entries;
+    unsigned        count;
+    unsigned        size;
+};
+
+/*
+    Device type & name queries of duplicated handles, made one at a time on
+    a helper thread so that a query that blocks can be abandoned. The helper
+    owns each handle it is given & closes it when its query returns, so a
+    stuck helper never queries a handle value that has since been reused.
+ */
+struct ownerworker {
+    LONG volatile   refs;           // the scan & the helper thread
+    HANDLE          request;        // auto reset, set for each handle & to quit
+    HANDLE          done;           // auto reset, query answered
+    Bool volatile   quit;
+    ntqueryobject_fn ntqueryobject;
+    ntqueryvolumeinformationfile_fn ntqueryvolumeinformationfile;
+    HANDLE          handle;         // duplicate, closed by the helper
+    Bool            isport;
+    LONG            status;
+    struct objectname name;
+};
+
+
 ////////////////////////////////////////////////
 // function prototypes
 ////////////////////////////////////////////////
@@ -339,27 +1215,405 @@ Bool findinlist(struct u32_list list, unsigned value);
 Bool checkpidandvidlists(PortList* portlist, PortInfo* pInfo);
 void trygetdevice_regdword(HKEY devkey, wchar_t* keyname, DWORD* result, unsigned int* flags, unsigned int attribflag);
 wchar_t* getportname(HKEY devkey);
+Bool getdevkeyvalues(HKEY devkey, PortInfo* pInfo);
 void getserialnumber(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo);
 void getverboseportinfo(HKEY devkey, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo);
-PortInfo* getdevicesetupinfo(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, unsigned opt_flags);
+PortInfo* getdevicesetupinfo(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData);
 wchar_t* portstringproperty(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, DWORD devprop);
 wchar_t* wcs_dupsubstr(const wchar_t* string, size_t length);
 Bool wcs_istr_tou(wchar_t** pString, const wchar_t* SubStr, unsigned* pOutValue, int Radix);
 int wcs_icmpprefix(const wchar_t* String, const wchar_t* SubStr);
-Bool getportpropstrings(unsigned opt_flags, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo);
+void parsehardwareid(PortInfo* pInfo);
+wchar_t* devnodestringproperty(DEVINST devinst, ULONG devprop);
+void gettopology(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo);
+void getusblink(DEVINST devinst, PortInfo* pInfo);
+Bool getusbconnection(wchar_t* hubid, ULONG hubport, PortInfo* pInfo);
+Bool queryusbconnection(wchar_t* hubid, ULONG hubport, struct usbconnectioninfo* info);
+unsigned usbhubspeed(DEVINST hub, DEVINST parent);
+unsigned usbbusspeed(const PortInfo* p);
+unsigned usbbusadd(struct usbbus* buses, unsigned count, const wchar_t* id, const wchar_t* controller,
+    Bool isTranslated, unsigned speed, double demand);
+unsigned usbbudget(PortInfo* ports, unsigned baud, struct usbbus* buses);
+Bool usbbusover(const struct usbbus* bus);
+void printusbbudget(PortList* portlist);
+enum costslot costslotof(const char* name, DWORD id);
+void recorddevicecost(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData,
+    PortInfo* pInfo, struct devicecost* cost, LONGLONG start);
+int costcmp(const void* p1, const void* p2);
+int costgroupcmp(const void* p1, const void* p2);
+Bool costsamegroup(const struct devicecost* c1, const struct devicecost* c2, int groupby);
+void printcostgroups(struct costreport* report, unsigned top, const wchar_t* title, int groupby);
+void printcostreport(PortList* portlist);
+void freecostreport(struct costreport* report);
+Bool tracestart(void);
+LONGLONG tracebegin(void);
+void traceend(const char* name, LONGLONG start, DWORD id, DWORD bytes, DWORD result, const wchar_t* detail);
+void traceport(const wchar_t* portname);
+const wchar_t* tracepropertyname(DWORD id);
+void tracejsonstring(FILE* f, const wchar_t* str);
+Bool tracewrite(const wchar_t* filename);
+Bool deadlinepassed(LONGLONG deadline);
+LONGLONG deadlineafter(unsigned ms);
+Bool enumstopped(PortList* portlist);
+Bool devicetimedout(PortList* portlist, PortInfo* pInfo);
+#if defined(DEBUG_DEVICE_DELAY)
+void testdevicedelay(const wchar_t* portname);
+#endif
+void portfound(PortList* portlist, PortInfo* pInfo);
+Bool getportpropstrings(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo);
 int portcmp(PortInfo* p1, PortInfo* p2);
+Bool iscomport(PortInfo* pInfo);
+void setportsortkey(PortInfo* pInfo);
+void portlistinsert(PortInfo** pList, PortInfo* pInfo);
+void freeportinfo(PortInfo* pInfo);
+void freeportlist(PortInfo* ports);
+Bool checkportfilters(PortList* portlist, PortInfo* pInfo);
+Bool portexists(const wchar_t* portname);
+unsigned listdevicemapnames(PortList* portlist, const wchar_t* keyname);
+Bool setlowlatency(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo);
 Bool getdeviceinfo(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData);
-unsigned listdevices(PortList* portlist, HDEVINFO hDevInfo);
+unsigned listdevices(PortList* portlist, HDEVINFO hDevInfo, const struct portclass* classes, unsigned nclasses);
 unsigned listclass(PortList* portlist, CONST GUID *guid);
+HDEVINFO portclassdevices(PortList* portlist, const struct portclass* classes, unsigned nclasses);
+unsigned listclasses(PortList* portlist, const struct portclass* classes, unsigned nclasses);
+void printowner(PortInfo* p);
+void printheader(unsigned opt_flags, const wchar_t* hostcolumn);
+void printport(unsigned opt_flags, PortInfo* p);
+void printfooter(unsigned opt_flags, unsigned count);
+unsigned topohash(enum topokey kind, const wchar_t* key, size_t keylen, unsigned number);
+void topoadd(struct topoindex* index, enum topokey kind, const wchar_t* key, size_t keylen, unsigned number, PortInfo* port);
+void topobuild(struct topoindex* index, PortInfo* ports);
+unsigned toposelect(struct topoindex* index, enum topokey kind, const wchar_t* key, size_t keylen, unsigned number);
+unsigned topoquery(PortList* portlist);
+int topopathcmp(const void* p1, const void* p2);
+void printtree(unsigned opt_flags, PortInfo* ports, unsigned count);
+unsigned timedlistclass(PortList* portlist, CONST GUID *guid, enum enumphase phase);
+unsigned enumerateports(PortList* portlist);
+unsigned enumeratewithdeadline(PortList* portlist);
+unsigned ownerindexkey(struct ownerindex* index, const wchar_t* keyname, PortInfo* ports);
+struct ownerworker* ownerworkerstart(ntqueryobject_fn ntqueryobject,
+    ntqueryvolumeinformationfile_fn ntqueryvolumeinformationfile);
+void ownerworkerstop(struct ownerworker* worker);
+void ownerworkerrelease(struct ownerworker* worker);
+DWORD WINAPI ownerworkerthread(LPVOID param);
+Bool queryhandlename(struct ownerworker* worker, HANDLE handle, wchar_t* name, size_t size, Bool* pStuck);
+Bool isportdevicehandle(ntqueryvolumeinformationfile_fn ntqueryvolumeinformationfile, HANDLE handle);
+struct handletable* queryhandletable(ntquerysysteminformation_fn ntquerysysteminformation);
+Bool ownerprivileges(void);
+void findportowners(PortInfo* ports, Bool quiet);
+Bool loopbackopen(struct loopback* lb, unsigned baud);
+void loopbackread(struct loopback* lb, DWORD bytes, LONGLONG now);
+void loopbackstep(struct loopback* lb, LONGLONG now, LONGLONG freq);
+int rttcmp(const void* p1, const void* p2);
+void printloopback(struct loopback* lb, unsigned baud, LONGLONG freq);
+int loopbackbench(PortList* portlist);
+void statsworkerrelease(struct statsworker* w);
+DWORD WINAPI statsworkerthread(LPVOID param);
+struct statsworker* statsworkerstart(void);
+Bool stuckquerywaiting(struct stuckqueries* stuck, DWORD processid, ULONG_PTR handle);
+Bool stuckqueryadd(struct stuckqueries* stuck, DWORD processid, ULONG_PTR handle, struct statsworker* w);
+void stuckqueriesfree(struct stuckqueries* stuck);
+Bool querycounters(struct statsworker** pWorker, struct stuckqueries* stuck, struct portcounters* pc,
+    struct serialstats* stats);
+void trackportowner(struct portcounters* pc);
+void trackportowners(PortList* portlist, struct portcounters* pcs, unsigned count);
+void printcounters(struct portcounters* pc, struct serialstats* stats, LONGLONG now, LONGLONG freq);
+int counterloop(PortList* portlist);
+unsigned getdeviceirqs(DEVINST devinst, struct irqdesc* irqs);
+PortInfo* irqfindport(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData);
+unsigned irqscan(PortList* portlist, struct irqdevice** pDevices);
+void irqname(wchar_t* text, size_t size, const struct irqdesc* irq);
+void cpulist(wchar_t* text, size_t size, ULONG_PTR mask);
+Bool irqshared(const struct irqdevice* devices, unsigned i, unsigned k, const struct irqdesc* irq);
+void printirqs(struct irqdevice* devices, unsigned count);
+int irqloop(PortList* portlist);
+void topstaterelease(struct topstate* state);
+Bool topcopyowners(PortTable* last, PortInfo* ports);
+DWORD WINAPI toprefresher(LPVOID param);
+void topresize(struct topscreen* scr);
+void topline(struct topscreen* scr, unsigned row, WORD attr, const wchar_t* text);
+unsigned topflush(struct topscreen* scr);
+unsigned topmerge(struct toprow* old, unsigned count, struct toprow* rows, PortTable* table, LONGLONG now,
+    LONGLONG highlight, Bool rates);
+void topsample(struct statsworker** pWorker, struct stuckqueries* stuck, struct toprow* rows, unsigned count,
+    LONGLONG now, LONGLONG freq);
+void topportline(wchar_t* line, const struct toprow* row, unsigned opt_flags, Bool rates);
+void topdraw(struct topscreen* scr, unsigned opt_flags, struct toprow* rows, unsigned count, LONGLONG now,
+    LONGLONG freq, Bool rates);
+int topview(PortList* portlist);
 void listports(PortList* portlist);
+DWORD WINAPI enumerationworker(LPVOID param);
+AsyncEnum* startenumeration(PortList* portlist, portfound_fn onportfound, enumdone_fn ondone, void* context);
+void cancelenumeration(AsyncEnum* ae);
+Bool waitenumeration(AsyncEnum* ae, DWORD milliseconds);
+void closeenumeration(AsyncEnum* ae);
+PortTable* porttablebuild(PortInfo* ports);
+unsigned splitqueryline(wchar_t* line, wchar_t** argv, unsigned maxargs);
+unsigned batchselect(PortTable* table, PortList* query, PortInfo*** pCandidates);
+int batchquery(PortList* portlist);
+void porttablerelease(PortTable* table);
+PortTable* porttableacquire(struct porttablepub* pub);
+void porttablepublish(struct porttablepub* pub, PortTable* table);
+Bool samemetriclabels(const PortInfo* p, const PortInfo* q);
+void writemetrics(FILE* f, PortList* portlist, unsigned count);
+Bool savemetrics(PortList* portlist, unsigned count);
+int metricsloop(PortList* portlist);
+void writesnapfield(FILE* f, const wchar_t* value);
+void writesnaprecord(FILE* f, PortInfo* p);
+Bool savesnapshot(PortList* portlist, const wchar_t* filename);
+DWORD exportstring(BYTE* pool, size_t* used, const wchar_t* s);
+void exportrecord(struct portsnap_record* r, BYTE* pool, size_t* used, const PortInfo* p);
+BYTE* exportimage(PortInfo* ports, size_t* pSize);
+Bool exportports(PortInfo* ports, const wchar_t* filename);
+Bool shmpublishopen(struct shmpublisher* pub, const wchar_t* name);
+void shmpublishclose(struct shmpublisher* pub);
+Bool shmpublish(struct shmpublisher* pub, const BYTE* image, size_t size);
+Bool shmpublishports(struct shmpublisher* pub, PortInfo* ports);
+int publishloop(PortList* portlist);
+wchar_t* snapfield(wchar_t** pLine);
+PortInfo* parsesnapshotrecord(wchar_t* line);
+Bool loadsnapshot(PortList* portlist, struct snapshot* snap);
+DWORD WINAPI fleetworker(LPVOID param);
+int listfleet(PortList* portlist);
+unsigned historyhash(const wchar_t* identity);
+Bool historyidentity(wchar_t* line, wchar_t* identity, size_t size);
+int historyfind(struct history* history, const wchar_t* identity);
+int historyadd(struct history* history, const wchar_t* identity);
+Bool loadhistory(struct history* history);
+void closehistory(struct history* history);
+PortInfo* historyrecord(struct historyentry* entry);
+HANDLE historylock(const wchar_t* filename);
+Bool compacthistory(struct history* history, PortInfo* ports, ULONGLONG now);
+unsigned updatehistory(PortList* portlist);
+#if defined(PORTLIST_BENCH)
+int microbench(PortList* portlist);
+int stresstest(PortList* portlist);
+int shmstresstest(PortList* portlist);
+int latencytest(PortList* portlist);
+#endif
+
+
+
+// which cost a traced OS call is attributed to
+enum costslot costslotof(const char* name, DWORD id)
+{
+    if (name == TRACE_PROPERTY) {
+        switch (id) {
+        case SPDRP_FRIENDLYNAME:
+            return COST_FRIENDLYNAME;
+        case SPDRP_HARDWAREID:
+            return COST_HARDWAREID;
+        case SPDRP_DEVICEDESC:
+            return COST_DEVICEDESC;
+        case SPDRP_MFG:
+            return COST_MFG;
+        case SPDRP_CLASS:
+            return COST_CLASS;
+        case SPDRP_LOCATION_INFORMATION:
+            return COST_LOCATION;
+        case SPDRP_PHYSICAL_DEVICE_OBJECT_NAME:
+            return COST_PHYSDEVOBJ;
+        default:
+            return COST_OTHER;
+        }
+    } else if (name == TRACE_REGKEY) {
+        return COST_REGKEY;
+    } else if ((name == TRACE_REGVALUE) || (name == TRACE_REGENUM)) {
+        return COST_REGVALUES;
+    } else if (name == TRACE_INSTANCEID) {
+        return COST_INSTANCEID;
+    } else if (name == TRACE_DEVNODE) {
+        return COST_DEVNODE;
+    } else if (name == TRACE_USBHUB) {
+        return COST_OTHER;
+    }
+    return COST_NONE; // spans that contain other calls
+}
+
+
+Bool tracestart(void)
+{
+    tracing = (struct tracebuffer*) calloc(1, sizeof(struct tracebuffer));
+    if (tracing) {
+        tracing->events = (struct traceevent*) calloc(TRACE_EVENTS, sizeof(struct traceevent));
+        if (tracing->events == NULL) {
+            free(tracing);
+            tracing = NULL;
+        }
+    }
+    if (tracing == NULL) {
+        errorprint(L"tracestart(): memory allocation failed");
+        return False;
+    }
+
+    QueryPerformanceFrequency(&tracing->freq);
+    QueryPerformanceCounter(&tracing->origin);
+    return True;
+}
+
+
+// start time for a span, 0 if not tracing
+LONGLONG tracebegin(void)
+{
+    LARGE_INTEGER now;
 
+    if ((tracing == NULL) && (profiling == NULL)) {
+        return 0;
+    }
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+
+void traceend(const char* name, LONGLONG start, DWORD id, DWORD bytes, DWORD result, const wchar_t* detail)
+{
+    struct traceevent*  event;
+    LARGE_INTEGER       now;
+
+    if (start == 0) {
+        return;
+    }
+
+    QueryPerformanceCounter(&now);
+    if (profiling) {
+        enum costslot slot = costslotof(name, id);
+
+        if (slot != COST_NONE) {
+            profiling->ticks[slot] += now.QuadPart - start;
+        }
+    }
+    if (tracing == NULL) {
+        return;
+    }
+
+    event = &tracing->events[(InterlockedIncrement(&tracing->next) - 1) & (TRACE_EVENTS - 1)];
+    event->name = name;
+    event->start = start;
+    event->end = now.QuadPart;
+    event->tid = GetCurrentThreadId();
+    event->id = id;
+    event->bytes = bytes;
+    event->result = result;
+    memcpy(event->port, tracing->port, sizeof(event->port));
+    if (detail) {
+        wcsncpy(event->detail, detail, 19);
+    } else {
+        event->detail[0] = L'\0';
+    }
+}
+
+
+// name of the port that following spans belong to, NULL between devices
+void traceport(const wchar_t* portname)
+{
+    if (tracing) {
+        if (portname) {
+            wcsncpy(tracing->port, portname, 11);
+        } else {
+            tracing->port[0] = L'\0';
+        }
+    }
+}
+
+
+const wchar_t* tracepropertyname(DWORD id)
+{
+    switch (id) {
+    case SPDRP_FRIENDLYNAME:
+        return L"FRIENDLYNAME";
+    case SPDRP_HARDWAREID:
+        return L"HARDWAREID";
+    case SPDRP_DEVICEDESC:
+        return L"DEVICEDESC";
+    case SPDRP_MFG:
+        return L"MFG";
+    case SPDRP_CLASS:
+        return L"CLASS";
+    case SPDRP_LOCATION_INFORMATION:
+        return L"LOCATION_INFORMATION";
+    case SPDRP_PHYSICAL_DEVICE_OBJECT_NAME:
+        return L"PHYSICAL_DEVICE_OBJECT_NAME";
+    default:
+        return NULL;
+    }
+}
+
+
+// JSON string, escaping as needed
+void tracejsonstring(FILE* f, const wchar_t* str)
+{
+    fputc('"', f);
+    for (; *str; str++) {
+        if ((*str == L'"') || (*str == L'\\')) {
+            fprintf(f, "\\%c", (char) *str);
+        } else if ((*str < 0x20) || (*str > 0x7E)) {
+            fprintf(f, "\\u%04X", (unsigned) *str);
+        } else {
+            fputc((char) *str, f);
+        }
+    }
+    fputc('"', f);
+}
+
+
+// write the recorded spans, oldest first, as Chrome trace event JSON
+Bool tracewrite(const wchar_t* filename)
+{
+    FILE*       f;
+    LONG        total;
+    LONG        first;
+    LONG        i;
+    DWORD       pid = GetCurrentProcessId();
+    double      usperTick;
+    Bool        success;
+
+    if (tracing == NULL) {
+        return False;
+    }
+
+    f = _wfopen(filename, L"wb");
+    if (f == NULL) {
+        errorprintf(L"could not create trace file %s", filename);
+        return False;
+    }
+
+    usperTick = 1.0e6 / (double) tracing->freq.QuadPart;
+    total = tracing->next;
+    first = (total > TRACE_EVENTS) ? (total - TRACE_EVENTS) : 0;
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%ld},\"traceEvents\":[\n", first);
+    for (i = first; i < total; i++) {
+        const struct traceevent* event = &tracing->events[i & (TRACE_EVENTS - 1)];
+        const wchar_t*           propname = (event->name == TRACE_PROPERTY) ? tracepropertyname(event->id) : NULL;
+
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"portlist\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%lu,\"tid\":%lu,"
+            "\"args\":{\"port\":", event->name,
+            (double) (event->start - tracing->origin.QuadPart) * usperTick,
+            (double) (event->end - event->start) * usperTick, pid, event->tid);
+        tracejsonstring(f, event->port);
+        fprintf(f, ",\"id\":\"%#lX\",\"bytes\":%lu,\"result\":%lu", event->id, event->bytes, event->result);
+        if (propname || event->detail[0]) {
+            fprintf(f, ",\"detail\":");
+            tracejsonstring(f, propname ? propname : event->detail);
+        }
+        fprintf(f, "}}%s\n", (i + 1 < total) ? "," : "");
+    }
+    fprintf(f, "]}\n");
+
+    success = !ferror(f);
+    if (fclose(f) || !success) {
+        errorprintf(L"error writing trace file %s", filename);
+        return False;
+    }
+    return True;
+}
 
 
 void listadd(struct u32_list* list, unsigned value)
 {
     if ((list->count + 1) > list->max) {
-        size_t sz = list->max + 10 * sizeof(unsigned); // granularity
-        list->ulist = (unsigned *) realloc(list->ulist, sz);
+        list->max += 10; // granularity
+        list->ulist = (unsigned *) realloc(list->ulist, list->max * sizeof(unsigned));
         if (list->ulist == NULL) {
             errorprint(L"listadd(): memory allocation failed");
             exit(-1);
@@ -466,11 +1720,22 @@ struct opt_info {
     const wchar_t* opt_text;
     unsigned       set_flags;
     unsigned       clear_flags;
+    unsigned       set_xflags;  // OPT_XFLAG_... as OPT_FLAG_ bits have run out
 };
 
 struct opt_info opt_list[] = {
     // -a                all known ports including those not currently available
     { L"a", OPT_FLAG_ALL, 0 },
+    // -batch            queries from stdin
+    { L"batch", OPT_FLAG_BATCH, 0 },
+    // -bench            loopback test of matching ports
+    { L"bench", 0, 0, OPT_XFLAG_BENCH },
+    // -counters         sample port counters
+    { L"counters", 0, 0, OPT_XFLAG_COUNTERS },
+    // -top              full screen live view
+    { L"top", 0, 0, OPT_XFLAG_TOP },
+    // -irq              port interrupts & processor interrupt rates
+    { L"irq", 0, 0, OPT_XFLAG_IRQ },
     // -c                show GPL copyright
     { L"c", OPT_FLAG_HELP_COPYRIGHT, 0 },
     // -h or -?          show help text plus examples
@@ -478,6 +1743,28 @@ struct opt_info opt_list[] = {
     { L"?", OPT_FLAG_HELP, 0 },
     // -l                long including Bus type, Vendor & Product IDs
     { L"l", OPT_FLAG_LONGFORM, 0 },
+#if defined(PORTLIST_BENCH)
+    // -microbench       run helper checks & microbenchmarks
+    { L"microbench", OPT_FLAG_MICROBENCH, 0 },
+    // -latency          asynchronous enumeration latency
+    { L"latency", OPT_FLAG_LATENCY, 0 },
+    // -stress           port table publication stress test
+    { L"stress", OPT_FLAG_STRESS, 0 },
+    // -shmstress        shared memory publication stress test
+    { L"shmstress", 0, 0, OPT_XFLAG_SHMSTRESS },
+#endif
+    // -stream           print ports as they are found
+    { L"stream", OPT_FLAG_STREAM, 0 },
+    // -tree             list by location path
+    { L"tree", OPT_FLAG_TREE, 0 },
+    // -set-low-latency   1 ms FTDI latency timer on matching ports
+    { L"set-low-latency", OPT_FLAG_SET_LOW_LATENCY, 0 },
+    // -n                names only
+    { L"n", OPT_FLAG_NAMESONLY, OPT_FLAG_LONGFORM | OPT_FLAG_VERBOSE },
+    // -owner            which process has each port open
+    { L"owner", OPT_FLAG_OWNER, 0 },
+    // -unsorted         same as -stream
+    { L"unsorted", OPT_FLAG_STREAM, 0 },
     // -v                verbose output, Vendor string, ...
     { L"v", OPT_FLAG_VERBOSE | OPT_FLAG_LONGFORM, 0 },
     // -x                exclude available ports (list only remembered ports)
@@ -490,6 +1777,57 @@ struct opt_info opt_list[] = {
     { NULL }
 };
 
+/* info about command line switches that take a string value */
+struct valopt_info {
+    const wchar_t* opt_text;    // includes the trailing '='
+    unsigned       set_flags;
+    size_t         offset;      // of the value in PortList
+    Bool           isnumber;    // value is unsigned decimal, else const wchar_t*
+};
+
+struct valopt_info valopt_list[] = {
+    // -batch=<file>     queries from a file
+    { L"batch=", OPT_FLAG_BATCH, offsetof(PortList, batchfile) },
+    // -baud=<n>         -bench & -v USB bandwidth line speed
+    { L"baud=", 0, offsetof(PortList, baud), True },
+    // -devtimeout=<ms>  budget for each device
+    { L"devtimeout=", 0, offsetof(PortList, devtimeout), True },
+    // -export=<file>    binary snapshot of the listed ports
+    { L"export=", 0, offsetof(PortList, exportfile) },
+    // -fleet=<dir>      query saved snapshots instead of this PC's ports
+    { L"fleet=", OPT_FLAG_FLEET, offsetof(PortList, fleetdir) },
+#if defined(PORTLIST_BENCH)
+    // -microbench=<json> run microbenchmarks & compare with baseline results
+    { L"microbench=", OPT_FLAG_MICROBENCH, offsetof(PortList, benchbaseline) },
+#endif
+    // -history=<file>   remembered ports log
+    { L"history=", OPT_FLAG_HISTORY, offsetof(PortList, historyfile) },
+    // -interval=<s>     repeat period in seconds, limited to INTERVAL_MAX
+    { L"interval=", 0, offsetof(PortList, interval), True },
+    // -hub=<n|path>     ports under a hub
+    { L"hub=", OPT_FLAG_HUBQUERY, offsetof(PortList, hubmatch) },
+    // -metrics=<file>   Prometheus text format output
+    { L"metrics=", OPT_FLAG_METRICS, offsetof(PortList, metricsfile) },
+    // -port=<name>      look up a single port
+    { L"port=", OPT_FLAG_PORTLOOKUP, offsetof(PortList, portmatch) },
+    // -publish=<name>   port table in shared memory
+    { L"publish=", 0, offsetof(PortList, publishname) },
+    // -save=<file>      save listed ports as a snapshot
+    { L"save=", OPT_FLAG_SAVE_SNAPSHOT, offsetof(PortList, savefile) },
+    // -serial=<sn>      device serial number to match
+    { L"serial=", OPT_FLAG_SERIALMATCH, offsetof(PortList, serialmatch) },
+    // -siblings=<port>  ports on the same device as <port>
+    { L"siblings=", OPT_FLAG_SIBLINGQUERY, offsetof(PortList, siblingmatch) },
+    // -slowest=<n>      enumeration cost report
+    { L"slowest=", 0, offsetof(PortList, slowest), True },
+    // -timeout=<ms>     budget for the whole run
+    { L"timeout=", 0, offsetof(PortList, runtimeout), True },
+    // -trace=<file>     Chrome trace of OS calls
+    { L"trace=", 0, offsetof(PortList, tracefile) },
+    // end of option list marker
+    { NULL }
+};
+
 struct bus_match_info {
     const wchar_t*  buslabel;
     enum pnpbus     bustype;
@@ -544,6 +1882,7 @@ Bool matchoption(PortList* portlist, wchar_t* arg)
         if (!wcsicmp(arg, opt_list[idx].opt_text)) {
             portlist->optFlags |= opt_list[idx].set_flags;
             portlist->optFlags &= ~opt_list[idx].clear_flags;
+            portlist->optXFlags |= opt_list[idx].set_xflags;
             return True;
         }   
     }
@@ -586,9 +1925,33 @@ Bool matchoption(PortList* portlist, wchar_t* arg)
         }   
     }
 
-    // not recognised
-    return False;
-}
+    // options with a value: /fleet= /save= /serial= etc
+    for (idx = 0; valopt_list[idx].opt_text != NULL; idx++) {
+        size_t len = wcslen(valopt_list[idx].opt_text);
+
+        if (!wcsnicmp(arg, valopt_list[idx].opt_text, len)) {
+            if (arg[len] == L'\0') {
+                return False; // value is missing
+            }
+            if (valopt_list[idx].isnumber) {
+                wchar_t*      end;
+                unsigned long value = wcstoul(arg + len, &end, 10);
+
+                if ((*end != L'\0') || (value > UINT_MAX)) {
+                    return False; // bad value
+                }
+                *(unsigned*)((char*)portlist + valopt_list[idx].offset) = (unsigned) value;
+            } else {
+                *(const wchar_t**)((char*)portlist + valopt_list[idx].offset) = arg + len;
+            }
+            portlist->optFlags |= valopt_list[idx].set_flags;
+            return True;
+        }
+    }
+
+    // not recognised
+    return False;
+}
 
 Bool checkoptions(PortList* portlist, int argc, wchar_t** argv)
 {
@@ -689,9 +2052,11 @@ void trygetdevice_regdword(HKEY devkey, wchar_t* keyname, DWORD* result, unsigne
         DWORD sizeIn = sizeof(DWORD);
         DWORD sizeOut = sizeIn;
         DWORD type = 0;
+        LONGLONG tracetime = tracebegin();
+        LSTATUS status = RegQueryValueEx(devkey, keyname, NULL, &type, (LPBYTE)result, &sizeOut);
 
-        if (((RegQueryValueEx(devkey, keyname, NULL, &type, (LPBYTE)result, &sizeOut)) == ERROR_SUCCESS)
-                    && (sizeOut == sizeIn) && (type == REG_DWORD)) {
+        traceend(TRACE_REGVALUE, tracetime, 0, sizeOut, status, keyname);
+        if ((status == ERROR_SUCCESS) && (sizeOut == sizeIn) && (type == REG_DWORD)) {
             // record our success
             *flags |= attribflag;
         }
@@ -709,8 +2074,11 @@ wchar_t* getportname(HKEY devkey)
     DWORD sizeOut = portbuffSize;
     DWORD type = 0;
     wchar_t* portname = NULL;
+    LONGLONG tracetime = tracebegin();
     LSTATUS result = RegQueryValueEx(devkey, keyname, NULL, &type, (LPBYTE)portnameBuff, &sizeOut);
 
+    traceend(TRACE_REGVALUE, tracetime, 0, sizeOut, result, keyname);
+
     // check type
     if (REG_SZ != type) {
         errorprintf(L"expected %s to be of type REG_SZ not %#X", keyname, type);
@@ -741,8 +2109,11 @@ void getserialnumber(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortIn
     // Get Dev Instance Id so that we can extract serial number
     static wchar_t szDevInstanceId[MAX_DEVICE_ID_LEN];
     DWORD size = 0;
+    LONGLONG tracetime = tracebegin();
+    BOOL success = SetupDiGetDeviceInstanceId(hDevInfo, pDeviceInfoData, szDevInstanceId, MAX_DEVICE_ID_LEN, &size);
 
-    if (SetupDiGetDeviceInstanceId(hDevInfo, pDeviceInfoData, szDevInstanceId, MAX_DEVICE_ID_LEN, &size)) {
+    traceend(TRACE_INSTANCEID, tracetime, 0, size * sizeof(wchar_t), success ? ERROR_SUCCESS : GetLastError(), NULL);
+    if (success) {
         size_t i;
         size_t serpos = 0;
         Bool   seenAmp = False;
@@ -770,6 +2141,74 @@ void getserialnumber(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortIn
 }
 
 
+/*
+    Verbose mode wants up to 6 values from the device key, rather than a
+    query for each read them all in one pass over the key. Device keys are
+    small, typically under a dozen values.
+ */
+Bool getdevkeyvalues(HKEY devkey, PortInfo* pInfo)
+{
+    wchar_t  name[32];
+    BYTE     data[64];
+    DWORD    index;
+    DWORD    namelen;
+    DWORD    datalen;
+    DWORD    type;
+    DWORD    bytes = 0;
+    LSTATUS  result;
+    LONGLONG tracetime = tracebegin();
+
+    for (index = 0; ; index++) {
+        namelen = sizeof(name) / sizeof(wchar_t);
+        datalen = sizeof(data);
+        result = RegEnumValue(devkey, index, name, &namelen, NULL, &type, data, &datalen);
+
+        if (result == ERROR_NO_MORE_ITEMS) {
+            break;
+        } else if (result == ERROR_MORE_DATA) {
+            // long name or data, not one of ours unless PortName is very long
+            if ((namelen == 8) && !wcsicmp(name, L"PortName")) {
+                traceend(TRACE_REGENUM, tracetime, index, bytes, result, NULL);
+                return False;
+            }
+            continue;
+        } else if (result != ERROR_SUCCESS) {
+            traceend(TRACE_REGENUM, tracetime, index, bytes, result, NULL);
+            return False;
+        }
+        bytes += datalen;
+
+        if (type == REG_SZ) {
+            if (!wcsicmp(name, L"PortName") && (pInfo->portname == NULL)) {
+                pInfo->portname = wcs_dupsubstr((wchar_t*) data, datalen / sizeof(wchar_t));
+            }
+        } else if ((type == REG_DWORD) && (datalen == sizeof(DWORD))) {
+            DWORD value = *(DWORD*) data;
+
+            if (!wcsicmp(name, L"PortAddress")) {
+                pInfo->portaddress = value;
+                pInfo->retrieved |= RETRIEVED_PORTADDRESS;
+            } else if (!wcsicmp(name, L"Interrupt")) {
+                pInfo->interrupt = value;
+                pInfo->retrieved |= RETRIEVED_INTERRUPT;
+            } else if (!wcsicmp(name, L"PortIndex")) {
+                pInfo->portindex = value;
+                pInfo->retrieved |= RETRIEVED_PORTINDEX;
+            } else if (!wcsicmp(name, L"Indexed")) {
+                pInfo->indexed = value;
+                pInfo->retrieved |= RETRIEVED_INDEXED;
+            } else if (!wcsicmp(name, L"LatencyTimer")) {
+                pInfo->latencytimer = value;
+                pInfo->retrieved |= RETRIEVED_LATENCYTIMER;
+            }
+        }
+    }
+
+    traceend(TRACE_REGENUM, tracetime, index, bytes, ERROR_SUCCESS, NULL);
+    return pInfo->portname != NULL;
+}
+
+
 void getverboseportreginfo(HKEY devkey, PortInfo* pInfo)
 {
     // verbose details for legacy ports
@@ -780,26 +2219,52 @@ void getverboseportreginfo(HKEY devkey, PortInfo* pInfo)
     trygetdevice_regdword(devkey, L"PortIndex", &pInfo->portindex, &pInfo->retrieved, RETRIEVED_PORTINDEX);
     trygetdevice_regdword(devkey, L"Indexed", &pInfo->indexed, &pInfo->retrieved, RETRIEVED_INDEXED);
 
+    // FTDI driver's USB receive latency timer
+    trygetdevice_regdword(devkey, L"LatencyTimer", &pInfo->latencytimer, &pInfo->retrieved, RETRIEVED_LATENCYTIMER);
 }
 
 
-PortInfo* getdevicesetupinfo(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, unsigned opt_flags)
+PortInfo* getdevicesetupinfo(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData)
 {
+    const unsigned opt_flags = portlist->optFlags;
     PortInfo* pInfo = NULL;
     
+    LONGLONG tracetime = tracebegin();
     // get the registry key with the device's port settings
     HKEY devkey = SetupDiOpenDevRegKey(hDevInfo, pDeviceInfoData, DICS_FLAG_GLOBAL, 0, DIREG_DEV, KEY_QUERY_VALUE);
 
-    if (devkey) {
+    traceend(TRACE_REGKEY, tracetime, 0, 0, (devkey != INVALID_HANDLE_VALUE) ? ERROR_SUCCESS : GetLastError(), NULL);
+
+    if (devkey != INVALID_HANDLE_VALUE) {
         pInfo = (PortInfo*) calloc(1, sizeof(PortInfo));
 
         if (pInfo) {
-            pInfo->portname = getportname(devkey);
+            Bool haveverbose = False;
+
+            if (opt_flags & OPT_FLAG_VERBOSE) {
+                haveverbose = getdevkeyvalues(devkey, pInfo);
+                if (!haveverbose) {
+                    // fall back to reading values one at a time
+                    free(pInfo->portname);
+                    memset(pInfo, 0, sizeof(PortInfo));
+                }
+            }
+            if (pInfo->portname == NULL) {
+                pInfo->portname = getportname(devkey);
+            }
 
-            if (pInfo->portname) {
-                if (opt_flags & OPT_FLAG_VERBOSE) {
+            if (pInfo->portname && (opt_flags & OPT_FLAG_PORTLOOKUP) && wcsicmp(pInfo->portname, portlist->portmatch)) {
+                // -port= lookup, not the port we want so skip the other properties
+                freeportinfo(pInfo);
+                pInfo = NULL;
+            } else if (pInfo->portname) {
+                if (opt_flags & (OPT_FLAG_VERBOSE | OPT_FLAG_SERIALMATCH | OPT_FLAG_HISTORY | OPT_FLAG_BATCH)) {
                     getserialnumber(hDevInfo, pDeviceInfoData, pInfo);
+                }
+                if ((opt_flags & OPT_FLAG_VERBOSE) && !haveverbose) {
                     getverboseportreginfo(devkey, pInfo);
+                } else if ((opt_flags & OPT_FLAG_SET_LOW_LATENCY) && !haveverbose) {
+                    trygetdevice_regdword(devkey, L"LatencyTimer", &pInfo->latencytimer, &pInfo->retrieved, RETRIEVED_LATENCYTIMER);
                 }
             } else {
                 // failed to get fullname
@@ -824,22 +2289,24 @@ wchar_t* portstringproperty(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData,
     DWORD    lastError;
     DWORD    buffersize = 0;
     wchar_t* strproperty = NULL;
+    LONGLONG tracetime = tracebegin();
 
     // first call gets property info, such as size & type
     BOOL result = SetupDiGetDeviceRegistryProperty(hDevInfo, pDeviceInfoData, devprop,
         &type, (PBYTE) strbuff, strbuffSize, &buffersize);
 
+    lastError = result ? ERROR_SUCCESS : GetLastError();
     if ((REG_SZ != type) && (REG_MULTI_SZ != type)) {
+        traceend(TRACE_PROPERTY, tracetime, devprop, buffersize, lastError, NULL);
         if (REG_NONE != type) {
             errorprintf(L"expected string property %#X, received type %#X", devprop, type);
+            property_errors++;
         }
         return NULL;
     } else if (result) {
         // copy (first) string to new buffer
         strproperty = wcs_dupsubstr(strbuff, buffersize);
     } else {
-        lastError = GetLastError();
-
         // continue if property currently defined for this port
         if (ERROR_INSUFFICIENT_BUFFER == lastError) {
             // sizeof(wchar_t) works around W2k MBCS bug per KB 888609. 
@@ -863,9 +2330,11 @@ wchar_t* portstringproperty(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData,
             }
         } else if ((ERROR_INVALID_DATA != lastError) && (ERROR_NO_SUCH_DEVINST != lastError)) {
             errorprintf(L"could not get property %#X - error %#X", devprop, lastError);
+            property_errors++;
         }
     }
 
+    traceend(TRACE_PROPERTY, tracetime, devprop, buffersize, lastError, NULL);
     return strproperty;
 }
 
@@ -939,6 +2408,70 @@ int wcs_icmpprefix(const wchar_t* String, const wchar_t* SubStr)
 }
 
 
+// extract Bus type, VID, PID & Revision etc from a hardware id string, eg USB\VID_04D8&PID_000A&REV_0100
+void parsehardwareid(PortInfo* pInfo)
+{
+    wchar_t* str = pInfo->hardwareid;
+    size_t bus_len = wcsspn(str, L"ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+
+    // extract busname
+    if (bus_len > 0) {
+        pInfo->busname = wcs_dupsubstr(str, bus_len);
+        str += bus_len;
+
+        if (!wcs_icmpprefix(pInfo->busname, L"USB")) {
+            pInfo->bustype = PNP_BUS_USB;
+        } else if (!wcs_icmpprefix(pInfo->busname, L"PCI")) {
+            pInfo->bustype = PNP_BUS_PCI;
+        } else if (!wcs_icmpprefix(pInfo->busname, L"BTHENUM")) {
+            pInfo->bustype = PNP_BUS_BLUETOOTH;
+        }
+    } else {
+        // workaround for Broadcom Bluetooth drivers not using a parsable bus name
+        if (wcsstr(pInfo->hardwareid, L"\\BLUETOOTHPORT")) {
+            pInfo->bustype = PNP_BUS_BLUETOOTH;
+        }
+    }
+
+    if (wcs_istr_tou(&str, L"\\VID_", &(pInfo->vendorId), 16)) {
+
+        if (wcs_istr_tou(&str, L"&PID_", &(pInfo->productId), 16)) {
+            if ( (pInfo->vendorId < 0x10000) && (pInfo->productId < 0x10000) ) {
+                pInfo->haveUSBid = True;
+                if (pInfo->bustype == PNP_BUS_UNKNOWN) {
+                    pInfo->bustype = PNP_BUS_USB;
+                }
+            }
+
+            if (wcs_istr_tou(&str, L"&REV_", &(pInfo->revision), 16)) {
+                pInfo->retrieved |= RETRIEVED_USB_REV;
+            }
+            if (wcs_istr_tou(&str, L"&MI_", &(pInfo->usbInterface), 16)) {
+                pInfo->retrieved |= RETRIEVED_USB_MI;
+            }
+        }
+    } else if (wcs_istr_tou(&str, L"VEN_", &(pInfo->vendorId), 16)) {
+
+        if (wcs_istr_tou(&str, L"&DEV_", &(pInfo->productId), 16)) {
+
+            if (wcs_istr_tou(&str, L"&SUBSYS_", &(pInfo->pciSubsys), 16)) {
+
+                if (wcs_istr_tou(&str, L"&REV_", &(pInfo->revision), 16)) {
+
+                    if ( (pInfo->vendorId < 0x10000) && (pInfo->productId < 0x10000) &&
+                            (pInfo->pciSubsys < 0x100000000L) && (pInfo->revision < 0x10000) ) {
+                        pInfo->havePCIid = True;
+                        if (pInfo->bustype == PNP_BUS_UNKNOWN) {
+                            pInfo->bustype = PNP_BUS_PCI;
+                        }
+                    }
+                }
+            }
+        }  // prospective PCI device
+    }
+}
+
+
 /* Device Properties that we can pick from
  *  SPDRP_DEVICEDESC                  DeviceDesc (R/W)
  *  SPDRP_HARDWAREID                  HardwareID (R/W)
@@ -976,10 +2509,125 @@ int wcs_icmpprefix(const wchar_t* String, const wchar_t* SubStr)
  *  SPDRP_BASE_CONTAINERID            Base ContainerID (R)
  *  SPDRP_MAXIMUM_PROPERTY            Upper bound on ordinals
  */
-Bool getportpropstrings(unsigned opt_flags, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo)
+// elapsed time is checked between property fetches, as the fetches themselves can hang
+Bool deadlinepassed(LONGLONG deadline)
+{
+    LARGE_INTEGER now;
+
+    if (deadline == 0) {
+        return False;
+    }
+    QueryPerformanceCounter(&now);
+    return now.QuadPart > deadline;
+}
+
+
+// ms from now in QueryPerformanceCounter() ticks, or 0 for no deadline
+LONGLONG deadlineafter(unsigned ms)
+{
+    LARGE_INTEGER now;
+    LARGE_INTEGER freq;
+
+    if (ms == 0) {
+        return 0;
+    }
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+    return now.QuadPart + (freq.QuadPart * ms) / 1000;
+}
+
+
+// enumeration has been cancelled, or has run out of time
+Bool enumstopped(PortList* portlist)
+{
+    if (portlist->cancel) {
+        return True;
+    }
+    if (deadlinepassed(portlist->rundeadline)) {
+        portlist->timedout = True;
+        return True;
+    }
+    return False;
+}
+
+
+// device has used up its -devtimeout budget, list it with the details fetched so far
+Bool devicetimedout(PortList* portlist, PortInfo* pInfo)
+{
+    if (deadlinepassed(portlist->devdeadline)) {
+        pInfo->isIncomplete = True;
+    }
+    return pInfo->isIncomplete;
+}
+
+
+#if defined(DEBUG_DEVICE_DELAY)
+/*
+    Test backend for -timeout & -devtimeout: sleep as if the driver for the
+    named port were slow, as set by environment variable eg
+    PORTLIST_TEST_DELAY=COM3:2000,COM7:500
+ */
+void testdevicedelay(const wchar_t* portname)
+{
+    wchar_t  delays[256];
+    wchar_t* item;
+    wchar_t* next;
+
+    if (!portname || !GetEnvironmentVariable(L"PORTLIST_TEST_DELAY", delays, sizeof(delays) / sizeof(wchar_t))) {
+        return;
+    }
+
+    for (item = delays; item; item = next) {
+        wchar_t* colon;
+
+        next = wcschr(item, L',');
+        if (next) {
+            *next++ = L'\0';
+        }
+
+        colon = wcschr(item, L':');
+        if (colon) {
+            *colon = L'\0';
+            if (!wcsicmp(item, portname)) {
+                Sleep(wcstoul(colon + 1, NULL, 10));
+                return;
+            }
+        }
+    }
+}
+#endif
+
+
+Bool getportpropstrings(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo)
 {
-    // get base information
-    pInfo->friendlyname = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_FRIENDLYNAME);
+    const unsigned opt_flags = portlist->optFlags;
+    const Bool     exporting = portlist->exportfile || portlist->publishname;  // record the details -save does
+
+    /*
+        All, Verbose, snapshot, export, metrics or history modes need the
+        PhysDevObj, if set the device is available. Fetched first, so that a
+        device that runs out of -devtimeout is still listed as available.
+     */
+    if ((opt_flags & (OPT_FLAG_ALL | OPT_FLAG_VERBOSE | OPT_FLAG_SAVE_SNAPSHOT | OPT_FLAG_METRICS | OPT_FLAG_HISTORY |
+            OPT_FLAG_BATCH)) || exporting) {
+        pInfo->physdevobj = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_PHYSICAL_DEVICE_OBJECT_NAME);
+        if (pInfo->physdevobj) {
+            pInfo->isAvailable = True;
+        }
+    }
+
+    if (devicetimedout(portlist, pInfo)) {
+        return True;
+    }
+
+    // get base information, unless only names are wanted, snapshots always record it
+    if (!(opt_flags & OPT_FLAG_NAMESONLY) || (opt_flags & OPT_FLAG_SAVE_SNAPSHOT) || exporting) {
+        pInfo->friendlyname = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_FRIENDLYNAME);
+    }
+
+#if defined(DEBUG_DEVICE_DELAY)
+    testdevicedelay(pInfo->portname);
+#endif
 
 
 #if defined(_DEBUG) && defined(DEBUG_DEV_PROPERTIES)
@@ -1023,74 +2671,33 @@ Bool getportpropstrings(unsigned opt_flags, HDEVINFO hDevInfo, SP_DEVINFO_DATA*
     
 
 
-    if (opt_flags & (OPT_FLAG_MATCH_SPECIFIED | OPT_FLAG_LONGFORM)) {
+    // stop between property fetches if cancelled or out of time
+    if (enumstopped(portlist)) {
+        return False;
+    }
+    if (devicetimedout(portlist, pInfo)) {
+        return True;
+    }
+
+    if ((opt_flags & (OPT_FLAG_MATCH_SPECIFIED | OPT_FLAG_LONGFORM | OPT_FLAG_SAVE_SNAPSHOT | OPT_FLAG_METRICS |
+            OPT_FLAG_HISTORY | OPT_FLAG_BATCH)) || exporting || portlist->slowest) {
         pInfo->hardwareid = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_HARDWAREID);
 
         // get Bus type, VID, PID & Revision
         if (pInfo->hardwareid) {
-            wchar_t* str = pInfo->hardwareid;
-            size_t bus_len = wcsspn(str, L"ABCDEFGHIJKLMNOPQRSTUVWXYZ");
-
-            // extract busname
-            if (bus_len > 0) {
-                pInfo->busname = wcs_dupsubstr(str, bus_len);
-                str += bus_len;
-
-                if (!wcs_icmpprefix(pInfo->busname, L"USB")) {
-                    pInfo->bustype = PNP_BUS_USB;
-                } else if (!wcs_icmpprefix(pInfo->busname, L"PCI")) {
-                    pInfo->bustype = PNP_BUS_PCI;
-                } else if (!wcs_icmpprefix(pInfo->busname, L"BTHENUM")) {
-                    pInfo->bustype = PNP_BUS_BLUETOOTH;
-                }
-            } else {
-                // workaround for Broadcom Bluetooth drivers not using a parsable bus name
-                if (wcsstr(pInfo->hardwareid, L"\\BLUETOOTHPORT")) {
-                    pInfo->bustype = PNP_BUS_BLUETOOTH;
-                }
-            }
-
-            if (wcs_istr_tou(&str, L"\\VID_", &(pInfo->vendorId), 16)) {
-
-                if (wcs_istr_tou(&str, L"&PID_", &(pInfo->productId), 16)) {
-                    if ( (pInfo->vendorId < 0x10000) && (pInfo->productId < 0x10000) ) {
-                        pInfo->haveUSBid = True;
-                        if (pInfo->bustype == PNP_BUS_UNKNOWN) {
-                            pInfo->bustype = PNP_BUS_USB;
-                        }
-                    }
-
-                    if (wcs_istr_tou(&str, L"&REV_", &(pInfo->revision), 16)) {
-                        pInfo->retrieved |= RETRIEVED_USB_REV;
-                    }
-                    if (wcs_istr_tou(&str, L"&MI_", &(pInfo->usbInterface), 16)) {
-                        pInfo->retrieved |= RETRIEVED_USB_MI;
-                    }
-                }
-            } else if (wcs_istr_tou(&str, L"VEN_", &(pInfo->vendorId), 16)) {
-
-                if (wcs_istr_tou(&str, L"&DEV_", &(pInfo->productId), 16)) {
-
-                    if (wcs_istr_tou(&str, L"&SUBSYS_", &(pInfo->pciSubsys), 16)) {
-
-                        if (wcs_istr_tou(&str, L"&REV_", &(pInfo->revision), 16)) {
+            parsehardwareid(pInfo);
+        }
+    }
 
-                            if ( (pInfo->vendorId < 0x10000) && (pInfo->productId < 0x10000) &&
-                                    (pInfo->pciSubsys < 0x100000000L) && (pInfo->revision < 0x10000) ) {
-                                pInfo->havePCIid = True;
-                                if (pInfo->bustype == PNP_BUS_UNKNOWN) {
-                                    pInfo->bustype = PNP_BUS_PCI;
-                                }
-                            }
-                        }
-                    }
-                }  // prospective PCI device
-            }
-        } // got hardware id
+    if (enumstopped(portlist)) {
+        return False;
+    }
+    if (devicetimedout(portlist, pInfo)) {
+        return True;
     }
 
-    // Vendor / Manufacturer name
-    if (opt_flags & OPT_FLAG_LONGFORM) {
+    // Vendor / Manufacturer name, snapshots & history records want them too
+    if ((opt_flags & (OPT_FLAG_LONGFORM | OPT_FLAG_SAVE_SNAPSHOT | OPT_FLAG_HISTORY)) || exporting) {
         pInfo->product = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_DEVICEDESC);
         pInfo->vendor = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_MFG);
 
@@ -1101,11 +2708,26 @@ Bool getportpropstrings(unsigned opt_flags, HDEVINFO hDevInfo, SP_DEVINFO_DATA*
         }
     }
 
-    // for All or Verbose modes need the PhysDevObj, if set the device is available
-    if (opt_flags & (OPT_FLAG_ALL | OPT_FLAG_VERBOSE)) {
-        pInfo->physdevobj = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_PHYSICAL_DEVICE_OBJECT_NAME);
-        if (pInfo->physdevobj) {
-            pInfo->isAvailable = True;
+    if (enumstopped(portlist)) {
+        return False;
+    }
+    if (devicetimedout(portlist, pInfo)) {
+        return True;
+    }
+
+    if (opt_flags & OPT_FLAG_TOPOLOGY) {
+        gettopology(hDevInfo, pDeviceInfoData, pInfo);
+
+        if (devicetimedout(portlist, pInfo)) {
+            return True;
+        }
+    }
+
+    if ((opt_flags & OPT_FLAG_VERBOSE) && (pInfo->bustype == PNP_BUS_USB)) {
+        getusblink(pDeviceInfoData->DevInst, pInfo);
+
+        if (devicetimedout(portlist, pInfo)) {
+            return True;
         }
     }
 
@@ -1113,131 +2735,762 @@ Bool getportpropstrings(unsigned opt_flags, HDEVINFO hDevInfo, SP_DEVINFO_DATA*
 }
 
 
-// compare portnames, eg COM5 and COM10 to create a stable & numerically sorted order
-int portcmp(PortInfo* p1, PortInfo* p2)
+// string property of a device node, for devices not in our device info set
+wchar_t* devnodestringproperty(DEVINST devinst, ULONG devprop)
 {
-    int res;
-    if (p1->prefixlen != p2->prefixlen) {
-        res = wcscmp(p1->portname, p2->portname);
-    } else {
-        res = wcsncmp(p1->portname, p2->portname, p1->prefixlen);
-        if (res == 0)
-            res = p1->portnumber - p2->portnumber;
+    wchar_t  buff[MAX_PATH];
+    ULONG    size = sizeof(buff);
+    ULONG    type = REG_NONE;
+    LONGLONG tracetime = tracebegin();
+    CONFIGRET result = CM_Get_DevNode_Registry_Property(devinst, devprop, &type, buff, &size, 0);
+
+    traceend(TRACE_DEVNODE, tracetime, devprop, size, result, NULL);
+    if ((result == CR_SUCCESS) && ((type == REG_SZ) || (type == REG_MULTI_SZ))) {
+        return wcs_dupsubstr(buff, size / sizeof(wchar_t));
     }
-
-    return res;
+    return NULL;
 }
 
 
-Bool getdeviceinfo(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData)
+/*
+    Where the port is in the USB (or PCI) device tree. Ports created by
+    a driver such as FTDIBUS are children of the USB device, so the USB
+    location is read from the parent device when the port has none.
+ */
+void gettopology(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo)
 {
-    unsigned opt_flags = portlist->optFlags;
-    Bool success = False;
-    PortInfo* pInfo = getdevicesetupinfo(hDevInfo, pDeviceInfoData, opt_flags);
+    DEVINST parent = 0;
+    Bool    haveparent = (CM_Get_Parent(&parent, pDeviceInfoData->DevInst, 0) == CR_SUCCESS);
 
-    if (pInfo) {
-        // extract prefix and port number for port name sorting
-        pInfo->prefixlen = wcscspn(pInfo->portname, L"0123456789");
-        if (pInfo->prefixlen != wcslen(pInfo->portname)) {
-            wchar_t* end;
+    if (haveparent) {
+        wchar_t  parentid[MAX_DEVICE_ID_LEN];
+        wchar_t* service;
 
-            pInfo->portnumber = wcstoul(pInfo->portname + pInfo->prefixlen, &end, 10);
+        if (CM_Get_Device_ID(parent, parentid, MAX_DEVICE_ID_LEN, 0) == CR_SUCCESS) {
+            pInfo->parentid = wcs_dupsubstr(parentid, MAX_DEVICE_ID_LEN);
         }
 
-        if ((opt_flags & (OPT_FLAG_EXCLUDE_COM | OPT_FLAG_EXCLUDE_LPT)) && (3 == pInfo->prefixlen)) {
-            // use port name to distinguish COM & LPT ports
-            Bool is_com_port = (0 == wcscmp(pInfo->portname, L"AUX")) ||
-                (pInfo->portnumber && (0 == wcsncmp(pInfo->portname, L"COM", 3)));
-
-            if (opt_flags & OPT_FLAG_EXCLUDE_COM) {
-                // exclude AUX & COM ports
-                if (!is_com_port) {
-                    success = getportpropstrings(opt_flags, hDevInfo, pDeviceInfoData, pInfo);
-                }
-            } else { // OPT_FLAG_EXCLUDE_LPT - only AUX & COM ports
-                if (is_com_port) {
-                    success = getportpropstrings(opt_flags, hDevInfo, pDeviceInfoData, pInfo);
-                }
-            }
-        } else {
-            success = getportpropstrings(opt_flags, hDevInfo, pDeviceInfoData, pInfo);
-        }
+        // -siblings, the interfaces of a composite device share the parent, single devices share a hub
+        service = devnodestringproperty(parent, CM_DRP_SERVICE);
+        pInfo->isParentComposite = service && !wcsicmp(service, L"usbccgp");
+        free(service);
+    }
 
-        if (success && (opt_flags & OPT_FLAG_EXCLUDE_AVAILABLE) && pInfo->isAvailable) {
-            // device is available, but we've been requested to exclude available this time!
-            success = False;
-        }
+    // Location Path is Vista or later
+    pInfo->locationpath = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_LOCATION_PATHS);
+    if ((pInfo->locationpath == NULL) && haveparent) {
+        pInfo->locationpath = devnodestringproperty(parent, CM_DRP_LOCATION_PATHS);
+    }
 
-        if (success && (opt_flags & OPT_FLAG_MATCH_SPECIFIED)) {
-            success = checkpidandvidlists(portlist, pInfo);
+    if (pInfo->location == NULL) {
+        pInfo->location = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_LOCATION_INFORMATION);
+        if ((pInfo->location == NULL) && haveparent) {
+            pInfo->location = devnodestringproperty(parent, CM_DRP_LOCATION_INFORMATION);
         }
+    }
 
-        if (success) {
-            // sort by name
-            
-            if ((portlist->ports == NULL) || (portcmp(pInfo, portlist->ports) < 0)) {
-                // place at front of linked list
-                pInfo->next = portlist->ports;
-                portlist->ports = pInfo;
-            } else {
-                PortInfo* prev = portlist->ports;
-                PortInfo* next = prev->next;
-                while (next && (portcmp(pInfo, next) > 0)) {
-                    prev = next;
-                    next = next->next;
-                }
-                pInfo->next = next;
-                prev->next = pInfo;
-            }
-        } else {
-            // cleanup allocated strings & memory
-            free(pInfo->friendlyname);
-            free(pInfo->busname);
-            free(pInfo->product);
-            free(pInfo->vendor);
-            free(pInfo->portname);
-            free(pInfo->hardwareid);
-            free(pInfo->location);
-            free(pInfo->physdevobj);
-            free(pInfo->devclass);
-            free(pInfo->serialnumber);
+    // USB Location Info, eg Port_#0001.Hub_#0004
+    if (pInfo->location) {
+        wchar_t* str = pInfo->location;
 
-            free(pInfo);
+        if (wcs_istr_tou(&str, L"Port_#", &pInfo->hubport, 10)) {
+            pInfo->retrieved |= RETRIEVED_HUBPORT;
+        }
+        str = pInfo->location;
+        if (wcs_istr_tou(&str, L"Hub_#", &pInfo->hubnumber, 10)) {
+            pInfo->retrieved |= RETRIEVED_HUBNUMBER;
         }
     }
-
-    return success;
 }
 
 
-unsigned listdevices(PortList* portlist, HDEVINFO hDevInfo)
+/*
+    Negotiated speed & packet size of a USB adapter, and the hub, root hub &
+    host controller it is on. The USB device is the port's device node or an
+    ancestor, eg the composite device of an interface or the parent of an
+    FTDIBUS port.
+ */
+void getusblink(DEVINST devinst, PortInfo* pInfo)
 {
-    DWORD lastError = 0;
-    SP_DEVINFO_DATA DeviceInfoData;
-    DWORD dev;
-    unsigned portcount = 0;
+    wchar_t  id[MAX_DEVICE_ID_LEN];
+    DEVINST  device = devinst;
+    DEVINST  hub = 0;
+    DEVINST  root;
+    DEVINST  parent;
+    DEVINST  controller;
+    ULONG    hubport = 0;
+    ULONG    size = sizeof(hubport);
+    ULONG    type = REG_NONE;
+    unsigned level;
+    Bool     findtt;
+
+    for (level = 0; level < USB_ANCESTORS_MAX; level++) {
+        if (CM_Get_Device_ID(device, id, MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) {
+            return;
+        }
+        if (!wcs_icmpprefix(id, L"USB\\") && !wcsstr(id, L"&MI_")) {
+            break;
+        }
+        if (CM_Get_Parent(&device, device, 0) != CR_SUCCESS) {
+            return;
+        }
+    }
+    if ((level == USB_ANCESTORS_MAX) || (CM_Get_Parent(&hub, device, 0) != CR_SUCCESS) ||
+            (CM_Get_Device_ID(hub, id, MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS)) {
+        return;
+    }
 
-    ZeroMemory(&DeviceInfoData, sizeof(SP_DEVINFO_DATA));
-    DeviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+    // a USB device's address is its hub port number
+    if ((CM_Get_DevNode_Registry_Property(device, CM_DRP_ADDRESS, &type, &hubport, &size, 0) != CR_SUCCESS) ||
+            (type != REG_DWORD) || (hubport == 0)) {
+        return;
+    }
+    pInfo->usbhub = wcs_dupsubstr(id, MAX_DEVICE_ID_LEN);
+    if (!(pInfo->retrieved & RETRIEVED_HUBPORT)) {
+        pInfo->hubport = hubport;
+        pInfo->retrieved |= RETRIEVED_HUBPORT;
+    }
 
-    for (dev = 0; SetupDiEnumDeviceInfo(hDevInfo, dev, &DeviceInfoData); dev++)
-    {
-        if (getdeviceinfo(portlist, hDevInfo, &DeviceInfoData)) {
-            portcount ++;
+    getusbconnection(id, hubport, pInfo);
+
+    /*
+        Full & low speed traffic is translated by the first hub upstream
+        that is linked at high speed. USB 1.1 hubs have no translator, and
+        root hub ports are on the controller's own bus.
+     */
+    findtt = (pInfo->retrieved & RETRIEVED_USB_LINK) && (pInfo->usbspeed <= USB_SPEED_FULL);
+    for (root = hub, level = 0; level < USB_ANCESTORS_MAX; level++) {
+        if (CM_Get_Device_ID(root, id, MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) {
+            break;
         }
+        if (!wcs_icmpprefix(id, L"USB\\ROOT_HUB")) {
+            pInfo->usbroothub = wcs_dupsubstr(id, MAX_DEVICE_ID_LEN);
+            if (CM_Get_Parent(&controller, root, 0) == CR_SUCCESS) {
+                pInfo->usbcontroller = devnodestringproperty(controller, CM_DRP_DEVICEDESC);
+            }
+            break;
+        }
+        if (CM_Get_Parent(&parent, root, 0) != CR_SUCCESS) {
+            break;
+        }
+        if (findtt && (usbhubspeed(root, parent) == USB_SPEED_HIGH)) {
+            pInfo->usbtthub = wcs_dupsubstr(id, MAX_DEVICE_ID_LEN);
+            findtt = False;
+        }
+        root = parent;
     }
+}
 
-    lastError = GetLastError();
-    if (NO_ERROR !=lastError && ERROR_NO_MORE_ITEMS != lastError) {
-        // nothing more we can do here for error handling at the moment
-        errorprintf(L"unrecoverable error whilst fetching Device Info - 0x%X", lastError);
-    }
 
-    return portcount;
+// speed a hub is linked at, asked of its parent hub, USB_SPEEDS if unknown
+unsigned usbhubspeed(DEVINST hub, DEVINST parent)
+{
+    struct usbconnectioninfo info;
+    wchar_t  parentid[MAX_DEVICE_ID_LEN];
+    ULONG    hubport = 0;
+    ULONG    size = sizeof(hubport);
+    ULONG    type = REG_NONE;
+
+    if ((CM_Get_DevNode_Registry_Property(hub, CM_DRP_ADDRESS, &type, &hubport, &size, 0) != CR_SUCCESS) ||
+            (type != REG_DWORD) || (hubport == 0) ||
+            (CM_Get_Device_ID(parent, parentid, MAX_DEVICE_ID_LEN, 0) != CR_SUCCESS) ||
+            !queryusbconnection(parentid, hubport, &info)) {
+        return USB_SPEEDS;
+    }
+    return info.speed;
 }
 
 
-unsigned listclass(PortList* portlist, const GUID *guid)
+// ask the hub about the device on one of its ports
+Bool queryusbconnection(wchar_t* hubid, ULONG hubport, struct usbconnectioninfo* info)
+{
+    wchar_t*  paths;
+    ULONG     len = 0;
+    HANDLE    hub;
+    DWORD     bytes = 0;
+    Bool      ok;
+    LONGLONG  tracetime = tracebegin();
+
+    if ((CM_Get_Device_Interface_List_Size(&len, (LPGUID) &usbhubinterface, hubid,
+            CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS) || (len < 2)) {
+        return False;
+    }
+    paths = calloc(len, sizeof(wchar_t));
+    if ((paths == NULL) || (CM_Get_Device_Interface_List((LPGUID) &usbhubinterface, hubid, paths, len,
+            CM_GET_DEVICE_INTERFACE_LIST_PRESENT) != CR_SUCCESS)) {
+        free(paths);
+        return False;
+    }
+
+    // hubs only accept this ioctl on a handle opened for writing
+    hub = CreateFile(paths, GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    free(paths);
+    if (hub == INVALID_HANDLE_VALUE) {
+        return False;
+    }
+
+    memset(info, 0, sizeof(*info));
+    info->connectionindex = hubport;
+    ok = DeviceIoControl(hub, IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX, info, sizeof(*info), info,
+        sizeof(*info), &bytes, NULL) && (info->status == USB_DEVICE_CONNECTED) && (info->speed < USB_SPEEDS);
+    traceend(TRACE_USBHUB, tracetime, hubport, bytes, ok ? ERROR_SUCCESS : GetLastError(), hubid);
+    CloseHandle(hub);
+
+    return ok;
+}
+
+
+// link speed & packet size of the adapter on a hub port
+Bool getusbconnection(wchar_t* hubid, ULONG hubport, PortInfo* pInfo)
+{
+    struct usbconnectioninfo info;
+    ULONG     i;
+    unsigned  bulkmax = 0;
+
+    if (!queryusbconnection(hubid, hubport, &info)) {
+        return False;
+    }
+
+    // serial data goes through the bulk endpoints
+    for (i = 0; (i < info.openpipes) && (i < USB_PIPES_MAX); i++) {
+        const struct usbendpointdescriptor* ep = &info.pipes[i].endpoint;
+
+        if (((ep->bmAttributes & 3) == USB_ENDPOINT_BULK) && ((ep->wMaxPacketSize & 0x7FFu) > bulkmax)) {
+            bulkmax = ep->wMaxPacketSize & 0x7FFu;
+        }
+    }
+    if (bulkmax) {
+        pInfo->usbmaxpacket = bulkmax;
+    } else {
+        pInfo->usbmaxpacket = (info.speed == USB_SPEED_SUPER) ? 1u << (info.device.bMaxPacketSize0 & 15) :
+            info.device.bMaxPacketSize0;
+    }
+    pInfo->usbspeed = info.speed;
+    pInfo->retrieved |= RETRIEVED_USB_LINK;
+
+    return True;
+}
+
+
+/*
+    Most bulk bytes/s of each speed, from the USB 2.0 & 3.0 specs: 19 full
+    speed 64 byte packets per 1 ms frame, 13 high speed 512 byte packets per
+    125 us microframe, & about 80% of the 5 Gbit/s SuperSpeed line. Low
+    speed has no bulk endpoints, adapters use an 8 byte interrupt endpoint
+    every 10 ms.
+ */
+const double usbspeed_rates[USB_SPEEDS] = { 800.0, 1216000.0, 53248000.0, 400000000.0 };
+
+const wchar_t* usbspeed_names[USB_SPEEDS] = {
+    L"Low speed (1.5 Mbit/s)",
+    L"Full speed (12 Mbit/s)",
+    L"High speed (480 Mbit/s)",
+    L"SuperSpeed (5 Gbit/s)"
+};
+
+
+/*
+    The root hub bus an adapter's traffic is on. SuperSpeed has its own
+    lanes, separate from the root hub's USB 2.0 bus.
+ */
+unsigned usbbusspeed(const PortInfo* p)
+{
+    if (p->usbspeed == USB_SPEED_SUPER) {
+        return USB_SPEED_SUPER;
+    }
+    // USB\ROOT_HUB is a USB 1.1 controller, or the companion of a USB 2.0 one
+    if (!wcs_icmpprefix(p->usbroothub, L"USB\\ROOT_HUB20") || !wcs_icmpprefix(p->usbroothub, L"USB\\ROOT_HUB30") ||
+            !wcs_icmpprefix(p->usbroothub, L"USB\\ROOT_HUB31")) {
+        return USB_SPEED_HIGH;
+    }
+    return USB_SPEED_FULL;
+}
+
+
+unsigned usbbusadd(struct usbbus* buses, unsigned count, const wchar_t* id, const wchar_t* controller,
+    Bool isTranslated, unsigned speed, double demand)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        if ((buses[i].isTranslated == isTranslated) && (buses[i].speed == speed) && !wcsicmp(buses[i].id, id)) {
+            break;
+        }
+    }
+    if (i == count) {
+        memset(&buses[i], 0, sizeof(struct usbbus));
+        buses[i].id = id;
+        buses[i].controller = controller;
+        buses[i].isTranslated = isTranslated;
+        buses[i].speed = speed;
+        buses[i].capacity = usbspeed_rates[speed];
+        count++;
+    }
+
+    buses[i].demand += demand;
+    buses[i].count++;
+
+    return count;
+}
+
+
+/*
+    Group the adapters by root hub & bus speed, and full & low speed adapters
+    also by the hub whose transaction translator they share, then add up the bytes/s
+    each needs to send & receive at baud. buses needs room for 2 per port.
+    Returns the number of groups.
+ */
+unsigned usbbudget(PortInfo* ports, unsigned baud, struct usbbus* buses)
+{
+    const double demand = 2.0 * baud / 10.0;   // 10 bit times per byte, both directions
+    unsigned     count = 0;
+    PortInfo*    p;
+
+    for (p = ports; p; p = p->next) {
+        if (!(p->retrieved & RETRIEVED_USB_LINK) || (p->usbroothub == NULL)) {
+            continue;
+        }
+
+        count = usbbusadd(buses, count, p->usbroothub, p->usbcontroller, False, usbbusspeed(p), demand);
+        if (p->usbtthub) {
+            count = usbbusadd(buses, count, p->usbtthub, NULL, True, USB_SPEED_FULL, demand);
+        }
+    }
+
+    return count;
+}
+
+
+Bool usbbusover(const struct usbbus* bus)
+{
+    return bus->demand * 100.0 > bus->capacity * USB_BUDGET_PERCENT;
+}
+
+
+// -v summary of the bandwidth adapters need on each USB bus, with buses over budget flagged
+void printusbbudget(PortList* portlist)
+{
+    const unsigned  baud = portlist->baud ? portlist->baud : LOOPBACK_DEFAULT_BAUD;
+    struct usbbus*  buses;
+    unsigned        ports = 0;
+    unsigned        count;
+    unsigned        i;
+    PortInfo*       p;
+
+    for (p = portlist->ports; p; p = p->next) {
+        ports++;
+    }
+    buses = ports ? calloc(2 * ports, sizeof(struct usbbus)) : NULL;
+    if (buses == NULL) {
+        return;
+    }
+
+    count = usbbudget(portlist->ports, baud, buses);
+    if (count) {
+        wprintf(L"\nUSB bandwidth for adapters at %u baud, both directions:\n", baud);
+    }
+    for (i = 0; i < count; i++) {
+        const struct usbbus* bus = &buses[i];
+        const Bool           over = usbbusover(bus);
+
+        if (bus->isTranslated) {
+            wprintf(L"%s Full speed transaction translator of hub %s\n", over ? L"OVER" : L"  ok", bus->id);
+        } else {
+            wprintf(L"%s Root hub %s, %s\n", over ? L"OVER" : L"  ok", bus->id, usbspeed_names[bus->speed]);
+        }
+        if (bus->controller) {
+            wprintf(L"     %s\n", bus->controller);
+        }
+        wprintf(L"     %u adapter%s need %.0f of %.0f KB/s (%.0f%%):", bus->count, (bus->count != 1) ? L"s" : L"",
+            bus->demand / 1000.0, bus->capacity / 1000.0, bus->demand * 100.0 / bus->capacity);
+        for (p = portlist->ports; p; p = p->next) {
+            if (!(p->retrieved & RETRIEVED_USB_LINK) || (p->usbroothub == NULL)) {
+                continue;
+            }
+            if (bus->isTranslated ? (p->usbtthub && !wcsicmp(p->usbtthub, bus->id)) :
+                    ((usbbusspeed(p) == bus->speed) && !wcsicmp(p->usbroothub, bus->id))) {
+                wprintf(L" %s", p->portname);
+            }
+        }
+        wprintf(L"\n");
+    }
+
+    free(buses);
+}
+
+
+// compare portnames, eg COM5 and COM10 to create a stable & numerically sorted order
+int portcmp(PortInfo* p1, PortInfo* p2)
+{
+    int res;
+    if (p1->prefixlen != p2->prefixlen) {
+        res = wcscmp(p1->portname, p2->portname);
+    } else {
+        res = wcsncmp(p1->portname, p2->portname, p1->prefixlen);
+        if (res == 0)
+            res = p1->portnumber - p2->portnumber;
+    }
+
+    return res;
+}
+
+
+// use port name to distinguish COM & LPT ports
+Bool iscomport(PortInfo* pInfo)
+{
+    return (0 == wcscmp(pInfo->portname, L"AUX")) ||
+        (pInfo->portnumber && (0 == wcsncmp(pInfo->portname, L"COM", 3)));
+}
+
+
+// extract prefix and port number for port name sorting
+void setportsortkey(PortInfo* pInfo)
+{
+    pInfo->prefixlen = wcscspn(pInfo->portname, L"0123456789");
+    if (pInfo->prefixlen != wcslen(pInfo->portname)) {
+        wchar_t* end;
+
+        pInfo->portnumber = wcstoul(pInfo->portname + pInfo->prefixlen, &end, 10);
+    }
+}
+
+
+// insert into linked list, sorted by name
+void portlistinsert(PortInfo** pList, PortInfo* pInfo)
+{
+    if ((*pList == NULL) || (portcmp(pInfo, *pList) < 0)) {
+        // place at front of linked list
+        pInfo->next = *pList;
+        *pList = pInfo;
+    } else {
+        PortInfo* prev = *pList;
+        PortInfo* next = prev->next;
+        while (next && (portcmp(pInfo, next) > 0)) {
+            prev = next;
+            next = next->next;
+        }
+        pInfo->next = next;
+        prev->next = pInfo;
+    }
+}
+
+
+// cleanup allocated strings & memory
+void freeportinfo(PortInfo* pInfo)
+{
+    free(pInfo->friendlyname);
+    free(pInfo->busname);
+    free(pInfo->product);
+    free(pInfo->vendor);
+    free(pInfo->portname);
+    free(pInfo->hardwareid);
+    free(pInfo->location);
+    free(pInfo->physdevobj);
+    free(pInfo->devclass);
+    free(pInfo->serialnumber);
+    free(pInfo->parentid);
+    free(pInfo->locationpath);
+    free(pInfo->ownername);
+    free(pInfo->usbhub);
+    free(pInfo->usbtthub);
+    free(pInfo->usbroothub);
+    free(pInfo->usbcontroller);
+
+    free(pInfo);
+}
+
+
+void freeportlist(PortInfo* ports)
+{
+    while (ports) {
+        PortInfo* next = ports->next;
+
+        freeportinfo(ports);
+        ports = next;
+    }
+}
+
+
+/*
+    Add an accepted port to the list, and report it if enumerating asynchronously.
+    With -stream the port is printed straight away and freed, so no list is kept.
+ */
+void portfound(PortList* portlist, PortInfo* pInfo)
+{
+    if (portlist->optFlags & OPT_FLAG_STREAM) {
+        if (portlist->onportfound) {
+            portlist->onportfound(portlist->context, pInfo);
+        }
+
+        // the lock keeps a -timeout worker quiet once its ports have been counted
+        if (portlist->listlock) {
+            EnterCriticalSection(portlist->listlock);
+        }
+        if (!portlist->cancel) {
+            if ((portlist->optFlags & OPT_FLAG_VERBOSE) && portlist->streamed) {
+                wprintf(L"\n");
+            }
+            printport(portlist->optFlags, pInfo);
+            fflush(stdout);
+            portlist->streamed++;
+        }
+        if (portlist->listlock) {
+            LeaveCriticalSection(portlist->listlock);
+        }
+
+        freeportinfo(pInfo);
+        return;
+    }
+
+    if (portlist->listlock) {
+        EnterCriticalSection(portlist->listlock);
+        portlistinsert(&portlist->ports, pInfo);
+        LeaveCriticalSection(portlist->listlock);
+    } else {
+        portlistinsert(&portlist->ports, pInfo);
+    }
+
+    // topology queries select from all the ports, so they are reported at the end
+    if (portlist->onportfound && !(portlist->optFlags & (OPT_FLAG_HUBQUERY | OPT_FLAG_SIBLINGQUERY))) {
+        portlist->onportfound(portlist->context, pInfo);
+    }
+}
+
+
+/*
+    Apply the user's port filters to already retrieved port info.
+    getdeviceinfo() applies the same tests as the info is retrieved,
+    -fleet uses this for ports loaded from snapshots.
+ */
+Bool checkportfilters(PortList* portlist, PortInfo* pInfo)
+{
+    const unsigned opt_flags = portlist->optFlags;
+
+    if ((opt_flags & (OPT_FLAG_EXCLUDE_COM | OPT_FLAG_EXCLUDE_LPT)) && (3 == pInfo->prefixlen)) {
+        Bool is_com_port = iscomport(pInfo);
+
+        if ((opt_flags & OPT_FLAG_EXCLUDE_COM) ? is_com_port : !is_com_port) {
+            return False;
+        }
+    }
+
+    if (pInfo->isAvailable ? (opt_flags & OPT_FLAG_EXCLUDE_AVAILABLE) : !(opt_flags & OPT_FLAG_ALL)) {
+        return False;
+    }
+
+    if ((opt_flags & OPT_FLAG_SERIALMATCH) &&
+            ((pInfo->serialnumber == NULL) || wcsicmp(pInfo->serialnumber, portlist->serialmatch))) {
+        return False;
+    }
+
+    if ((opt_flags & OPT_FLAG_PORTLOOKUP) && wcsicmp(pInfo->portname, portlist->portmatch)) {
+        return False;
+    }
+
+    if (opt_flags & OPT_FLAG_MATCH_SPECIFIED) {
+        return checkpidandvidlists(portlist, pInfo);
+    }
+
+    return True;
+}
+
+
+/*
+    -set-low-latency: FTDI's driver waits up to LatencyTimer ms (default 16)
+    before passing a part filled USB packet on, which adds to every round
+    trip. The value is in the port's device key, and is read when the device
+    starts, so the device is restarted once the value is changed. Other USB
+    serial drivers, eg CP210x & usbser, have no such timer.
+ */
+#define LOW_LATENCY_TIMER_MS    1
+
+Bool setlowlatency(HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData, PortInfo* pInfo)
+{
+    const DWORD          value = LOW_LATENCY_TIMER_MS;
+    SP_PROPCHANGE_PARAMS params;
+    SP_DEVINSTALL_PARAMS install;
+    HKEY                 devkey;
+    LSTATUS              status;
+
+    if (!(pInfo->retrieved & RETRIEVED_LATENCYTIMER) || (pInfo->latencytimer <= LOW_LATENCY_TIMER_MS)) {
+        return False; // not an FTDI port, or already low latency
+    }
+
+    devkey = SetupDiOpenDevRegKey(hDevInfo, pDeviceInfoData, DICS_FLAG_GLOBAL, 0, DIREG_DEV, KEY_SET_VALUE);
+    if (devkey == INVALID_HANDLE_VALUE) {
+        errorprintf(L"%s: could not open device key to set latency timer - error %#X, run as Administrator",
+            pInfo->portname, GetLastError());
+        return False;
+    }
+    status = RegSetValueEx(devkey, L"LatencyTimer", 0, REG_DWORD, (const BYTE*) &value, sizeof(DWORD));
+    RegCloseKey(devkey);
+    if (status != ERROR_SUCCESS) {
+        errorprintf(L"%s: could not set latency timer - error %#X, run as Administrator", pInfo->portname, status);
+        return False;
+    }
+    pInfo->latencytimer = value;
+    pInfo->isLatencySet = True;
+
+    // remembered ports pick up the value when next connected
+    if (!pInfo->isAvailable) {
+        return True;
+    }
+
+    params.ClassInstallHeader.cbSize = sizeof(SP_CLASSINSTALL_HEADER);
+    params.ClassInstallHeader.InstallFunction = DIF_PROPERTYCHANGE;
+    params.StateChange = DICS_PROPCHANGE;
+    params.Scope = DICS_FLAG_GLOBAL;
+    params.HwProfile = 0;
+    install.cbSize = sizeof(SP_DEVINSTALL_PARAMS);
+
+    if (!SetupDiSetClassInstallParams(hDevInfo, pDeviceInfoData, &params.ClassInstallHeader, sizeof(params)) ||
+            !SetupDiCallClassInstaller(DIF_PROPERTYCHANGE, hDevInfo, pDeviceInfoData)) {
+        errorprintf(L"%s: latency timer is set, reconnect the device to use it - error %#X", pInfo->portname, GetLastError());
+    } else if (SetupDiGetDeviceInstallParams(hDevInfo, pDeviceInfoData, &install) &&
+            (install.Flags & (DI_NEEDRESTART | DI_NEEDREBOOT))) {
+        // the port is open, so the device could not be restarted
+        errorprintf(L"%s: latency timer is set, close the port & reconnect the device to use it", pInfo->portname);
+    }
+
+    return True;
+}
+
+
+Bool getdeviceinfo(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData)
+{
+    unsigned opt_flags = portlist->optFlags;
+    Bool success = False;
+    PortInfo* pInfo;
+    struct devicecost cost;
+    LONGLONG costStart = 0;
+
+    if (portlist->slowest) {
+        memset(&cost, 0, sizeof(cost));
+        profiling = &cost;
+        costStart = tracebegin();
+    }
+
+    portlist->devdeadline = deadlineafter(portlist->devtimeout);
+    pInfo = getdevicesetupinfo(portlist, hDevInfo, pDeviceInfoData);
+    if (pInfo) {
+        traceport(pInfo->portname);
+    }
+
+    if (pInfo) {
+        setportsortkey(pInfo);
+
+        if ((opt_flags & (OPT_FLAG_EXCLUDE_COM | OPT_FLAG_EXCLUDE_LPT)) && (3 == pInfo->prefixlen)) {
+            Bool is_com_port = iscomport(pInfo);
+
+            if (opt_flags & OPT_FLAG_EXCLUDE_COM) {
+                // exclude AUX & COM ports
+                if (!is_com_port) {
+                    success = getportpropstrings(portlist, hDevInfo, pDeviceInfoData, pInfo);
+                }
+            } else { // OPT_FLAG_EXCLUDE_LPT - only AUX & COM ports
+                if (is_com_port) {
+                    success = getportpropstrings(portlist, hDevInfo, pDeviceInfoData, pInfo);
+                }
+            }
+        } else {
+            success = getportpropstrings(portlist, hDevInfo, pDeviceInfoData, pInfo);
+        }
+
+        if (success && (opt_flags & OPT_FLAG_EXCLUDE_AVAILABLE) && pInfo->isAvailable &&
+                !(opt_flags & OPT_FLAG_HISTORY)) {
+            // device is available, but we've been requested to exclude available this time!
+            // (-history logs it first, listports() drops it after)
+            success = False;
+        }
+
+        if (success && (opt_flags & OPT_FLAG_SERIALMATCH)) {
+            success = (pInfo->serialnumber != NULL) && !wcsicmp(pInfo->serialnumber, portlist->serialmatch);
+        }
+
+        if (success && (opt_flags & OPT_FLAG_MATCH_SPECIFIED)) {
+            success = checkpidandvidlists(portlist, pInfo);
+        }
+    }
+
+    if (profiling) {
+        recorddevicecost(portlist, hDevInfo, pDeviceInfoData, pInfo, &cost, costStart);
+    }
+
+    if (pInfo) {
+        if (success) {
+            if ((opt_flags & OPT_FLAG_SET_LOW_LATENCY) && setlowlatency(hDevInfo, pDeviceInfoData, pInfo)) {
+                portlist->latencyset++;
+            }
+            portfound(portlist, pInfo);
+        } else {
+            freeportinfo(pInfo);
+        }
+    }
+
+    return success;
+}
+
+
+/*
+    Get info about each device in a set. If the set was made from several
+    classes, the time for each device is added to its class's phase. A
+    device has one setup class, so is only in the set once.
+ */
+unsigned listdevices(PortList* portlist, HDEVINFO hDevInfo, const struct portclass* classes, unsigned nclasses)
+{
+    DWORD lastError = 0;
+    SP_DEVINFO_DATA DeviceInfoData;
+    DWORD dev;
+    unsigned portcount = 0;
+    // -port= lookup of an available port can stop at the first match, names are unique
+    const Bool stopwhenfound = (portlist->optFlags & (OPT_FLAG_PORTLOOKUP | OPT_FLAG_ALL)) == OPT_FLAG_PORTLOOKUP;
+
+    ZeroMemory(&DeviceInfoData, sizeof(SP_DEVINFO_DATA));
+    DeviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+
+    for (dev = 0; !enumstopped(portlist) && SetupDiEnumDeviceInfo(hDevInfo, dev, &DeviceInfoData); dev++)
+    {
+        LONGLONG      tracetime;
+        LARGE_INTEGER start;
+        LARGE_INTEGER stop;
+        Bool          found;
+        unsigned      c;
+
+        QueryPerformanceCounter(&start);
+        tracetime = tracebegin();
+        traceport(NULL);
+        found = getdeviceinfo(portlist, hDevInfo, &DeviceInfoData);
+        traceend(TRACE_DEVICE, tracetime, dev, 0, found ? ERROR_SUCCESS : ERROR_NOT_FOUND, NULL);
+        traceport(NULL);
+        QueryPerformanceCounter(&stop);
+
+        for (c = 0; classes && (c < nclasses); c++) {
+            if (IsEqualGUID(&DeviceInfoData.ClassGuid, classes[c].guid)) {
+                portlist->stats.ticks[classes[c].phase] += stop.QuadPart - start.QuadPart;
+                break;
+            }
+        }
+
+        if (found) {
+            portcount ++;
+            if (stopwhenfound) {
+                return portcount;
+            }
+        }
+    }
+
+    lastError = GetLastError();
+    if (NO_ERROR !=lastError && ERROR_NO_MORE_ITEMS != lastError) {
+        // nothing more we can do here for error handling at the moment
+        errorprintf(L"unrecoverable error whilst fetching Device Info - 0x%X", lastError);
+        property_errors++;
+    }
+
+    return portcount;
+}
+
+
+unsigned listclass(PortList* portlist, const GUID *guid)
 {
     /*
        device interface GUIDs of interest to us include:
@@ -1246,175 +3499,6535 @@ unsigned listclass(PortList* portlist, const GUID *guid)
     */ 
     HDEVINFO hDevInfo = INVALID_HANDLE_VALUE;
     unsigned count = 0;
-    DWORD    devflags = (portlist->optFlags & OPT_FLAG_ALL) ? 0 : DIGCF_PRESENT;
+    DWORD    devflags = (portlist->optFlags & OPT_FLAG_ALL) ? 0 : DIGCF_PRESENT;
+
+    /* Create a HDEVINFO with devices matching GUID & user choise of -a or -p
+     * MSDN example code I've seen for this API includes DIGCF_DEVICEINTERFACE,
+     * but for me this stops any COM ports from being found.
+     */
+    hDevInfo = SetupDiGetClassDevs(guid, 0, 0, devflags);
+
+    if (hDevInfo == INVALID_HANDLE_VALUE)
+    {
+        // unrecoverable error
+        wchar_t guid_string[40];
+        swprintf(guid_string, sizeof(guid_string) / sizeof(wchar_t),
+            L"{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+            guid->Data1, guid->Data2, guid->Data3,
+            guid->Data4[0], guid->Data4[1], guid->Data4[2],
+            guid->Data4[3], guid->Data4[4], guid->Data4[5],
+            guid->Data4[6], guid->Data4[7]);
+
+        errorprintf(L"error calling SetupDiGetClassDevs with %s - 0x%X", guid_string, GetLastError());
+        exit(-1);
+    } else {
+        // Enumerate through all devices in Set
+        count = listdevices(portlist, hDevInfo, NULL, 0);
+        
+        //  Cleanup
+        SetupDiDestroyDeviceInfoList(hDevInfo);
+    }
+
+    return count;
+}
+
+
+/*
+    One device set for several classes: each class's devices are added to
+    the same set, so there is one set to build, walk & destroy rather than
+    one per class. Asking for each class, rather than for all classes and
+    filtering, keeps the set to the few devices that can have ports.
+ */
+HDEVINFO portclassdevices(PortList* portlist, const struct portclass* classes, unsigned nclasses)
+{
+    DWORD    devflags = (portlist->optFlags & OPT_FLAG_ALL) ? 0 : DIGCF_PRESENT;
+    HDEVINFO hDevInfo = SetupDiCreateDeviceInfoList(NULL, NULL);
+    unsigned c;
+
+    if (hDevInfo == INVALID_HANDLE_VALUE) {
+        return INVALID_HANDLE_VALUE;
+    }
+
+    for (c = 0; c < nclasses; c++) {
+        LARGE_INTEGER start;
+        LARGE_INTEGER stop;
+
+        QueryPerformanceCounter(&start);
+        if (SetupDiGetClassDevsEx(classes[c].guid, NULL, NULL, devflags, hDevInfo, NULL, NULL) == INVALID_HANDLE_VALUE) {
+            errorprintf(L"error calling SetupDiGetClassDevsEx for %S class - 0x%X",
+                enumphase_names[classes[c].phase], GetLastError());
+            property_errors++;
+        }
+        QueryPerformanceCounter(&stop);
+        portlist->stats.ticks[classes[c].phase] += stop.QuadPart - start.QuadPart;
+    }
+
+    return hDevInfo;
+}
+
+
+unsigned listclasses(PortList* portlist, const struct portclass* classes, unsigned nclasses)
+{
+    HDEVINFO      hDevInfo;
+    LARGE_INTEGER start;
+    unsigned      count;
+
+    if (enumstopped(portlist)) {
+        return 0;
+    }
+
+    QueryPerformanceCounter(&start);
+    hDevInfo = portclassdevices(portlist, classes, nclasses);
+    if (hDevInfo == INVALID_HANDLE_VALUE) {
+        // unrecoverable error
+        errorprintf(L"error calling SetupDiCreateDeviceInfoList - 0x%X", GetLastError());
+        exit(-1);
+    }
+
+    count = listdevices(portlist, hDevInfo, classes, nclasses);
+    SetupDiDestroyDeviceInfoList(hDevInfo);
+
+    if (tracing) {
+        traceend(TRACE_LISTCLASS, start.QuadPart, ENUM_PHASE_TOTAL, count, ERROR_SUCCESS,
+            (nclasses > 1) ? L"all" : L"ports");
+    }
+    return count;
+}
+
+
+/*
+    Quick check that a port is available, by looking up its MS-DOS device name
+    (eg COM7 -> \Device\USBSER000) rather than enumerating devices.
+ */
+Bool portexists(const wchar_t* portname)
+{
+    wchar_t target[MAX_PATH];
+
+    return QueryDosDevice(portname, target, MAX_PATH) != 0;
+}
+
+
+/*
+    -n fast path: Windows keeps maps of the names of available serial and
+    parallel ports under HKLM\HARDWARE\DEVICEMAP. One pass over the values
+    of a key is much cheaper than SetupAPI device enumeration.
+ */
+unsigned listdevicemapnames(PortList* portlist, const wchar_t* keyname)
+{
+    HKEY     hKey;
+    DWORD    idx;
+    unsigned count = 0;
+
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, keyname, 0, KEY_QUERY_VALUE, &hKey) != ERROR_SUCCESS) {
+        return 0; // the key only exists once a port of that type has been seen
+    }
+
+    for (idx = 0; ; idx++) {
+        wchar_t   valuename[MAX_PATH];
+        DWORD     namelen = MAX_PATH;
+        wchar_t   data[MAX_PATH];
+        DWORD     datasize = sizeof(data);
+        DWORD     type = 0;
+        wchar_t*  name = data;
+        PortInfo* pInfo;
+        LSTATUS   result = RegEnumValue(hKey, idx, valuename, &namelen, NULL, &type, (LPBYTE) data, &datasize);
+
+        if (result == ERROR_NO_MORE_ITEMS) {
+            break;
+        }
+        if ((result != ERROR_SUCCESS) || (type != REG_SZ)) {
+            continue;
+        }
+
+        // registry strings need not be terminated
+        data[(datasize / sizeof(wchar_t) < MAX_PATH) ? (datasize / sizeof(wchar_t)) : (MAX_PATH - 1)] = L'\0';
+
+        // SERIALCOMM values are eg "COM3", PARALLEL PORTS are eg "\DosDevices\LPT1"
+        if (!wcs_icmpprefix(name, L"\\DosDevices\\")) {
+            name += 12;
+            datasize -= 12 * sizeof(wchar_t);
+        }
+
+        pInfo = (PortInfo*) calloc(1, sizeof(PortInfo));
+        if (pInfo == NULL) {
+            break;
+        }
+        pInfo->portname = wcs_dupsubstr(name, datasize / sizeof(wchar_t));
+        pInfo->isAvailable = True;
+
+        if (pInfo->portname) {
+            setportsortkey(pInfo);
+        }
+
+        if (pInfo->portname && checkportfilters(portlist, pInfo)) {
+            portfound(portlist, pInfo);
+            count++;
+        } else {
+            freeportinfo(pInfo);
+        }
+    }
+
+    RegCloseKey(hKey);
+    return count;
+}
+
+
+// -owner column, eg "putty.exe (1234)", blank if the port is not open
+void printowner(PortInfo* p)
+{
+    wchar_t label[64] = L"";
+
+    if (p->ownerpid) {
+        _snwprintf(label, 63, L"%s (%lu)", p->ownername ? p->ownername : L"?", p->ownerpid);
+        label[63] = L'\0';
+    }
+    wprintf(L"%-24s ", label);
+}
+
+
+// column headings, optionally preceded by a heading for the -fleet Host column
+void printheader(unsigned opt_flags, const wchar_t* hostcolumn)
+{
+    if (hostcolumn) {
+        wprintf(L"%-16s ", hostcolumn);
+    }
+
+    if (opt_flags & OPT_FLAG_LONGFORM) {
+        wprintf(L"Port   %sVID  PID  Rev  %sFriendly name\n",
+            opt_flags & (OPT_FLAG_ALL | OPT_FLAG_VERBOSE) ? L"A " : L"",
+            opt_flags & OPT_FLAG_OWNER ? L"Owner                    " : L"");
+    } else {
+        wprintf(L"Port   %s%sFriendly name\n", opt_flags & OPT_FLAG_ALL ? L"A " : L"",
+            opt_flags & OPT_FLAG_OWNER ? L"Owner                    " : L"");
+    }
+}
+
+
+// print details of one port, a single line or multiple lines in verbose mode
+void printport(unsigned opt_flags, PortInfo* p)
+{
+    if (opt_flags & OPT_FLAG_NAMESONLY) {
+        wprintf(L"%s\n", p->portname);
+    } else if (opt_flags & OPT_FLAG_LONGFORM) {
+        wprintf(L"%-6s ", p->portname);
+
+        // device availability only for Verbose or All listings
+        if (opt_flags & (OPT_FLAG_ALL | OPT_FLAG_VERBOSE) ) {
+            wprintf(p->isAvailable ? L"A " : L". ");
+        }
+
+        if (p->haveUSBid || p->havePCIid) {
+            const wchar_t* fmt_4hex = L"%04lX ";
+            const wchar_t* spaces5  = L"     ";
+
+            // at least Vendor Id & Product Id were extracted
+            wprintf(fmt_4hex, p->vendorId);
+            wprintf(fmt_4hex, p->productId);
+            wprintf(p->retrieved & RETRIEVED_USB_REV ? fmt_4hex : spaces5, p->revision);
+        } else {
+            wprintf(L"               ");
+        }
+
+        if (opt_flags & OPT_FLAG_OWNER) {
+            printowner(p);
+        }
+
+        if (p->friendlyname) {
+            wprintf(p->isIncomplete ? L"%s (incomplete)\n" : L"%s\n", p->friendlyname);
+        } else {
+            wprintf(p->isIncomplete ? L"(incomplete)\n" : L"\n");
+        }
+
+        // extra info for verbose mode
+        if (opt_flags & OPT_FLAG_VERBOSE) {
+            wchar_t* indent = L"         ";
+
+            if (p->vendor) {
+                wprintf(L"%sVendor: %s\n", indent, p->vendor);
+            }
+            if (p->product) {
+                wprintf(L"%sProduct: %s\n", indent, p->product);
+            }
+
+            if(p->busname) {
+                wprintf(L"%sBus: %s\n", indent, p->busname);
+            }
+
+            // details specific to underlying bus
+            if (p->haveUSBid) {
+                wprintf(L"%sUSB VendorId 0x%04lX, ProductId 0x%04lX", indent, p->vendorId, p->productId);
+                wprintf( p->retrieved & RETRIEVED_USB_REV ? L", Revision 0x%04lX\n" : L"\n", p->revision);
+                if (p->retrieved & RETRIEVED_USB_MI) {
+                    wprintf(L"%sUSB Interface %lu of composite device\n", indent, p->usbInterface);
+                }
+            } else if (p->havePCIid) {
+                wprintf(L"%sPCI VendorId 0x%04lX, DeviceId 0x%04lX\n", indent, p->vendorId, p->productId);
+                wprintf(L"%sPCI SubSystem VendorId 0x%04lX, DeviceId 0x%04lX, Revision 0x%02lX\n",
+                    indent, p->pciSubsys >> 16, p->pciSubsys & 0xFFFFL, p->revision);
+            }
+
+            if (p->serialnumber) {
+                wprintf(L"%s%s Serial number: %s\n", indent, 
+                    p->isWinSerial ? L"Windows generated" : L"Device",  p->serialnumber);
+            }
+            if (p->devclass) {
+                wprintf(L"%sDevice Class: %s\n", indent, p->devclass);
+            }
+            if (p->hardwareid) {
+                wprintf(L"%sHardware Id: %s\n", indent, p->hardwareid);
+            }
+            if (p->physdevobj) {
+                wprintf(L"%sPhysical Device Object: %s\n", indent, p->physdevobj);
+            }
+            if (p->location) {
+                wprintf(L"%sLocation Info: %s\n", indent, p->location);
+            }
+            if (p->locationpath) {
+                wprintf(L"%sLocation Path: %s\n", indent, p->locationpath);
+            }
+            if (p->parentid) {
+                wprintf(L"%sParent Device: %s\n", indent, p->parentid);
+            }
+            if (p->retrieved & RETRIEVED_USB_LINK) {
+                wprintf(L"%sUSB link: %s, max packet size %u bytes\n", indent, usbspeed_names[p->usbspeed],
+                    p->usbmaxpacket);
+            }
+            if (p->usbhub) {
+                wprintf(L"%sUSB hub: %s, port %u\n", indent, p->usbhub, p->hubport);
+            }
+            if (p->usbtthub) {
+                wprintf(L"%sUSB transaction translator: %s\n", indent, p->usbtthub);
+            }
+            if (p->usbroothub) {
+                wprintf(p->usbcontroller ? L"%sUSB root hub: %s, on %s\n" : L"%sUSB root hub: %s\n", indent,
+                    p->usbroothub, p->usbcontroller);
+            }
+            if (p->isIncomplete) {
+                wprintf(L"%sIncomplete: device did not respond within -devtimeout\n", indent);
+            }
+            if (p->retrieved & RETRIEVED_LATENCYTIMER) {
+                wprintf(p->isLatencySet ? L"%sLatency timer: %lu ms, set by -set-low-latency\n" :
+                    L"%sLatency timer: %lu ms\n", indent, p->latencytimer);
+            }
+            if (p->ownerpid) {
+                wprintf(L"%sOpened by: %s, process id %lu\n", indent,
+                    p->ownername ? p->ownername : L"unknown program", p->ownerpid);
+            }
+            if (p->lastseen) {
+                FILETIME   utc;
+                FILETIME   local;
+                SYSTEMTIME st;
+
+                utc.dwLowDateTime = (DWORD) p->lastseen;
+                utc.dwHighDateTime = (DWORD) (p->lastseen >> 32);
+                if (FileTimeToLocalFileTime(&utc, &local) && FileTimeToSystemTime(&local, &st)) {
+                    wprintf(L"%sRemembered, last seen: %04u-%02u-%02u %02u:%02u\n", indent,
+                        st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute);
+                }
+            }
+
+            // ISA legacy hardware port
+            if ((p->retrieved & (RETRIEVED_PORTADDRESS | RETRIEVED_INTERRUPT)) == (RETRIEVED_PORTADDRESS | RETRIEVED_INTERRUPT)) {
+                wprintf(L"%sLegacy port -- address %04lX, interrupt %lu\n", indent, p->portaddress, p->interrupt);
+            }
+
+            // multiport device
+            if ((p->retrieved & (RETRIEVED_PORTINDEX | RETRIEVED_INDEXED)) == (RETRIEVED_PORTINDEX | RETRIEVED_INDEXED)) {
+                wprintf(L"%sMulti-port device -- port ", indent);
+                    
+                wprintf(p->indexed ? L"index %lu\n" : L"%bitmap 0x%04lX\n", p->portindex);
+            }
+        }
+    } else {
+        wprintf(L"%-6s ", p->portname);
+
+        if (opt_flags & OPT_FLAG_ALL) {
+            wprintf(p->isAvailable ? L"A " : L". ");
+        }
+
+        if (opt_flags & OPT_FLAG_OWNER) {
+            printowner(p);
+        }
+
+        if (p->friendlyname) {
+            wprintf(p->isIncomplete ? L"%s (incomplete)\n" : L"%s\n", p->friendlyname);
+        } else {
+            wprintf(p->isIncomplete ? L"(incomplete)\n" : L"\n");
+        }
+    }
+}
+
+
+void printfooter(unsigned opt_flags, unsigned count)
+{
+    wprintf(L"\n%u %sport%s found.\n", count, 
+        (opt_flags & OPT_FLAG_FILTER_SPECIFIED) ? L"matching " : L"",
+        (count != 1) ? L"s" : L"");
+}
+
+
+// case insensitive FNV-1a hash of topology index key
+unsigned topohash(enum topokey kind, const wchar_t* key, size_t keylen, unsigned number)
+{
+    unsigned hash = 2166136261u ^ (unsigned) kind;
+    size_t   i;
+
+    hash = (hash ^ number) * 16777619u;
+    for (i = 0; i < keylen; i++) {
+        hash = (hash ^ (unsigned) towupper(key[i])) * 16777619u;
+    }
+    return hash % TOPO_BUCKETS;
+}
+
+
+void topoadd(struct topoindex* index, enum topokey kind, const wchar_t* key, size_t keylen, unsigned number, PortInfo* port)
+{
+    struct toponode* node;
+    unsigned         bucket;
+
+    if (index->count == index->max) {
+        return; // topobuild() sizes the node block, so should not happen
+    }
+
+    node = &index->nodes[index->count++];
+    node->kind = kind;
+    node->key = key;
+    node->keylen = keylen;
+    node->number = number;
+    node->port = port;
+
+    bucket = topohash(kind, key, keylen, number);
+    node->next = index->buckets[bucket];
+    index->buckets[bucket] = node;
+}
+
+
+void topobuild(struct topoindex* index, PortInfo* ports)
+{
+    PortInfo* p;
+    unsigned  nodes = 0;
+
+    memset(index, 0, sizeof(struct topoindex));
+
+    // count nodes needed: hub, parent and one per location path component
+    for (p = ports; p; p = p->next) {
+        const wchar_t* c;
+
+        nodes += 2;
+        for (c = p->locationpath; c && *c; c++) {
+            nodes += (*c == L'#') ? 1 : 0;
+        }
+        nodes += p->locationpath ? 1 : 0;
+    }
+
+    index->nodes = (struct toponode*) calloc(nodes ? nodes : 1, sizeof(struct toponode));
+    if (index->nodes == NULL) {
+        errorprint(L"topobuild(): memory allocation failed");
+        exit(-1);
+    }
+    index->max = nodes;
+
+    for (p = ports; p; p = p->next) {
+        if (p->retrieved & RETRIEVED_HUBNUMBER) {
+            topoadd(index, TOPO_KEY_HUB, NULL, 0, p->hubnumber, p);
+        }
+        if (p->parentid) {
+            topoadd(index, TOPO_KEY_PARENT, p->parentid, wcslen(p->parentid), 0, p);
+        }
+        if (p->locationpath) {
+            const wchar_t* c;
+
+            for (c = p->locationpath; ; c++) {
+                if ((*c == L'#') || (*c == L'\0')) {
+                    topoadd(index, TOPO_KEY_PATH, p->locationpath, c - p->locationpath, 0, p);
+                }
+                if (*c == L'\0') {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+
+// mark ports matching the key as selected, returns count
+unsigned toposelect(struct topoindex* index, enum topokey kind, const wchar_t* key, size_t keylen, unsigned number)
+{
+    struct toponode* node = index->buckets[topohash(kind, key, keylen, number)];
+    unsigned         count = 0;
+
+    for (; node; node = node->next) {
+        if ((node->kind == kind) && (node->number == number) && (node->keylen == keylen) &&
+                ((keylen == 0) || !wcsnicmp(node->key, key, keylen))) {
+            if (!node->port->isSelected) {
+                node->port->isSelected = True;
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+
+// apply -hub= & -siblings= queries, discards ports that do not match
+unsigned topoquery(PortList* portlist)
+{
+    const unsigned   opt_flags = portlist->optFlags;
+    struct topoindex index;
+    PortInfo**       link;
+    unsigned         count = 0;
+
+    topobuild(&index, portlist->ports);
+
+    if (opt_flags & OPT_FLAG_HUBQUERY) {
+        const wchar_t* str = portlist->hubmatch;
+        wchar_t*       end;
+        unsigned long  hub = wcstoul(str, &end, 10);
+
+        if ((end != str) && (*end == L'\0')) {
+            count += toposelect(&index, TOPO_KEY_HUB, NULL, 0, (unsigned) hub);
+        } else {
+            // location path, ignore any trailing separator
+            size_t len = wcslen(str);
+
+            if ((len > 0) && (str[len - 1] == L'#')) {
+                len--;
+            }
+            count += toposelect(&index, TOPO_KEY_PATH, str, len, 0);
+        }
+    }
+
+    if (opt_flags & OPT_FLAG_SIBLINGQUERY) {
+        PortInfo* p;
+
+        for (p = portlist->ports; p; p = p->next) {
+            if (wcsicmp(p->portname, portlist->siblingmatch)) {
+                continue;
+            }
+            // only an interface of a composite device has siblings, else the parent is the hub
+            if (p->parentid && ((p->retrieved & RETRIEVED_USB_MI) || p->isParentComposite)) {
+                count += toposelect(&index, TOPO_KEY_PARENT, p->parentid, wcslen(p->parentid), 0);
+            } else if (!p->isSelected) {
+                p->isSelected = True;
+                count++;
+            }
+        }
+    }
+
+    free(index.nodes);
+
+    // unlink & free ports that were not selected
+    for (link = &portlist->ports; *link; ) {
+        PortInfo* p = *link;
+
+        if (p->isSelected) {
+            link = &p->next;
+        } else {
+            *link = p->next;
+            freeportinfo(p);
+        }
+    }
+
+    return count;
+}
+
+
+// qsort() comparison for -tree, by location path then port name
+int topopathcmp(const void* p1, const void* p2)
+{
+    PortInfo* port1 = *(PortInfo**) p1;
+    PortInfo* port2 = *(PortInfo**) p2;
+    int       res = 0;
+
+    if (port1->locationpath && port2->locationpath) {
+        res = wcsicmp(port1->locationpath, port2->locationpath);
+    } else if (port1->locationpath || port2->locationpath) {
+        res = port1->locationpath ? -1 : 1; // ports without a location path last
+    }
+
+    return res ? res : portcmp(port1, port2);
+}
+
+
+/*
+    -tree, print each location path component that differs from the previous
+    port's path, indented by depth, then the port indented below it.
+ */
+void printtree(unsigned opt_flags, PortInfo* ports, unsigned count)
+{
+    PortInfo**     sorted = (PortInfo**) calloc(count ? count : 1, sizeof(PortInfo*));
+    const wchar_t* prevpath = NULL;
+    unsigned       i = 0;
+    PortInfo*      p;
+
+    if (sorted == NULL) {
+        errorprint(L"printtree(): memory allocation failed");
+        exit(-1);
+    }
+
+    for (p = ports; p && (i < count); p = p->next) {
+        sorted[i++] = p;
+    }
+    count = i;
+    qsort(sorted, count, sizeof(PortInfo*), topopathcmp);
+
+    for (i = 0; i < count; i++) {
+        const wchar_t* path = sorted[i]->locationpath ? sorted[i]->locationpath : L"(no location path)";
+        const wchar_t* c = path;
+        const wchar_t* prev = prevpath;
+        unsigned       depth = 0;
+        Bool           same = (prev != NULL);
+
+        // print components of path, skipping those shared with the previous port
+        while (*c) {
+            size_t len = wcscspn(c, L"#");
+
+            if (same) {
+                same = !wcsnicmp(c, prev, len) && ((prev[len] == L'#') || (prev[len] == L'\0'));
+            }
+            if (!same) {
+                wprintf(L"%*s%.*s\n", depth * 2, L"", (int) len, c);
+            }
+
+            depth++;
+            c += len;
+            if (*c == L'#') {
+                c++;
+            }
+            if (same) {
+                prev += len;
+                if (*prev == L'#') {
+                    prev++;
+                }
+            }
+        }
+
+        wprintf(L"%*s", depth * 2, L"");
+        printport(opt_flags, sorted[i]);
+        prevpath = path;
+    }
+
+    free(sorted);
+}
+
+
+unsigned timedlistclass(PortList* portlist, CONST GUID *guid, enum enumphase phase)
+{
+    LARGE_INTEGER start;
+    LARGE_INTEGER stop;
+    unsigned      count;
+
+    if (enumstopped(portlist)) {
+        return 0;
+    }
+
+    QueryPerformanceCounter(&start);
+    count = listclass(portlist, guid);
+    QueryPerformanceCounter(&stop);
+
+    portlist->stats.ticks[phase] += stop.QuadPart - start.QuadPart;
+    if (tracing) {
+        wchar_t classname[20];
+
+        swprintf(classname, 20, L"%S", enumphase_names[phase]);
+        traceend(TRACE_LISTCLASS, start.QuadPart, phase, count, ERROR_SUCCESS, classname);
+    }
+    return count;
+}
+
+
+// find the (matching) ports, returns count
+unsigned enumerateports(PortList* portlist)
+{
+    /* device setup GUIDs to look for are:
+       GUID_DEVCLASS_PORTS single COM / LPT ports
+       GUID_DEVCLASS_MODEM modem ports are not included in GUID_DEVCLASS_PORTS
+       GUID_DEVCLASS_MULTIPORTSERIAL multiple COM ports on single (PCI) card
+    */
+    const unsigned  opt_flags = portlist->optFlags;
+    unsigned        count = 0;
+    LARGE_INTEGER   start;
+    LARGE_INTEGER   stop;
+
+    memset(&portlist->stats, 0, sizeof(struct enumstats));
+    property_errors = 0;
+    freecostreport(portlist->costs);
+    portlist->costs = NULL;
+    QueryPerformanceCounter(&start);
+
+    if ((opt_flags & OPT_FLAG_NAMESONLY) && !(opt_flags & OPT_FLAG_NEED_DEVICEINFO) && !portlist->exportfile) {
+        // names of available ports, without enumerating devices
+        if ((opt_flags & OPT_FLAG_EXCLUDE_LPT) == 0) {
+            count = listdevicemapnames(portlist, L"HARDWARE\\DEVICEMAP\\PARALLEL PORTS");
+        }
+        if ((opt_flags & OPT_FLAG_EXCLUDE_COM) == 0) {
+            count += listdevicemapnames(portlist, L"HARDWARE\\DEVICEMAP\\SERIALCOMM");
+        }
+    } else if ((opt_flags & (OPT_FLAG_PORTLOOKUP | OPT_FLAG_ALL)) == OPT_FLAG_PORTLOOKUP) {
+        // available port lookup, no need to enumerate devices if the port does not exist
+        if (portexists(portlist->portmatch)) {
+            count = timedlistclass(portlist, &GUID_DEVCLASS_PORTS, ENUM_PHASE_PORTS);
+
+            if ((count == 0) && ((opt_flags & OPT_FLAG_EXCLUDE_COM) == 0)) {
+                count = timedlistclass(portlist, &GUID_DEVCLASS_MODEM, ENUM_PHASE_MODEM);
+                if (count == 0) {
+                    count = timedlistclass(portlist, &GUID_DEVCLASS_MULTIPORTSERIAL, ENUM_PHASE_MULTIPORTSERIAL);
+                }
+            }
+        }
+    } else {
+        // get info about ports, plus modems & multiport serial ports unless COM ports are excluded
+        count = listclasses(portlist, portclasses, (opt_flags & OPT_FLAG_EXCLUDE_COM) ? 1 : PORT_CLASSES);
+    }
+
+    // hub or composite device queries through the topology index
+    if (opt_flags & (OPT_FLAG_HUBQUERY | OPT_FLAG_SIBLINGQUERY)) {
+        if (portlist->listlock) {
+            EnterCriticalSection(portlist->listlock);
+        }
+        count = topoquery(portlist);
+        if (portlist->listlock) {
+            LeaveCriticalSection(portlist->listlock);
+        }
+    }
+
+    QueryPerformanceCounter(&stop);
+    portlist->stats.ticks[ENUM_PHASE_TOTAL] = stop.QuadPart - start.QuadPart;
+    portlist->stats.errors = property_errors;
+    GetSystemTimeAsFileTime(&portlist->stats.finished);
+
+    return count;
+}
+
+
+/*
+    -slowest report, device cost records are kept for every device that was
+    examined whether or not it was listed.
+ */
+void recorddevicecost(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData,
+    PortInfo* pInfo, struct devicecost* cost, LONGLONG start)
+{
+    struct costreport*  report;
+    LARGE_INTEGER       now;
+
+    QueryPerformanceCounter(&now);
+    cost->total = now.QuadPart - start;
+    profiling = NULL;
+
+    // identify the device, outside of the timing
+    if (pInfo) {
+        if (pInfo->portname) {
+            cost->portname = wcs_dupsubstr(pInfo->portname, wcslen(pInfo->portname));
+        }
+        if (pInfo->busname) {
+            cost->busname = wcs_dupsubstr(pInfo->busname, wcslen(pInfo->busname));
+        }
+        cost->haveids = pInfo->haveUSBid || pInfo->havePCIid;
+        cost->vendorId = pInfo->vendorId;
+        cost->productId = pInfo->productId;
+    }
+    cost->service = portstringproperty(hDevInfo, pDeviceInfoData, SPDRP_SERVICE);
+
+    // -timeout takes the report from an abandoned worker under the list lock
+    if (portlist->listlock) {
+        EnterCriticalSection(portlist->listlock);
+    }
+    report = portlist->costs;
+    if (report == NULL) {
+        report = portlist->costs = (struct costreport*) calloc(1, sizeof(struct costreport));
+    }
+    if (report && (report->count == report->max)) {
+        unsigned            newmax = report->max ? (report->max * 2) : 32;
+        struct devicecost*  newdevices = realloc(report->devices, newmax * sizeof(struct devicecost));
+
+        if (newdevices) {
+            report->devices = newdevices;
+            report->max = newmax;
+        }
+    }
+    if (report && (report->count < report->max)) {
+        report->devices[report->count++] = *cost;
+        cost = NULL;
+    }
+    if (portlist->listlock) {
+        LeaveCriticalSection(portlist->listlock);
+    }
+
+    // no room to keep it
+    if (cost) {
+        free(cost->portname);
+        free(cost->busname);
+        free(cost->service);
+    }
+}
+
+
+// most expensive first
+int costcmp(const void* p1, const void* p2)
+{
+    const struct devicecost* c1 = (const struct devicecost*) p1;
+    const struct devicecost* c2 = (const struct devicecost*) p2;
+
+    return (c1->total < c2->total) ? 1 : (c1->total > c2->total) ? -1 : 0;
+}
+
+
+#define COST_BY_BUS         0
+#define COST_BY_ID          1
+#define COST_BY_SERVICE     2
+
+// same group for the report
+Bool costsamegroup(const struct devicecost* c1, const struct devicecost* c2, int groupby)
+{
+    const wchar_t* s1 = (groupby == COST_BY_BUS) ? c1->busname : c1->service;
+    const wchar_t* s2 = (groupby == COST_BY_BUS) ? c2->busname : c2->service;
+
+    if (groupby == COST_BY_ID) {
+        return (c1->haveids == c2->haveids) && (!c1->haveids ||
+            ((c1->vendorId == c2->vendorId) && (c1->productId == c2->productId)));
+    }
+    return (s1 && s2) ? !wcsicmp(s1, s2) : (s1 == s2);
+}
+
+
+struct costgroup {
+    const struct devicecost*    first;  // identifies the group
+    LONGLONG                    total;
+    unsigned                    count;
+};
+
+
+int costgroupcmp(const void* p1, const void* p2)
+{
+    const struct costgroup* g1 = (const struct costgroup*) p1;
+    const struct costgroup* g2 = (const struct costgroup*) p2;
+
+    return (g1->total < g2->total) ? 1 : (g1->total > g2->total) ? -1 : 0;
+}
+
+
+// total cost per group, the top groups printed most expensive first
+void printcostgroups(struct costreport* report, unsigned top, const wchar_t* title, int groupby)
+{
+    struct costgroup*   groups = (struct costgroup*) calloc(report->count, sizeof(struct costgroup));
+    unsigned            ngroups = 0;
+    unsigned            i;
+    unsigned            g;
+    LARGE_INTEGER       freq;
+
+    if (groups == NULL) {
+        return;
+    }
+
+    for (i = 0; i < report->count; i++) {
+        for (g = 0; (g < ngroups) && !costsamegroup(groups[g].first, &report->devices[i], groupby); g++) {
+        }
+        if (g == ngroups) {
+            groups[ngroups++].first = &report->devices[i];
+        }
+        groups[g].total += report->devices[i].total;
+        groups[g].count++;
+    }
+    qsort(groups, ngroups, sizeof(struct costgroup), costgroupcmp);
+
+    QueryPerformanceFrequency(&freq);
+    wprintf(L"\nSlowest %s:\n", title);
+    for (g = 0; (g < ngroups) && (g < top); g++) {
+        const struct devicecost* first = groups[g].first;
+
+        wprintf(L"  %10.3f ms  %3u device%s  ", (double) groups[g].total * 1000.0 / (double) freq.QuadPart,
+            groups[g].count, (groups[g].count != 1) ? L"s" : L" ");
+        if (groupby == COST_BY_ID) {
+            if (first->haveids) {
+                wprintf(L"%04X:%04X\n", first->vendorId, first->productId);
+            } else {
+                wprintf(L"(no ids)\n");
+            }
+        } else {
+            const wchar_t* name = (groupby == COST_BY_BUS) ? first->busname : first->service;
+
+            wprintf(L"%s\n", name ? name : L"(unknown)");
+        }
+    }
+
+    free(groups);
+}
+
+
+void printcostreport(PortList* portlist)
+{
+    struct costreport*  report = portlist->costs;
+    LARGE_INTEGER       freq;
+    unsigned            i;
+    unsigned            slot;
+
+    if ((report == NULL) || (report->count == 0)) {
+        wprintf(L"\nNo devices were timed.\n");
+        return;
+    }
+
+    QueryPerformanceFrequency(&freq);
+    qsort(report->devices, report->count, sizeof(struct devicecost), costcmp);
+
+    wprintf(L"\nSlowest devices (of %u):\n", report->count);
+    for (i = 0; (i < report->count) && (i < portlist->slowest); i++) {
+        const struct devicecost* cost = &report->devices[i];
+
+        wprintf(L"  %10.3f ms  %-6s ", (double) cost->total * 1000.0 / (double) freq.QuadPart,
+            cost->portname ? cost->portname : L"-");
+        if (cost->haveids) {
+            wprintf(L"%04X:%04X ", cost->vendorId, cost->productId);
+        } else {
+            wprintf(L"          ");
+        }
+        wprintf(L"%s %s\n", cost->busname ? cost->busname : L"", cost->service ? cost->service : L"");
+
+        // breakdown, in slot order, omitting calls that took no measurable time
+        wprintf(L"               ");
+        for (slot = 0; slot < COST_SLOTS; slot++) {
+            if (cost->ticks[slot]) {
+                wprintf(L" %s %.3f", costslot_names[slot], (double) cost->ticks[slot] * 1000.0 / (double) freq.QuadPart);
+            }
+        }
+        wprintf(L"\n");
+    }
+
+    printcostgroups(report, portlist->slowest, L"buses", COST_BY_BUS);
+    printcostgroups(report, portlist->slowest, L"Vendor:Product ids", COST_BY_ID);
+    printcostgroups(report, portlist->slowest, L"driver services", COST_BY_SERVICE);
+}
+
+
+void freecostreport(struct costreport* report)
+{
+    unsigned i;
+
+    if (report == NULL) {
+        return;
+    }
+    for (i = 0; i < report->count; i++) {
+        free(report->devices[i].portname);
+        free(report->devices[i].busname);
+        free(report->devices[i].service);
+    }
+    free(report->devices);
+    free(report);
+}
+
+
+/*
+    -timeout: enumerate on a worker thread, so that a driver call that never
+    returns cannot hold up the results. The worker also checks the deadline
+    between property fetches, and usually stops by itself. If it is stuck it
+    is abandoned with the ports found so far, and ends with the process.
+ */
+#define TIMEOUT_GRACE_MS    50      // for the worker to notice the deadline
+
+unsigned enumeratewithdeadline(PortList* portlist)
+{
+    PortList*       worker = (PortList*) malloc(sizeof(PortList));
+    CRITICAL_SECTION* lock = (CRITICAL_SECTION*) malloc(sizeof(CRITICAL_SECTION));
+    AsyncEnum*      ae = NULL;
+    PortInfo*       p;
+    unsigned        count = 0;
+
+    if ((worker == NULL) || (lock == NULL)) {
+        free(worker);
+        free(lock);
+        portlist->rundeadline = deadlineafter(portlist->runtimeout);
+        return enumerateports(portlist);
+    }
+
+    // the worker has its own copy of the options & list, & starts a new cost report
+    freecostreport(portlist->costs);
+    portlist->costs = NULL;
+    *worker = *portlist;
+    InitializeCriticalSection(lock);
+    worker->listlock = lock;
+    worker->rundeadline = deadlineafter(portlist->runtimeout);
+
+    ae = startenumeration(worker, NULL, NULL, NULL);
+    if (ae == NULL) {
+        worker->listlock = NULL;
+        count = enumerateports(worker);
+    } else if (waitenumeration(ae, portlist->runtimeout + TIMEOUT_GRACE_MS)) {
+        count = ae->summary.count;
+        closeenumeration(ae);
+    } else {
+        // stuck in a driver, take what has been found; ae, worker & lock are left to the worker
+        cancelenumeration(ae);
+        EnterCriticalSection(lock);
+        portlist->ports = worker->ports;
+        worker->ports = NULL;
+        portlist->costs = worker->costs;
+        worker->costs = NULL;
+        count = worker->streamed;
+        portlist->latencyset = worker->latencyset;
+        LeaveCriticalSection(lock);
+
+        portlist->timedout = True;
+        portlist->stats = worker->stats;
+
+        // topology queries select from the ports found, as the worker did not get to
+        if (portlist->optFlags & (OPT_FLAG_HUBQUERY | OPT_FLAG_SIBLINGQUERY)) {
+            return topoquery(portlist);
+        }
+        for (p = portlist->ports; p; p = p->next) {
+            count++;
+        }
+        return count;
+    }
+
+    portlist->ports = worker->ports;
+    portlist->stats = worker->stats;
+    portlist->costs = worker->costs;
+    portlist->timedout = worker->timedout;
+    portlist->latencyset = worker->latencyset;
+    DeleteCriticalSection(lock);
+    free(lock);
+    free(worker);
+
+    return count;
+}
+
+
+/*
+    -owner: which process has each port open, eg when a flash tool fails
+    with "port busy". Windows keeps the kernel device name of each available
+    port under HARDWARE\DEVICEMAP, so the listed ports are indexed by device
+    name, then one pass over the system handle table finds the ports however
+    many there are. File handles are duplicated, and only those whose device
+    type is a port are named, on one helper thread. Processes of other
+    users, including services, can only be inspected when run as Administrator.
+ */
+unsigned ownerindexkey(struct ownerindex* index, const wchar_t* keyname, PortInfo* ports)
+{
+    HKEY     hKey;
+    DWORD    idx;
+    unsigned count = 0;
+
+    if (RegOpenKeyEx(HKEY_LOCAL_MACHINE, keyname, 0, KEY_QUERY_VALUE, &hKey) != ERROR_SUCCESS) {
+        return 0; // the key only exists once a port of that type has been seen
+    }
+
+    for (idx = 0; ; idx++) {
+        wchar_t   valuename[OWNER_NAME_MAX];
+        DWORD     namelen = OWNER_NAME_MAX;
+        wchar_t   data[MAX_PATH];
+        DWORD     datasize = sizeof(data);
+        DWORD     type = 0;
+        wchar_t*  name = data;
+        PortInfo* p;
+        LSTATUS   result = RegEnumValue(hKey, idx, valuename, &namelen, NULL, &type, (LPBYTE) data, &datasize);
+
+        if (result == ERROR_NO_MORE_ITEMS) {
+            break;
+        }
+        if ((result != ERROR_SUCCESS) || (type != REG_SZ)) {
+            continue;
+        }
+
+        // registry strings need not be terminated
+        data[(datasize / sizeof(wchar_t) < MAX_PATH) ? (datasize / sizeof(wchar_t)) : (MAX_PATH - 1)] = L'\0';
+
+        // SERIALCOMM values are eg "COM3", PARALLEL PORTS are eg "\DosDevices\LPT1"
+        if (!wcs_icmpprefix(name, L"\\DosDevices\\")) {
+            name += 12;
+        }
+
+        for (p = ports; p; p = p->next) {
+            if (p->isAvailable && p->portname && !wcsicmp(p->portname, name)) {
+                break;
+            }
+        }
+        if (p == NULL) {
+            continue; // port not listed
+        }
+
+        if (index->count == index->size) {
+            unsigned                newsize = index->size ? index->size * 2 : 16;
+            struct ownerindexentry* entries = (struct ownerindexentry*) realloc(index->entries,
+                                                newsize * sizeof(struct ownerindexentry));
+
+            if (entries == NULL) {
+                break;
+            }
+            index->entries = entries;
+            index->size = newsize;
+        }
+        wcscpy(index->entries[index->count].devicename, valuename);
+        index->entries[index->count].port = p;
+        index->count++;
+        count++;
+    }
+
+    RegCloseKey(hKey);
+    return count;
+}
+
+
+// the last of the scan and the helper thread to finish frees it
+void ownerworkerrelease(struct ownerworker* worker)
+{
+    if (InterlockedDecrement(&worker->refs) == 0) {
+        CloseHandle(worker->request);
+        CloseHandle(worker->done);
+        free(worker);
+    }
+}
+
+
+DWORD WINAPI ownerworkerthread(LPVOID param)
+{
+    struct ownerworker* worker = (struct ownerworker*) param;
+
+    while ((WaitForSingleObject(worker->request, INFINITE) == WAIT_OBJECT_0) && !worker->quit) {
+        ULONG returned = 0;
+
+        worker->isport = isportdevicehandle(worker->ntqueryvolumeinformationfile, worker->handle);
+        // abandoned while the type query blocked, the name is no longer wanted
+        worker->status = (worker->isport && !worker->quit) ? worker->ntqueryobject(worker->handle,
+                            OBJECT_NAME_INFORMATION, &worker->name, sizeof(worker->name), &returned) : -1;
+        CloseHandle(worker->handle);
+        SetEvent(worker->done);
+    }
+    ownerworkerrelease(worker);
+    return 0;
+}
+
+
+struct ownerworker* ownerworkerstart(ntqueryobject_fn ntqueryobject,
+    ntqueryvolumeinformationfile_fn ntqueryvolumeinformationfile)
+{
+    struct ownerworker* worker = (struct ownerworker*) calloc(1, sizeof(struct ownerworker));
+    HANDLE              thread;
+
+    if (worker == NULL) {
+        return NULL;
+    }
+    worker->refs = 2;
+    worker->ntqueryobject = ntqueryobject;
+    worker->ntqueryvolumeinformationfile = ntqueryvolumeinformationfile;
+    worker->request = CreateEvent(NULL, FALSE, FALSE, NULL);
+    worker->done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    thread = (worker->request && worker->done) ? CreateThread(NULL, 0, ownerworkerthread, worker, 0, NULL) : NULL;
+    if (thread == NULL) {
+        if (worker->request) {
+            CloseHandle(worker->request);
+        }
+        if (worker->done) {
+            CloseHandle(worker->done);
+        }
+        free(worker);
+        return NULL;
+    }
+    CloseHandle(thread);
+    return worker;
+}
+
+
+// a stuck helper quits when its query returns
+void ownerworkerstop(struct ownerworker* worker)
+{
+    worker->quit = True;
+    SetEvent(worker->request);
+    ownerworkerrelease(worker);
+}
+
+
+/*
+    Kernel name of a duplicated handle to a port device, else False.
+    Naming a file opened for synchronous I/O waits for any I/O pending on
+    it, eg a blocking ReadFile of a serial port, as can the device type
+    query. If the helper does not answer in time *pStuck is set, & the
+    helper must be stopped. The helper closes handle, the caller must not.
+ */
+Bool queryhandlename(struct ownerworker* worker, HANDLE handle, wchar_t* name, size_t size, Bool* pStuck)
+{
+    size_t length;
+
+    worker->handle = handle;
+    worker->name.length = 0;
+    worker->name.buffer = NULL;
+    SetEvent(worker->request);
+
+    *pStuck = (WaitForSingleObject(worker->done, OWNER_QUERY_MS) != WAIT_OBJECT_0);
+    if (*pStuck || !worker->isport || (worker->status < 0)) {
+        return False;
+    }
+
+    length = worker->name.length / sizeof(wchar_t);
+    if ((worker->name.buffer == NULL) || (length == 0)) {
+        return False;
+    }
+    if (length >= size) {
+        length = size - 1;
+    }
+    memcpy(name, worker->name.buffer, length * sizeof(wchar_t));
+    name[length] = L'\0';
+    return True;
+}
+
+
+// device types that can be a listed port, serial first as the most common
+Bool isportdevicehandle(ntqueryvolumeinformationfile_fn ntqueryvolumeinformationfile, HANDLE handle)
+{
+    ULONG_PTR iostatus[2];
+    ULONG     deviceinfo[2];  // FILE_FS_DEVICE_INFORMATION: DeviceType, Characteristics
+
+    if (ntqueryvolumeinformationfile(handle, iostatus, deviceinfo, sizeof(deviceinfo), FILE_FS_DEVICE_INFORMATION) < 0) {
+        return False;
+    }
+
+    switch (deviceinfo[0]) {
+    case FILE_DEVICE_SERIAL_PORT:
+    case FILE_DEVICE_PARALLEL_PORT:
+    case FILE_DEVICE_MODEM:
+        return True;
+    default:
+        return False;
+    }
+}
+
+
+// snapshot of every handle open in the system, caller frees it
+struct handletable* queryhandletable(ntquerysysteminformation_fn ntquerysysteminformation)
+{
+    ULONG               size = 1024 * 1024;
+    struct handletable* table = NULL;
+
+    for (;;) {
+        ULONG returned = 0;
+        LONG  status;
+
+        table = (struct handletable*) malloc(size);
+        if (table == NULL) {
+            errorprint(L"-owner: memory allocation failed");
+            return NULL;
+        }
+
+        status = ntquerysysteminformation(SYSTEM_EXTENDED_HANDLE_INFORMATION, table, size, &returned);
+        if (status >= 0) {
+            return table;
+        }
+        free(table);
+
+        if ((status != STATUS_INFO_LENGTH_MISMATCH) || (size > 256 * 1024 * 1024)) {
+            errorprintf(L"-owner: could not query system handles - status %#X", status);
+            return NULL;
+        }
+        // handles are opened all the time, allow some growth
+        size = (returned > size ? returned : size) + size / 2;
+    }
+}
+
+
+/*
+    Duplicating another user's handles needs PROCESS_DUP_HANDLE, which an
+    elevated administrator gets once SeDebugPrivilege is enabled. Protected
+    processes refuse it even then, so when elevated those are not counted as
+    hidden. Returns whether we are elevated, checked once.
+ */
+Bool ownerprivileges(void)
+{
+    static int          elevated = -1;
+    HANDLE              token;
+    TOKEN_ELEVATION     elevation;
+    TOKEN_PRIVILEGES    privileges;
+    DWORD               size;
+
+    if (elevated >= 0) {
+        return (Bool) elevated;
+    }
+    elevated = 0;
+
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY | TOKEN_ADJUST_PRIVILEGES, &token)) {
+        return False;
+    }
+    if (GetTokenInformation(token, TokenElevation, &elevation, sizeof(elevation), &size) && elevation.TokenIsElevated) {
+        elevated = 1;
+    }
+
+    // does nothing if the token does not hold the privilege
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    if (LookupPrivilegeValue(NULL, SE_DEBUG_NAME, &privileges.Privileges[0].Luid)) {
+        AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL);
+    }
+    CloseHandle(token);
+
+    return (Bool) elevated;
+}
+
+
+void findportowners(PortInfo* ports, Bool quiet)
+{
+    HMODULE                         ntdll = GetModuleHandle(L"ntdll.dll");
+    ntquerysysteminformation_fn     ntquerysysteminformation;
+    ntqueryobject_fn                ntqueryobject;
+    ntqueryvolumeinformationfile_fn ntqueryvolumeinformationfile;
+    struct ownerindex               index = { NULL, 0, 0 };
+    struct handletable*             table;
+    HANDLE                          probe;
+    const DWORD                     self = GetCurrentProcessId();
+    const Bool                      elevated = ownerprivileges();
+    unsigned                        filetype = (unsigned) -1;
+    ULONG_PTR                       pid = 0;
+    HANDLE                          process = NULL;
+    struct ownerworker*             worker = NULL;
+    unsigned                        stuck = 0;
+    unsigned                        hidden = 0;     // processes we were refused, when not elevated
+    Bool                            incomplete = False; // handles left uninspected
+    unsigned                        unowned = 0;
+    ULONG_PTR                       h;
+    PortInfo*                       p;
+
+    // -counters finds the owners again, as programs close & open ports
+    for (p = ports; p; p = p->next) {
+        p->ownerpid = 0;
+        p->ownerhandle = 0;
+        p->isOwnerHidden = False;
+        free(p->ownername);
+        p->ownername = NULL;
+    }
+
+    ntquerysysteminformation = ntdll ?
+        (ntquerysysteminformation_fn) GetProcAddress(ntdll, "NtQuerySystemInformation") : NULL;
+    ntqueryobject = ntdll ? (ntqueryobject_fn) GetProcAddress(ntdll, "NtQueryObject") : NULL;
+    ntqueryvolumeinformationfile = ntdll ?
+        (ntqueryvolumeinformationfile_fn) GetProcAddress(ntdll, "NtQueryVolumeInformationFile") : NULL;
+    if (!ntquerysysteminformation || !ntqueryobject || !ntqueryvolumeinformationfile) {
+        for (p = ports; p; p = p->next) {
+            p->isOwnerHidden = p->isAvailable;
+        }
+        if (!quiet) {
+            errorprint(L"-owner: system handle information is not available");
+        }
+        return;
+    }
+
+    ownerindexkey(&index, L"HARDWARE\\DEVICEMAP\\SERIALCOMM", ports);
+    ownerindexkey(&index, L"HARDWARE\\DEVICEMAP\\PARALLEL PORTS", ports);
+    if (index.count == 0) {
+        free(index.entries);
+        return;
+    }
+
+    // a file handle of our own identifies the object type number of files
+    probe = CreateFile(L"NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    table = queryhandletable(ntquerysysteminformation);
+    if (table && (probe != INVALID_HANDLE_VALUE)) {
+        for (h = 0; h < table->count; h++) {
+            if ((table->handles[h].pid == self) && (table->handles[h].handle == (ULONG_PTR) probe)) {
+                filetype = table->handles[h].typeindex;
+                break;
+            }
+        }
+    }
+    if (probe != INVALID_HANDLE_VALUE) {
+        CloseHandle(probe);
+    }
+    if (table) {
+        worker = ownerworkerstart(ntqueryobject, ntqueryvolumeinformationfile);
+        incomplete = (worker == NULL);
+    }
+
+    // handles are grouped by process, so each process is opened once
+    for (h = 0; worker && (h < table->count); h++) {
+        struct handleentry* entry = &table->handles[h];
+        HANDLE              dup;
+        wchar_t             name[OWNER_NAME_MAX];
+        Bool                named;
+        Bool                blocked;
+        unsigned            i;
+
+        if ((entry->pid == self) || ((filetype != (unsigned) -1) && (entry->typeindex != filetype))) {
+            continue;
+        }
+
+        if (entry->pid != pid) {
+            if (process) {
+                CloseHandle(process);
+            }
+            pid = entry->pid;
+            process = OpenProcess(PROCESS_DUP_HANDLE, FALSE, (DWORD) pid);
+            if ((process == NULL) && !elevated) {
+                hidden++;
+            }
+        }
+        if (process == NULL) {
+            continue;
+        }
+
+        if (!DuplicateHandle(process, (HANDLE) entry->handle, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+            continue;
+        }
+        named = queryhandlename(worker, dup, name, OWNER_NAME_MAX, &blocked);
+        if (blocked) {
+            // leave the helper to its query, & carry on with a new one
+            ownerworkerstop(worker);
+            worker = (++stuck < OWNER_STUCK_MAX) ? ownerworkerstart(ntqueryobject, ntqueryvolumeinformationfile) : NULL;
+            if (worker == NULL) {
+                incomplete = True;  // the rest of the handles are not inspected
+            }
+        }
+        if (!named) {
+            continue;
+        }
+
+        for (i = 0; i < index.count; i++) {
+            if (!wcsicmp(index.entries[i].devicename, name)) {
+                if (!index.entries[i].port->ownerpid) {
+                    index.entries[i].port->ownerpid = (DWORD) pid;
+                    index.entries[i].port->ownerhandle = entry->handle;
+                }
+                break;
+            }
+        }
+    }
+    if (process) {
+        CloseHandle(process);
+    }
+    if (worker) {
+        ownerworkerstop(worker);
+    }
+    free(table);
+
+    // program names, from one snapshot of all processes
+    for (h = 0; h < index.count; h++) {
+        PortInfo* port = index.entries[h].port;
+
+        if (!port->ownerpid) {
+            // may be open in a process that could not be inspected
+            port->isOwnerHidden = (table == NULL) || incomplete || (hidden != 0);
+            unowned++;
+        }
+    }
+    if (unowned < index.count) {
+        HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+
+        if (snapshot != INVALID_HANDLE_VALUE) {
+            PROCESSENTRY32 pe;
+
+            pe.dwSize = sizeof(pe);
+            if (Process32First(snapshot, &pe)) {
+                do {
+                    for (p = ports; p; p = p->next) {
+                        if (p->ownerpid == pe.th32ProcessID && !p->ownername) {
+                            p->ownername = wcsdup(pe.szExeFile);
+                        }
+                    }
+                } while (Process32Next(snapshot, &pe));
+            }
+            CloseHandle(snapshot);
+        }
+    }
+
+    if (hidden && unowned && !quiet) {
+        errorprintf(L"-owner: %u processes could not be inspected, run as Administrator to see them all", hidden);
+    } else if (incomplete && unowned && !quiet) {
+        errorprint(L"-owner: some handles could not be inspected");
+    }
+    free(index.entries);
+}
+
+
+/*
+    -bench: loopback tests of the matching COM ports, all at once. Each port
+    is timed echoing single probes, then streaming data both ways. All the
+    ports' reads & writes complete through one I/O completion port, so the
+    number of ports is not limited as with WaitForMultipleObjects().
+ */
+Bool loopbackopen(struct loopback* lb, unsigned baud)
+{
+    wchar_t      devname[MAX_PATH];
+    DCB          dcb;
+    COMMTIMEOUTS timeouts;
+    unsigned     i;
+
+    _snwprintf(devname, MAX_PATH - 1, L"\\\\.\\%s", lb->port->portname);
+    devname[MAX_PATH - 1] = L'\0';
+    lb->handle = CreateFile(devname, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (lb->handle == INVALID_HANDLE_VALUE) {
+        lb->error = GetLastError();
+        return False;
+    }
+
+    ZeroMemory(&dcb, sizeof(DCB));
+    dcb.DCBlength = sizeof(DCB);
+    if (!GetCommState(lb->handle, &dcb)) {
+        lb->error = GetLastError();
+        return False;
+    }
+    // 8N1, no flow control, so that nothing but the plug is tested
+    dcb.BaudRate = baud;
+    dcb.ByteSize = 8;
+    dcb.Parity = NOPARITY;
+    dcb.StopBits = ONESTOPBIT;
+    dcb.fBinary = TRUE;
+    dcb.fParity = FALSE;
+    dcb.fOutxCtsFlow = FALSE;
+    dcb.fOutxDsrFlow = FALSE;
+    dcb.fDtrControl = DTR_CONTROL_ENABLE;
+    dcb.fRtsControl = RTS_CONTROL_ENABLE;
+    dcb.fDsrSensitivity = FALSE;
+    dcb.fOutX = FALSE;
+    dcb.fInX = FALSE;
+    dcb.fNull = FALSE;
+    dcb.fAbortOnError = FALSE;
+    if (!SetCommState(lb->handle, &dcb)) {
+        lb->error = GetLastError();
+        return False;
+    }
+
+    // reads complete as soon as any bytes arrive, or after 100 ms with none
+    timeouts.ReadIntervalTimeout = MAXDWORD;
+    timeouts.ReadTotalTimeoutMultiplier = MAXDWORD;
+    timeouts.ReadTotalTimeoutConstant = 100;
+    timeouts.WriteTotalTimeoutMultiplier = 0;
+    timeouts.WriteTotalTimeoutConstant = 0;
+    if (!SetCommTimeouts(lb->handle, &timeouts)) {
+        lb->error = GetLastError();
+        return False;
+    }
+    PurgeComm(lb->handle, PURGE_RXCLEAR | PURGE_TXCLEAR);
+
+    for (i = 0; i < LOOPBACK_WRITE_SIZE; i++) {
+        lb->writebuf[i] = (BYTE) i;
+    }
+    return True;
+}
+
+
+void loopbackread(struct loopback* lb, DWORD bytes, LONGLONG now)
+{
+    if (bytes == 0) {
+        return; // read timed out
+    }
+    lb->lastread = now;
+
+    if (lb->phase == LOOPBACK_LATENCY) {
+        DWORD i;
+
+        if (lb->pending == 0) {
+            return; // late echo of a lost probe
+        }
+
+        // match the echo byte by byte, a late echo of a lost probe has an older sequence byte
+        for (i = 0; (i < bytes) && lb->pending; i++) {
+            if (lb->readbuf[i] == lb->writebuf[LOOPBACK_PROBE_SIZE - lb->pending]) {
+                lb->pending--;
+            } else {
+                lb->pending = LOOPBACK_PROBE_SIZE - ((lb->readbuf[i] == lb->writebuf[0]) ? 1 : 0);
+            }
+        }
+        if (lb->pending == 0) {
+            lb->rtt[lb->samples++] = now - lb->sent;
+        }
+    } else {
+        lb->received += bytes;
+    }
+}
+
+
+// start the next read or write the port's phase needs, and move on to the next phase
+void loopbackstep(struct loopback* lb, LONGLONG now, LONGLONG freq)
+{
+    const LONGLONG elapsedms = (now - lb->phasestart) * 1000 / freq;
+
+    switch (lb->phase) {
+    case LOOPBACK_LATENCY:
+        if (lb->pending && ((now - lb->sent) * 1000 / freq >= LOOPBACK_PROBE_MS)) {
+            lb->lost++;
+            lb->pending = 0;
+        }
+        if ((lb->samples == 0) && (lb->lost >= 3)) {
+            lb->phase = LOOPBACK_DONE; // no plug, skip the throughput test
+        } else if (!lb->pending && !lb->writing &&
+                ((lb->probes >= LOOPBACK_PROBES) || (elapsedms >= LOOPBACK_LATENCY_MS))) {
+            lb->phase = LOOPBACK_THROUGHPUT;
+            lb->phasestart = now;
+            lb->lastread = now;
+        } else if (!lb->pending && !lb->writing) {
+            lb->writebuf[0] = (BYTE) lb->probes;
+            lb->probes++;
+            lb->pending = LOOPBACK_PROBE_SIZE;
+            lb->sent = now;
+            lb->writing = True;
+            if (!WriteFile(lb->handle, lb->writebuf, LOOPBACK_PROBE_SIZE, NULL, &lb->writeov) &&
+                    (GetLastError() != ERROR_IO_PENDING)) {
+                lb->writing = False;
+                lb->error = GetLastError();
+                lb->phase = LOOPBACK_DONE;
+            }
+        }
+        break;
+    case LOOPBACK_THROUGHPUT:
+        if (elapsedms >= LOOPBACK_THROUGHPUT_MS) {
+            lb->phase = LOOPBACK_DRAIN;
+        } else if (!lb->writing) {
+            lb->writing = True;
+            if (!WriteFile(lb->handle, lb->writebuf, LOOPBACK_WRITE_SIZE, NULL, &lb->writeov) &&
+                    (GetLastError() != ERROR_IO_PENDING)) {
+                lb->writing = False;
+                lb->error = GetLastError();
+                lb->phase = LOOPBACK_DONE;
+            }
+        }
+        break;
+    case LOOPBACK_DRAIN:
+        if ((elapsedms >= LOOPBACK_THROUGHPUT_MS + LOOPBACK_DRAIN_MAX_MS) ||
+                (!lb->writing && ((now - lb->lastread) * 1000 / freq >= LOOPBACK_DRAIN_MS))) {
+            lb->streamticks = lb->lastread - lb->phasestart;
+            lb->phase = LOOPBACK_DONE;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (lb->phase == LOOPBACK_DONE) {
+        if (lb->reading || lb->writing) {
+            CancelIo(lb->handle);
+        }
+    } else if (!lb->reading) {
+        lb->reading = True;
+        if (!ReadFile(lb->handle, lb->readbuf, LOOPBACK_READ_SIZE, NULL, &lb->readov) &&
+                (GetLastError() != ERROR_IO_PENDING)) {
+            lb->reading = False;
+            lb->error = GetLastError();
+            lb->phase = LOOPBACK_DONE;
+            CancelIo(lb->handle);
+        }
+    }
+}
+
+
+// ascending round trip times
+int rttcmp(const void* p1, const void* p2)
+{
+    const LONGLONG t1 = *(const LONGLONG*) p1;
+    const LONGLONG t2 = *(const LONGLONG*) p2;
+
+    return (t1 < t2) ? -1 : (t1 > t2) ? 1 : 0;
+}
+
+
+void printloopback(struct loopback* lb, unsigned baud, LONGLONG freq)
+{
+    PortInfo*       p = lb->port;
+    const wchar_t*  location = p->location ? p->location : p->locationpath ? p->locationpath : L"";
+
+    wprintf(L"%-6s ", p->portname);
+    if (p->haveUSBid || p->havePCIid) {
+        wprintf(L"%04lX %04lX ", p->vendorId, p->productId);
+    } else {
+        wprintf(L"          ");
+    }
+
+    if (lb->handle == INVALID_HANDLE_VALUE) {
+        wprintf(L"could not open port - error %#X  %s\n", lb->error, location);
+    } else if (lb->error && (lb->samples == 0)) {
+        wprintf(L"I/O error %#X  %s\n", lb->error, location);
+    } else if (lb->samples == 0) {
+        wprintf(L"no echo, is a loopback plug fitted?  %s\n", location);
+    } else {
+        double bytespersec = lb->streamticks ? (double) lb->received * (double) freq / (double) lb->streamticks : 0.0;
+
+        qsort(lb->rtt, lb->samples, sizeof(LONGLONG), rttcmp);
+        // 10 bits per byte for 8N1
+        wprintf(L"%9.0f %5.1f %7.2f %7.2f %7.2f %4u/%-4u %s\n", bytespersec, bytespersec * 1000.0 / baud,
+            (double) lb->rtt[(lb->samples - 1) * 50 / 100] * 1000.0 / (double) freq,
+            (double) lb->rtt[(lb->samples - 1) * 99 / 100] * 1000.0 / (double) freq,
+            (double) lb->rtt[lb->samples - 1] * 1000.0 / (double) freq,
+            lb->samples, lb->probes, location);
+    }
+}
+
+
+int loopbackbench(PortList* portlist)
+{
+    const unsigned   baud = portlist->baud ? portlist->baud : LOOPBACK_DEFAULT_BAUD;
+    struct loopback* lbs;
+    unsigned         count = 0;
+    unsigned         active = 0;
+    unsigned         i;
+    PortInfo*        p;
+    HANDLE           iocp;
+    LARGE_INTEGER    freq;
+    LARGE_INTEGER    now;
+
+    // writing to every port on the PC could upset modems & other devices
+    if (!(portlist->optFlags & OPT_FLAG_FILTER_SPECIFIED)) {
+        errorprint(L"-bench needs -usb=, -pci=, -serial= or -port= to choose the ports with loopback plugs");
+        return -1;
+    }
+
+    // available COM ports, with the details needed for the report
+    portlist->optFlags &= ~(OPT_FLAG_ALL | OPT_FLAG_EXCLUDE_AVAILABLE | OPT_FLAG_EXCLUDE_COM |
+                            OPT_FLAG_NAMESONLY | OPT_FLAG_STREAM);
+    portlist->optFlags |= OPT_FLAG_EXCLUDE_LPT | OPT_FLAG_LONGFORM | OPT_FLAG_VERBOSE;
+    if (portlist->runtimeout) {
+        enumeratewithdeadline(portlist);
+    } else {
+        enumerateports(portlist);
+    }
+    for (p = portlist->ports; p; p = p->next) {
+        count++;
+    }
+    if (count == 0) {
+        errorprint(L"-bench: no matching COM ports found");
+        return -1;
+    }
+
+    lbs = (struct loopback*) calloc(count, sizeof(struct loopback));
+    iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+    if ((lbs == NULL) || (iocp == NULL)) {
+        errorprint(L"-bench: could not create I/O completion port");
+        free(lbs);
+        return -1;
+    }
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    for (i = 0, p = portlist->ports; p; p = p->next, i++) {
+        struct loopback* lb = &lbs[i];
+
+        lb->port = p;
+        lb->handle = INVALID_HANDLE_VALUE;
+        lb->phasestart = now.QuadPart;
+        lb->rtt = (LONGLONG*) calloc(LOOPBACK_PROBES, sizeof(LONGLONG));
+        if ((lb->rtt == NULL) || !loopbackopen(lb, baud) ||
+                (CreateIoCompletionPort(lb->handle, iocp, (ULONG_PTR) i, 0) == NULL)) {
+            if (!lb->error) {
+                lb->error = GetLastError();
+            }
+            lb->phase = LOOPBACK_DONE;
+        } else {
+            active++;
+        }
+    }
+
+    wprintf(L"Testing %u port%s at %u baud...\n", active, (active != 1) ? L"s" : L"", baud);
+    fflush(stdout);
+
+    while (active) {
+        DWORD       bytes = 0;
+        ULONG_PTR   key = 0;
+        OVERLAPPED* ov = NULL;
+        BOOL        ok = GetQueuedCompletionStatus(iocp, &bytes, &key, &ov, 10);
+        DWORD       lasterror = ok ? 0 : GetLastError();
+
+        QueryPerformanceCounter(&now);
+        if (ov) {
+            struct loopback* lb = &lbs[key];
+
+            if (ov == &lb->readov) {
+                lb->reading = False;
+                loopbackread(lb, ok ? bytes : 0, now.QuadPart);
+            } else {
+                lb->writing = False;
+            }
+            if (!ok && (lasterror != ERROR_OPERATION_ABORTED) && !lb->error) {
+                lb->error = lasterror;
+                lb->phase = LOOPBACK_DONE;
+            }
+        }
+
+        for (i = 0, active = 0; i < count; i++) {
+            struct loopback* lb = &lbs[i];
+
+            if (lb->handle != INVALID_HANDLE_VALUE) {
+                loopbackstep(lb, now.QuadPart, freq.QuadPart);
+                if ((lb->phase != LOOPBACK_DONE) || lb->reading || lb->writing) {
+                    active++;
+                }
+            }
+        }
+    }
+
+    wprintf(L"\nPort   VID  PID    Bytes/s Line%%  p50 ms  p99 ms  max ms Echoed    Location\n");
+    for (i = 0; i < count; i++) {
+        printloopback(&lbs[i], baud, freq.QuadPart);
+        if (lbs[i].handle != INVALID_HANDLE_VALUE) {
+            CloseHandle(lbs[i].handle);
+        }
+        free(lbs[i].rtt);
+    }
+
+    CloseHandle(iocp);
+    free(lbs);
+    freeportlist(portlist->ports);
+    portlist->ports = NULL;
+    return 0;
+}
+
+
+void statsworkerrelease(struct statsworker* w)
+{
+    if (InterlockedDecrement(&w->refs) == 0) {
+        CloseHandle(w->wake);
+        CloseHandle(w->done);
+        free(w);
+    }
+}
+
+
+DWORD WINAPI statsworkerthread(LPVOID param)
+{
+    struct statsworker* w = (struct statsworker*) param;
+
+    for (;;) {
+        HANDLE handle;
+        DWORD  bytes = 0;
+
+        WaitForSingleObject(w->wake, INFINITE);
+        if (w->quit) {
+            break;
+        }
+
+        handle = w->handle;
+        w->ok = DeviceIoControl(handle, IOCTL_SERIAL_GET_STATS, NULL, 0, &w->stats, sizeof(struct serialstats), &bytes, NULL) &&
+                    (bytes == sizeof(struct serialstats));
+        w->error = w->ok ? 0 : GetLastError();
+        CloseHandle(handle);
+        SetEvent(w->done);
+    }
+
+    statsworkerrelease(w);
+    return 0;
+}
+
+
+struct statsworker* statsworkerstart(void)
+{
+    struct statsworker* w = (struct statsworker*) calloc(1, sizeof(struct statsworker));
+    HANDLE              thread;
+
+    if (w == NULL) {
+        return NULL;
+    }
+    w->refs = 2;
+    w->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    w->done = CreateEvent(NULL, FALSE, FALSE, NULL);
+    thread = (w->wake && w->done) ? CreateThread(NULL, 0, statsworkerthread, w, 0, NULL) : NULL;
+    if (thread == NULL) {
+        if (w->wake) {
+            CloseHandle(w->wake);
+        }
+        if (w->done) {
+            CloseHandle(w->done);
+        }
+        free(w);
+        return NULL;
+    }
+
+    CloseHandle(thread);
+    return w;
+}
+
+
+// forget the stuck queries that have returned, then whether one through this handle is still stuck
+Bool stuckquerywaiting(struct stuckqueries* stuck, DWORD processid, ULONG_PTR handle)
+{
+    Bool     waiting = False;
+    unsigned i = 0;
+
+    while (i < stuck->count) {
+        struct stuckquery* q = &stuck->entries[i];
+
+        // done stays set, as nothing waits on an abandoned worker's event
+        if (WaitForSingleObject(q->worker->done, 0) == WAIT_OBJECT_0) {
+            statsworkerrelease(q->worker);
+            *q = stuck->entries[--stuck->count];
+            continue;
+        }
+        if ((q->processid == processid) && (q->handle == handle)) {
+            waiting = True;
+        }
+        i++;
+    }
+
+    return waiting;
+}
+
+
+Bool stuckqueryadd(struct stuckqueries* stuck, DWORD processid, ULONG_PTR handle, struct statsworker* w)
+{
+    if (stuck->count == stuck->size) {
+        unsigned           newsize = stuck->size ? stuck->size * 2 : 8;
+        struct stuckquery* entries = (struct stuckquery*) realloc(stuck->entries,
+                                        newsize * sizeof(struct stuckquery));
+
+        if (entries == NULL) {
+            return False;
+        }
+        stuck->entries = entries;
+        stuck->size = newsize;
+    }
+
+    stuck->entries[stuck->count].processid = processid;
+    stuck->entries[stuck->count].handle = handle;
+    stuck->entries[stuck->count].worker = w;
+    stuck->count++;
+    return True;
+}
+
+
+// the workers free themselves if their queries ever return
+void stuckqueriesfree(struct stuckqueries* stuck)
+{
+    unsigned i;
+
+    for (i = 0; i < stuck->count; i++) {
+        statsworkerrelease(stuck->entries[i].worker);
+    }
+    free(stuck->entries);
+    memset(stuck, 0, sizeof(struct stuckqueries));
+}
+
+
+// statistics of one port, through a duplicate of its owner's handle
+Bool querycounters(struct statsworker** pWorker, struct stuckqueries* stuck, struct portcounters* pc,
+    struct serialstats* stats)
+{
+    struct statsworker* w = *pWorker;
+    HANDLE              dup;
+
+    pc->stalled = stuckquerywaiting(stuck, pc->processid, pc->handle);
+    if (pc->stalled) {
+        return False;
+    }
+
+    // duplicates are closed straight after use, so the owner can close & reopen the port
+    if (!DuplicateHandle(pc->process, (HANDLE) pc->handle, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        pc->error = GetLastError();
+        return False;
+    }
+
+    w->handle = dup;
+    SetEvent(w->wake);
+    if (WaitForSingleObject(w->done, COUNTERS_QUERY_MS) != WAIT_OBJECT_0) {
+        // the worker quits once the ioctl returns, our reference is kept until then
+        pc->stalled = True;
+        w->quit = True;
+        SetEvent(w->wake);
+        if (!stuckqueryadd(stuck, pc->processid, pc->handle, w)) {
+            statsworkerrelease(w);
+        }
+        *pWorker = statsworkerstart();
+        return False;
+    }
+
+    if (!w->ok) {
+        pc->error = w->error;
+        return False;
+    }
+    pc->error = 0;
+    *stats = w->stats;
+    return True;
+}
+
+
+// note whether the owner found for a port has changed
+void trackportowner(struct portcounters* pc)
+{
+    PortInfo* p = pc->port;
+
+    if ((p->ownerpid != pc->processid) && pc->process) {
+        CloseHandle(pc->process);
+        pc->process = NULL;
+    }
+    if ((p->ownerpid != pc->processid) || (p->ownerhandle != pc->handle)) {
+        // counts restart when a port is opened
+        pc->havelast = False;
+    }
+    pc->processid = p->ownerpid;
+    pc->handle = p->ownerhandle;
+
+    if (pc->processid && (pc->process == NULL)) {
+        pc->process = OpenProcess(PROCESS_DUP_HANDLE, FALSE, pc->processid);
+        pc->error = pc->process ? 0 : GetLastError();
+    }
+}
+
+
+// scan the handle table for the owners of the ports, and note any that have changed
+void trackportowners(PortList* portlist, struct portcounters* pcs, unsigned count)
+{
+    unsigned i;
+
+    findportowners(portlist->ports, True);
+
+    for (i = 0; i < count; i++) {
+        trackportowner(&pcs[i]);
+    }
+}
+
+
+void printcounters(struct portcounters* pc, struct serialstats* stats, LONGLONG now, LONGLONG freq)
+{
+    wchar_t owner[64] = L"";
+    double  seconds;
+
+    if (pc->processid) {
+        _snwprintf(owner, 63, L"%s (%lu)", pc->port->ownername ? pc->port->ownername : L"?", pc->processid);
+        owner[63] = L'\0';
+    }
+    wprintf(L"%-6s %-24s ", pc->port->portname, owner);
+
+    if ((pc->processid == 0) && pc->port->isOwnerHidden) {
+        wprintf(ownerprivileges() ? L"not accessible\n" : L"not accessible, run as Administrator\n");
+    } else if (pc->processid == 0) {
+        wprintf(L"not open\n");
+    } else if (pc->stalled) {
+        wprintf(L"busy with synchronous I/O\n");
+    } else if (pc->error == ERROR_ACCESS_DENIED) {
+        wprintf(L"access denied, run as Administrator\n");
+    } else if ((pc->error == ERROR_INVALID_FUNCTION) || (pc->error == ERROR_NOT_SUPPORTED)) {
+        wprintf(L"driver has no counters\n");
+    } else if (pc->error) {
+        wprintf(L"error %#X\n", pc->error);
+    } else if (!pc->havelast) {
+        wprintf(L"%9s %9s %6lu %6lu %7lu %7lu  (totals)\n", L"", L"", stats->frameerrors,
+            stats->parityerrors, stats->serialoverruns, stats->bufferoverruns);
+    } else {
+        // unsigned differences are right when the counts wrap
+        seconds = (double) (now - pc->lasttime) / (double) freq;
+        wprintf(L"%9.0f %9.0f %6lu %6lu %7lu %7lu\n",
+            (double) (ULONG) (stats->received - pc->last.received) / seconds,
+            (double) (ULONG) (stats->transmitted - pc->last.transmitted) / seconds,
+            (ULONG) (stats->frameerrors - pc->last.frameerrors),
+            (ULONG) (stats->parityerrors - pc->last.parityerrors),
+            (ULONG) (stats->serialoverruns - pc->last.serialoverruns),
+            (ULONG) (stats->bufferoverruns - pc->last.bufferoverruns));
+    }
+}
+
+
+/*
+    -counters: every -interval seconds, until stopped, the traffic rates &
+    new line errors of the matching ports. Windows has no way to read the
+    counters of a port without a handle to it, and ports are exclusive, so
+    they are read through the handle of the program using the port, found
+    by the -owner handle scan. ClearCommError() is not used, as it would
+    clear the program's own error state. One waitable timer paces the loop.
+ */
+int counterloop(PortList* portlist)
+{
+    const unsigned       interval = portlist->interval ? portlist->interval : 1;
+    struct portcounters* pcs;
+    struct statsworker*  worker;
+    struct stuckqueries  stuck = { NULL, 0, 0 };
+    unsigned             count = 0;
+    unsigned             i;
+    PortInfo*            p;
+    HANDLE               timer;
+    LARGE_INTEGER        due;
+    LARGE_INTEGER        freq;
+    LARGE_INTEGER        now;
+    LONGLONG             lastscan;
+
+    // available COM ports
+    portlist->optFlags &= ~(OPT_FLAG_ALL | OPT_FLAG_EXCLUDE_AVAILABLE | OPT_FLAG_EXCLUDE_COM |
+                            OPT_FLAG_NAMESONLY | OPT_FLAG_STREAM);
+    portlist->optFlags |= OPT_FLAG_EXCLUDE_LPT;
+    portlist->rundeadline = deadlineafter(portlist->runtimeout);
+    enumerateports(portlist);
+    for (p = portlist->ports; p; p = p->next) {
+        count++;
+    }
+    if (count == 0) {
+        errorprint(L"-counters: no matching COM ports found");
+        return -1;
+    }
+
+    pcs = (struct portcounters*) calloc(count, sizeof(struct portcounters));
+    worker = statsworkerstart();
+    timer = CreateWaitableTimer(NULL, FALSE, NULL);
+    due.QuadPart = -1; // first sample straight away
+    if ((pcs == NULL) || (worker == NULL) || (timer == NULL) ||
+            !SetWaitableTimer(timer, &due, interval * 1000, NULL, NULL, FALSE)) {
+        errorprint(L"-counters: could not start sampling");
+        return -1;
+    }
+    for (i = 0, p = portlist->ports; p; p = p->next, i++) {
+        pcs[i].port = p;
+    }
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    trackportowners(portlist, pcs, count);
+    lastscan = now.QuadPart;
+
+    wprintf(L"Sampling %u port%s every %u second%s, Ctrl+C to stop.\n", count, (count != 1) ? L"s" : L"",
+        interval, (interval != 1) ? L"s" : L"");
+
+    for (;;) {
+        SYSTEMTIME st;
+        Bool       rescan = False;
+
+        WaitForSingleObject(timer, INFINITE);
+        QueryPerformanceCounter(&now);
+
+        // look for newly opened ports, or ports whose handle could not be used
+        if ((now.QuadPart - lastscan) * 1000 / freq.QuadPart >= COUNTERS_RESCAN_MS) {
+            for (i = 0; i < count; i++) {
+                rescan |= !pcs[i].processid || pcs[i].error;
+            }
+        }
+        if (rescan) {
+            trackportowners(portlist, pcs, count);
+            lastscan = now.QuadPart;
+        }
+
+        GetLocalTime(&st);
+        wprintf(L"\n%02u:%02u:%02u Owner                     rx B/s    tx B/s  frame parity overrun  bufovr\n",
+            st.wHour, st.wMinute, st.wSecond);
+
+        for (i = 0; i < count; i++) {
+            struct portcounters* pc = &pcs[i];
+            struct serialstats   stats;
+
+            memset(&stats, 0, sizeof(stats));
+            if (pc->process && worker) {
+                if (querycounters(&worker, &stuck, pc, &stats)) {
+                    printcounters(pc, &stats, now.QuadPart, freq.QuadPart);
+                    pc->last = stats;
+                    pc->lasttime = now.QuadPart;
+                    pc->havelast = True;
+                    continue;
+                }
+                pc->havelast = False;
+            }
+            printcounters(pc, &stats, now.QuadPart, freq.QuadPart);
+        }
+        fflush(stdout);
+    }
+}
+
+
+// interrupts allocated to a device node, or its boot configuration for legacy devices
+unsigned getdeviceirqs(DEVINST devinst, struct irqdesc* irqs)
+{
+    LOG_CONF   conf;
+    RES_DES    res;
+    RES_DES    next;
+    ULONG_PTR  data[16];    // IRQ_RESOURCE, aligned
+    ULONG      size;
+    unsigned   count = 0;
+    CONFIGRET  result;
+
+    if ((CM_Get_First_Log_Conf(&conf, devinst, ALLOC_LOG_CONF) != CR_SUCCESS) &&
+            (CM_Get_First_Log_Conf(&conf, devinst, BOOT_LOG_CONF) != CR_SUCCESS)) {
+        return 0;
+    }
+
+    result = CM_Get_Next_Res_Des(&res, conf, ResType_IRQ, NULL, 0);
+    while ((result == CR_SUCCESS) && (count < IRQ_DEVICE_IRQS)) {
+        if ((CM_Get_Res_Des_Data_Size(&size, res, 0) == CR_SUCCESS) && (size >= sizeof(IRQ_DES)) &&
+                (size <= sizeof(data)) && (CM_Get_Res_Des_Data(res, data, size, 0) == CR_SUCCESS)) {
+            const IRQ_DES* des = (const IRQ_DES*) data;
+
+            irqs[count].irq = des->IRQD_Alloc_Num;
+            irqs[count].affinity = des->IRQD_Affinity;
+            irqs[count].flags = des->IRQD_Flags;
+            count++;
+        }
+        result = CM_Get_Next_Res_Des(&next, res, ResType_IRQ, NULL, 0);
+        CM_Free_Res_Des_Handle(res);
+        res = next;
+    }
+    if (result == CR_SUCCESS) {
+        // stopped at IRQ_DEVICE_IRQS
+        CM_Free_Res_Des_Handle(res);
+    }
+    CM_Free_Log_Conf_Handle(conf);
+
+    return count;
+}
+
+
+// the listed port that a Ports, Modem or Multiport Serial class device is, or NULL
+PortInfo* irqfindport(PortList* portlist, HDEVINFO hDevInfo, SP_DEVINFO_DATA* pDeviceInfoData)
+{
+    PortInfo* p = NULL;
+    wchar_t*  portname;
+    HKEY      devkey;
+    unsigned  i;
+
+    for (i = 0; i < PORT_CLASSES; i++) {
+        if (IsEqualGUID(&pDeviceInfoData->ClassGuid, portclasses[i].guid)) {
+            break;
+        }
+    }
+    if (i == PORT_CLASSES) {
+        return NULL;
+    }
+
+    devkey = SetupDiOpenDevRegKey(hDevInfo, pDeviceInfoData, DICS_FLAG_GLOBAL, 0, DIREG_DEV, KEY_QUERY_VALUE);
+    if (devkey == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    portname = getportname(devkey);
+    RegCloseKey(devkey);
+
+    if (portname) {
+        for (p = portlist->ports; p; p = p->next) {
+            if (!wcsicmp(p->portname, portname)) {
+                break;
+            }
+        }
+        free(portname);
+    }
+
+    return p;
+}
+
+
+/*
+    The interrupts of every present device, and of each matching port. A
+    port without interrupts of its own uses those of the nearest ancestor
+    with any, eg its multiport board or USB host controller, else a legacy
+    port's Interrupt registry value. Returns the number of devices.
+ */
+unsigned irqscan(PortList* portlist, struct irqdevice** pDevices)
+{
+    HDEVINFO          hDevInfo = SetupDiGetClassDevs(NULL, NULL, NULL, DIGCF_ALLCLASSES | DIGCF_PRESENT);
+    SP_DEVINFO_DATA   devinfo;
+    struct irqdevice* devices = NULL;
+    unsigned          count = 0;
+    unsigned          max = 0;
+    DWORD             index;
+
+    *pDevices = NULL;
+    if (hDevInfo == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+
+    devinfo.cbSize = sizeof(SP_DEVINFO_DATA);
+    for (index = 0; SetupDiEnumDeviceInfo(hDevInfo, index, &devinfo); index++) {
+        struct irqdevice d;
+        DEVINST          ancestor = devinfo.DevInst;
+        unsigned         level;
+
+        memset(&d, 0, sizeof(d));
+        d.devinst = devinfo.DevInst;
+        d.count = getdeviceirqs(devinfo.DevInst, d.irqs);
+        d.port = irqfindport(portlist, hDevInfo, &devinfo);
+        if (d.port) {
+            for (level = 0; (d.count == 0) && (level < USB_ANCESTORS_MAX); level++) {
+                if (CM_Get_Parent(&ancestor, ancestor, 0) != CR_SUCCESS) {
+                    break;
+                }
+                d.count = getdeviceirqs(ancestor, d.irqs);
+                if (d.count) {
+                    d.devinst = ancestor;
+                    d.via = devnodestringproperty(ancestor, CM_DRP_DEVICEDESC);
+                }
+            }
+            if ((d.count == 0) && (d.port->retrieved & RETRIEVED_INTERRUPT)) {
+                d.irqs[0].irq = d.port->interrupt;
+                d.isRegistry = True;
+                d.count = 1;
+            }
+        } else if (d.count) {
+            d.name = portstringproperty(hDevInfo, &devinfo, SPDRP_FRIENDLYNAME);
+            if (d.name == NULL) {
+                d.name = portstringproperty(hDevInfo, &devinfo, SPDRP_DEVICEDESC);
+            }
+        } else {
+            continue;
+        }
+
+        if (count == max) {
+            struct irqdevice* grown = (struct irqdevice*) realloc(devices, (max + 64) * sizeof(struct irqdevice));
+
+            if (grown == NULL) {
+                free(d.name);
+                free(d.via);
+                break;
+            }
+            devices = grown;
+            max += 64;
+        }
+        devices[count++] = d;
+    }
+    SetupDiDestroyDeviceInfoList(hDevInfo);
+
+    *pDevices = devices;
+    return count;
+}
+
+
+// eg IRQ 4, or MSI -5 for a message signalled interrupt
+void irqname(wchar_t* text, size_t size, const struct irqdesc* irq)
+{
+    if ((LONG) irq->irq < 0) {
+        _snwprintf(text, size - 1, L"MSI %ld", (LONG) irq->irq);
+    } else {
+        _snwprintf(text, size - 1, L"IRQ %lu", irq->irq);
+    }
+    text[size - 1] = L'\0';
+}
+
+
+// processor numbers of an affinity mask, eg 0-3,6
+void cpulist(wchar_t* text, size_t size, ULONG_PTR mask)
+{
+    size_t   used = 0;
+    unsigned cpu = 0;
+    unsigned last;
+
+    if (mask == 0) {
+        wcsncpy(text, L"any", size);
+        return;
+    }
+
+    text[0] = L'\0';
+    while ((cpu < IRQ_CPUS_MAX) && (used + 16 < size)) {
+        if (!(mask & ((ULONG_PTR) 1 << cpu))) {
+            cpu++;
+            continue;
+        }
+        for (last = cpu; (last + 1 < IRQ_CPUS_MAX) && (mask & ((ULONG_PTR) 1 << (last + 1))); last++) {
+        }
+        used += _snwprintf(text + used, size - used - 1, (last > cpu) ? L"%s%u-%u" : L"%s%u",
+            used ? L"," : L"", cpu, last);
+        cpu = last + 1;
+    }
+    text[size - 1] = L'\0';
+}
+
+
+// whether devices[k] is another user of the line of devices[i]'s irq
+Bool irqshared(const struct irqdevice* devices, unsigned i, unsigned k, const struct irqdesc* irq)
+{
+    const struct irqdevice* other = &devices[k];
+    unsigned                m;
+
+    // message signalled interrupts are never shared
+    if ((LONG) irq->irq < 0) {
+        return False;
+    }
+    // the board or controller the port interrupts through is not another user of the line
+    if ((k == i) || ((other->port == NULL) && (other->devinst == devices[i].devinst))) {
+        return False;
+    }
+    for (m = 0; m < other->count; m++) {
+        if (other->irqs[m].irq == irq->irq) {
+            return True;
+        }
+    }
+    return False;
+}
+
+
+// the interrupts of the matching ports, where they are routed & the devices sharing them
+void printirqs(struct irqdevice* devices, unsigned count)
+{
+    wchar_t  name[IRQ_TEXT_MAX];
+    wchar_t  cpus[IRQ_TEXT_MAX];
+    unsigned i;
+    unsigned j;
+    unsigned k;
+
+    for (i = 0; i < count; i++) {
+        const struct irqdevice* d = &devices[i];
+
+        if (d->port == NULL) {
+            continue;
+        }
+        if (d->count == 0) {
+            wprintf(L"%-6s no interrupt found\n", d->port->portname);
+            continue;
+        }
+
+        for (j = 0; j < d->count; j++) {
+            const struct irqdesc* irq = &d->irqs[j];
+            Bool                  shared = False;
+
+            irqname(name, IRQ_TEXT_MAX, irq);
+            cpulist(cpus, IRQ_TEXT_MAX, irq->affinity);
+            if (d->isRegistry) {
+                wprintf(L"%-6s %s, CPUs %s, legacy Interrupt registry value\n", d->port->portname, name, cpus);
+            } else {
+                wprintf(L"%-6s %s, %s%s, CPUs %s\n", j ? L"" : d->port->portname, name,
+                    (irq->flags & fIRQD_Edge) ? L"edge" : L"level", (irq->flags & fIRQD_Share) ? L" sharable" : L"",
+                    cpus);
+            }
+            if ((j == 0) && d->via) {
+                wprintf(L"       through %s\n", d->via);
+            }
+
+            for (k = 0; k < count; k++) {
+                const struct irqdevice* other = &devices[k];
+
+                if (irqshared(devices, i, k, irq)) {
+                    wprintf(shared ? L"                   %s\n" : L"       shared with %s\n",
+                        other->port ? other->port->portname : other->name ? other->name : L"unnamed device");
+                    shared = True;
+                }
+            }
+        }
+    }
+}
+
+
+/*
+    -irq: the interrupts the matching ports use & the devices sharing them,
+    then every -interval seconds until stopped, each processor's interrupt
+    rate, interrupt & DPC time, and the port interrupts routed to it. From
+    these the port interrupts can be given the affinity of quieter
+    processors.
+ */
+int irqloop(PortList* portlist)
+{
+    const unsigned              interval = portlist->interval ? portlist->interval : 1;
+    HMODULE                     ntdll = GetModuleHandle(L"ntdll.dll");
+    ntquerysysteminformation_fn ntquerysysteminformation;
+    struct irqdevice*           devices;
+    struct cpuperf*             perf;
+    struct cpuperf*             last;
+    SYSTEM_INFO                 si;
+    unsigned                    cpus;
+    unsigned                    count;
+    unsigned                    i;
+    unsigned                    j;
+    ULONG                       length;
+    ULONG                       returned = 0;
+    HANDLE                      timer;
+    LARGE_INTEGER               due;
+    LARGE_INTEGER               freq;
+    LARGE_INTEGER               now;
+    LARGE_INTEGER               then;
+
+    // available ports, with the legacy Interrupt value
+    portlist->optFlags &= ~(OPT_FLAG_ALL | OPT_FLAG_EXCLUDE_AVAILABLE | OPT_FLAG_NAMESONLY | OPT_FLAG_STREAM);
+    portlist->optFlags |= OPT_FLAG_LONGFORM | OPT_FLAG_VERBOSE;
+    portlist->rundeadline = deadlineafter(portlist->runtimeout);
+    enumerateports(portlist);
+    if (portlist->ports == NULL) {
+        errorprint(L"-irq: no matching ports found");
+        return -1;
+    }
+
+    count = irqscan(portlist, &devices);
+    printirqs(devices, count);
+
+    GetSystemInfo(&si);
+    cpus = (si.dwNumberOfProcessors < IRQ_CPUS_MAX) ? si.dwNumberOfProcessors : IRQ_CPUS_MAX;
+    length = cpus * sizeof(struct cpuperf);
+    ntquerysysteminformation = ntdll ?
+        (ntquerysysteminformation_fn) GetProcAddress(ntdll, "NtQuerySystemInformation") : NULL;
+    perf = (struct cpuperf*) calloc(2 * cpus, sizeof(struct cpuperf));
+    last = perf ? perf + cpus : NULL;
+    timer = CreateWaitableTimer(NULL, FALSE, NULL);
+    due.QuadPart = -(LONGLONG) interval * 10000000; // first rates after one interval
+    if ((ntquerysysteminformation == NULL) || (perf == NULL) || (timer == NULL) ||
+            (ntquerysysteminformation(SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION, last, length, &returned) < 0) ||
+            !SetWaitableTimer(timer, &due, interval * 1000, NULL, NULL, FALSE)) {
+        errorprint(L"-irq: could not sample the processor interrupt counts");
+        return -1;
+    }
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&then);
+
+    wprintf(L"\nSampling %u processor%s every %u second%s, Ctrl+C to stop.\n", cpus, (cpus != 1) ? L"s" : L"",
+        interval, (interval != 1) ? L"s" : L"");
+
+    for (;;) {
+        SYSTEMTIME st;
+        double     ticks;       // 100 ns units, of the processor times
+
+        WaitForSingleObject(timer, INFINITE);
+        QueryPerformanceCounter(&now);
+        if (ntquerysysteminformation(SYSTEM_PROCESSOR_PERFORMANCE_INFORMATION, perf, length, &returned) < 0) {
+            continue;
+        }
+        ticks = (double) (now.QuadPart - then.QuadPart) * 1.0e7 / (double) freq.QuadPart;
+
+        GetLocalTime(&st);
+        wprintf(L"\n%02u:%02u:%02u CPU    int/s  int%%  dpc%%  port interrupts\n", st.wHour, st.wMinute, st.wSecond);
+
+        for (i = 0; i < cpus; i++) {
+            wchar_t routed[IRQ_TEXT_MAX];
+            size_t  used = 0;
+
+            // the port interrupts this processor may service
+            routed[0] = L'\0';
+            for (j = 0; j < count; j++) {
+                const struct irqdevice* d = &devices[j];
+                unsigned                k;
+
+                for (k = 0; d->port && (k < d->count) && (used + 24 < IRQ_TEXT_MAX); k++) {
+                    wchar_t name[IRQ_TEXT_MAX];
+
+                    if (d->irqs[k].affinity && !(d->irqs[k].affinity & ((ULONG_PTR) 1 << i))) {
+                        continue;
+                    }
+                    irqname(name, IRQ_TEXT_MAX, &d->irqs[k]);
+                    _snwprintf(routed + used, IRQ_TEXT_MAX - used - 1, L"%s%s %s", used ? L", " : L"",
+                        d->port->portname, name);
+                    routed[IRQ_TEXT_MAX - 1] = L'\0';
+                    used = wcslen(routed);
+                }
+            }
+
+            // unsigned difference is right when the count wraps
+            wprintf(L"         %3u %8.0f %5.1f %5.1f  %s\n", i,
+                (double) (ULONG) (perf[i].interrupts - last[i].interrupts) * 1.0e7 / ticks,
+                (double) (perf[i].interrupt.QuadPart - last[i].interrupt.QuadPart) * 100.0 / ticks,
+                (double) (perf[i].dpc.QuadPart - last[i].dpc.QuadPart) * 100.0 / ticks, routed);
+        }
+        fflush(stdout);
+
+        memcpy(last, perf, length);
+        then = now;
+    }
+}
+
+
+void topstaterelease(struct topstate* state)
+{
+    if (InterlockedDecrement(&state->refs) == 0) {
+        porttablepublish(&state->pub, NULL);
+        if (state->publisher) {
+            shmpublishclose(state->publisher);
+        }
+        CloseHandle(state->stop);
+        free(state);
+    }
+}
+
+
+/*
+    Owners of the ports in the last table, copied to the same ports newly
+    enumerated. False if any port has arrived, gone or changed availability,
+    as a handle scan is then needed.
+ */
+Bool topcopyowners(PortTable* last, PortInfo* ports)
+{
+    unsigned  count = 0;
+    unsigned  i;
+    PortInfo* p;
+
+    for (p = ports; p; p = p->next, count++) {
+        for (i = 0; (i < last->count) && wcsicmp(last->index[i]->portname, p->portname); i++) {
+        }
+        if ((i == last->count) || (last->index[i]->isAvailable != p->isAvailable)) {
+            return False;
+        }
+    }
+    if (count != last->count) {
+        return False;
+    }
+
+    for (p = ports; p; p = p->next) {
+        for (i = 0; wcsicmp(last->index[i]->portname, p->portname); i++) {
+        }
+        p->ownerpid = last->index[i]->ownerpid;
+        p->ownerhandle = last->index[i]->ownerhandle;
+        p->isOwnerHidden = last->index[i]->isOwnerHidden;
+        p->ownername = last->index[i]->ownername ? wcsdup(last->index[i]->ownername) : NULL;
+    }
+    return True;
+}
+
+
+/*
+    -top refresher thread, a new port table every interval until stopped.
+    The system handle scan for owners is costly, so it is only repeated
+    when the ports present change, or every TOP_OWNER_RESCAN_MS.
+ */
+DWORD WINAPI toprefresher(LPVOID param)
+{
+    struct topstate* state = (struct topstate*) param;
+    PortList*        pl = &state->enumlist;
+    const Bool       owners = (pl->optFlags & OPT_FLAG_OWNER) || (pl->optXFlags & OPT_XFLAG_COUNTERS);
+    DWORD            lastscan = 0;
+
+    do {
+        PortTable* table;
+
+        pl->ports = NULL;
+        pl->timedout = False;
+        pl->rundeadline = deadlineafter(pl->runtimeout);
+        enumerateports(pl);
+        if (owners) {
+            PortTable* last = porttableacquire(&state->pub);
+
+            if (!last || (GetTickCount() - lastscan >= TOP_OWNER_RESCAN_MS) || !topcopyowners(last, pl->ports)) {
+                findportowners(pl->ports, True);
+                lastscan = GetTickCount();
+            }
+            porttablerelease(last);
+        }
+        if (state->publisher) {
+            shmpublishports(state->publisher, pl->ports);
+        }
+
+        table = porttablebuild(pl->ports);
+        pl->ports = NULL;
+        if (table) {
+            porttablepublish(&state->pub, table);
+        }
+    } while (WaitForSingleObject(state->stop, state->interval) == WAIT_TIMEOUT);
+
+    topstaterelease(state);
+    return 0;
+}
+
+
+// follow the size & position of the console window, a change means the whole frame is drawn
+void topresize(struct topscreen* scr)
+{
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    unsigned                   width;
+    unsigned                   height;
+    size_t                     cells;
+    size_t                     i;
+
+    if (!GetConsoleScreenBufferInfo(scr->console, &csbi)) {
+        return;
+    }
+    width = csbi.srWindow.Right - csbi.srWindow.Left + 1;
+    height = csbi.srWindow.Bottom - csbi.srWindow.Top + 1;
+    if (scr->chars && (width == scr->width) && (height == scr->height) &&
+            (csbi.srWindow.Left == scr->origin.X) && (csbi.srWindow.Top == scr->origin.Y)) {
+        return;
+    }
+
+    free(scr->chars);
+    free(scr->attrs);
+    free(scr->shownchars);
+    free(scr->shownattrs);
+    cells = (size_t) width * height;
+    scr->chars = (wchar_t*) malloc(cells * sizeof(wchar_t));
+    scr->attrs = (WORD*) malloc(cells * sizeof(WORD));
+    scr->shownchars = (wchar_t*) malloc(cells * sizeof(wchar_t));
+    scr->shownattrs = (WORD*) malloc(cells * sizeof(WORD));
+    if (!scr->chars || !scr->attrs || !scr->shownchars || !scr->shownattrs) {
+        free(scr->chars);
+        free(scr->attrs);
+        free(scr->shownchars);
+        free(scr->shownattrs);
+        scr->chars = scr->shownchars = NULL;
+        scr->attrs = scr->shownattrs = NULL;
+        scr->width = scr->height = 0;
+        return;
+    }
+
+    scr->origin.X = csbi.srWindow.Left;
+    scr->origin.Y = csbi.srWindow.Top;
+    scr->width = width;
+    scr->height = height;
+    for (i = 0; i < cells; i++) {
+        scr->shownchars[i] = L' ';
+        scr->shownattrs[i] = TOP_UNDRAWN;
+    }
+}
+
+
+// one row of the frame, text is clipped or padded to the window width
+void topline(struct topscreen* scr, unsigned row, WORD attr, const wchar_t* text)
+{
+    wchar_t* chars;
+    WORD*    attrs;
+    unsigned col;
+
+    if (row >= scr->height) {
+        return;
+    }
+    chars = scr->chars + (size_t) row * scr->width;
+    attrs = scr->attrs + (size_t) row * scr->width;
+    for (col = 0; col < scr->width; col++) {
+        chars[col] = *text ? *text++ : L' ';
+        attrs[col] = attr;
+    }
+}
+
+
+// write the cells of the frame that differ from the screen, returns the number written
+unsigned topflush(struct topscreen* scr)
+{
+    unsigned written = 0;
+    unsigned row;
+
+    for (row = 0; row < scr->height; row++) {
+        const size_t base = (size_t) row * scr->width;
+        unsigned     col = 0;
+
+        while (col < scr->width) {
+            unsigned start;
+            unsigned end;
+            COORD    at;
+            DWORD    count;
+
+            if ((scr->chars[base + col] == scr->shownchars[base + col]) &&
+                    (scr->attrs[base + col] == scr->shownattrs[base + col])) {
+                col++;
+                continue;
+            }
+
+            // one write for a run of changes, short unchanged gaps included
+            start = col;
+            for (end = ++col; col < scr->width; col++) {
+                if ((scr->chars[base + col] != scr->shownchars[base + col]) ||
+                        (scr->attrs[base + col] != scr->shownattrs[base + col])) {
+                    end = col + 1;
+                } else if (col - end >= TOP_RUN_GAP) {
+                    break;
+                }
+            }
+
+            at.X = (SHORT) (scr->origin.X + start);
+            at.Y = (SHORT) (scr->origin.Y + row);
+            WriteConsoleOutputCharacterW(scr->console, scr->chars + base + start, end - start, at, &count);
+            WriteConsoleOutputAttribute(scr->console, scr->attrs + base + start, end - start, at, &count);
+            memcpy(scr->shownchars + base + start, scr->chars + base + start, (end - start) * sizeof(wchar_t));
+            memcpy(scr->shownattrs + base + start, scr->attrs + base + start, (end - start) * sizeof(WORD));
+            written += end - start;
+            col = end;
+        }
+    }
+
+    return written;
+}
+
+
+/*
+    Carry the -top rows over to a new table, into rows which has room for
+    the ports of both. Ports that arrive, are removed or change availability
+    are highlighted from now, removed ports are kept while highlighted. now
+    is 0 for the first table. Returns the new row count.
+ */
+unsigned topmerge(struct toprow* old, unsigned count, struct toprow* rows, PortTable* table, LONGLONG now,
+    LONGLONG highlight, Bool rates)
+{
+    unsigned n = 0;
+    unsigned i;
+    unsigned j;
+
+    for (j = 0; j < count; j++) {
+        old[j].seen = False;
+    }
+
+    for (i = 0; i < table->count; i++) {
+        PortInfo*      p = table->index[i];
+        struct toprow* row = &rows[n++];
+
+        for (j = 0; (j < count) && (old[j].seen || _wcsicmp(old[j].portname, p->portname)); j++) {
+        }
+
+        if (j < count) {
+            *row = old[j];
+            old[j].seen = True;
+            if (row->port == NULL) {
+                // back again
+                row->changed = now;
+                row->isNew = True;
+            } else if (row->isAvailable != p->isAvailable) {
+                row->changed = now;
+                row->isNew = False;
+            }
+        } else {
+            wcsncpy(row->portname, p->portname, 15);
+            row->changed = now;
+            row->isNew = True;
+        }
+        row->port = p;
+        row->isAvailable = p->isAvailable;
+        if (rates) {
+            row->counters.port = p;
+            trackportowner(&row->counters);
+        }
+    }
+
+    for (j = 0; j < count; j++) {
+        struct toprow* row = &old[j];
+
+        if (row->seen) {
+            continue;
+        }
+        if (row->port) {
+            row->port = NULL;
+            row->counters.port = NULL;
+            row->haverates = False;
+            row->changed = now;
+        }
+        if (row->changed && (now - row->changed < highlight)) {
+            rows[n++] = *row;
+        } else if (row->counters.process) {
+            CloseHandle(row->counters.process);
+        }
+    }
+
+    return n;
+}
+
+
+// -top -counters traffic rates of the open ports, through their owners' handles
+void topsample(struct statsworker** pWorker, struct stuckqueries* stuck, struct toprow* rows, unsigned count,
+    LONGLONG now, LONGLONG freq)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        struct portcounters* pc = &rows[i].counters;
+        struct serialstats   stats;
+
+        rows[i].haverates = False;
+        if (!rows[i].port || !pc->process || (*pWorker == NULL)) {
+            continue;
+        }
+        if (!querycounters(pWorker, stuck, pc, &stats)) {
+            pc->havelast = False;
+            continue;
+        }
+
+        if (pc->havelast && (now > pc->lasttime)) {
+            double seconds = (double) (now - pc->lasttime) / (double) freq;
+
+            // unsigned differences are right when the counts wrap
+            rows[i].rxrate = (double) (ULONG) (stats.received - pc->last.received) / seconds;
+            rows[i].txrate = (double) (ULONG) (stats.transmitted - pc->last.transmitted) / seconds;
+            rows[i].haverates = True;
+        }
+        pc->last = stats;
+        pc->lasttime = now;
+        pc->havelast = True;
+    }
+}
+
+
+// text of a -top port row, in line[TOP_LINE_MAX]
+void topportline(wchar_t* line, const struct toprow* row, unsigned opt_flags, Bool rates)
+{
+    const PortInfo* p = row->port;
+    wchar_t         ids[16] = L"";
+    wchar_t         owner[64] = L"";
+    wchar_t         traffic[32] = L"";
+    wchar_t         text[32] = L"";
+    const wchar_t*  avail = L"";
+
+    if (opt_flags & OPT_FLAG_ALL) {
+        avail = p ? (p->isAvailable ? L"A " : L". ") : L"  ";
+    }
+    if (p && (p->haveUSBid || p->havePCIid)) {
+        _snwprintf(ids, 15, (p->retrieved & RETRIEVED_USB_REV) ? L"%04lX %04lX %04lX " : L"%04lX %04lX      ",
+            p->vendorId, p->productId, p->revision);
+        ids[15] = L'\0';
+    }
+
+    if (opt_flags & OPT_FLAG_OWNER) {
+        if (p && p->ownerpid) {
+            _snwprintf(text, 31, L"%s (%lu)", p->ownername ? p->ownername : L"?", p->ownerpid);
+            text[31] = L'\0';
+        }
+        _snwprintf(owner, 63, L"%-24.24s ", text);
+        owner[63] = L'\0';
+    }
+
+    if (rates) {
+        const struct portcounters* pc = &row->counters;
+
+        if (!p) {
+            text[0] = L'\0';
+        } else if (row->haverates) {
+            _snwprintf(text, 31, L"%9.0f %9.0f", row->rxrate, row->txrate);
+        } else if (pc->stalled) {
+            wcscpy(text, L"busy");
+        } else if (!p->ownerpid && p->isOwnerHidden) {
+            wcscpy(text, L"not accessible");
+        } else if (pc->error == ERROR_ACCESS_DENIED) {
+            wcscpy(text, L"access denied");
+        } else if ((pc->error == ERROR_INVALID_FUNCTION) || (pc->error == ERROR_NOT_SUPPORTED)) {
+            wcscpy(text, L"no counters");
+        } else {
+            text[0] = L'\0';
+        }
+        text[31] = L'\0';
+        _snwprintf(traffic, 31, L"%-19.19s ", text);
+        traffic[31] = L'\0';
+    }
+
+    _snwprintf(line, TOP_LINE_MAX - 1, L"%-6s %s%-15s%s%s%s", row->portname, avail, ids, owner, traffic,
+        !p ? L"(removed)" : (p->friendlyname ? p->friendlyname : L""));
+    line[TOP_LINE_MAX - 1] = L'\0';
+}
+
+
+// draw the whole -top frame, topflush() then writes just what changed
+void topdraw(struct topscreen* scr, unsigned opt_flags, struct toprow* rows, unsigned count, LONGLONG now,
+    LONGLONG freq, Bool rates)
+{
+    const WORD      background = scr->normal & 0xF0;
+    const WORD      title = (WORD) (((scr->normal & 0x0F) << 4) | ((scr->normal & 0xF0) >> 4));
+    const LONGLONG  highlight = freq * TOP_HIGHLIGHT_MS / 1000;
+    wchar_t         line[TOP_LINE_MAX];
+    wchar_t         avail[32] = L"";
+    SYSTEMTIME      st;
+    unsigned        available = 0;
+    unsigned        removed = 0;
+    unsigned        visible = 0;
+    unsigned        row;
+    unsigned        i;
+
+    if (scr->height == 0) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (rows[i].port == NULL) {
+            removed++;
+        } else if (rows[i].isAvailable) {
+            available++;
+        }
+    }
+    if (opt_flags & OPT_FLAG_ALL) {
+        _snwprintf(avail, 31, L", %u available", available);
+        avail[31] = L'\0';
+    }
+    GetLocalTime(&st);
+    _snwprintf(line, TOP_LINE_MAX - 1, L"portlist -top  %02u:%02u:%02u  %u port%s%s, %u removed    q to quit",
+        st.wHour, st.wMinute, st.wSecond, count - removed, (count - removed != 1) ? L"s" : L"", avail, removed);
+    line[TOP_LINE_MAX - 1] = L'\0';
+    topline(scr, 0, title, line);
+
+    _snwprintf(line, TOP_LINE_MAX - 1, L"Port   %sVID  PID  Rev  %s%sFriendly name",
+        (opt_flags & OPT_FLAG_ALL) ? L"A " : L"", (opt_flags & OPT_FLAG_OWNER) ? L"Owner                    " : L"",
+        rates ? L"   rx B/s    tx B/s " : L"");
+    line[TOP_LINE_MAX - 1] = L'\0';
+    topline(scr, 1, scr->normal | FOREGROUND_INTENSITY, line);
+
+    // rows that fit, keeping the last line to say how many more there are
+    if (scr->height > 2) {
+        visible = scr->height - 2;
+        if (count > visible) {
+            visible--;
+        }
+    }
+
+    for (row = 2, i = 0; row < scr->height; row++, i++) {
+        WORD attr = scr->normal;
+
+        if (i >= count) {
+            topline(scr, row, scr->normal, L"");
+            continue;
+        }
+        if (i >= visible) {
+            _snwprintf(line, TOP_LINE_MAX - 1, L"... %u more", count - visible);
+            line[TOP_LINE_MAX - 1] = L'\0';
+            topline(scr, row, scr->normal, line);
+            continue;
+        }
+
+        if (rows[i].port == NULL) {
+            attr = background | FOREGROUND_RED | FOREGROUND_INTENSITY;
+        } else if (rows[i].changed && (now - rows[i].changed < highlight)) {
+            attr = background | FOREGROUND_INTENSITY |
+                (rows[i].isNew ? FOREGROUND_GREEN : (FOREGROUND_RED | FOREGROUND_GREEN));
+        }
+        topportline(line, &rows[i], opt_flags, rates);
+        topline(scr, row, attr, line);
+    }
+}
+
+
+/*
+    -top: full screen view of the matching ports until q, Esc or Ctrl+C is
+    pressed. Ports that arrive, are removed or change availability (with -a)
+    are highlighted for a while. -counters adds traffic rates of open COM
+    ports, -owner the program using each. The ports are enumerated every
+    -interval seconds on the refresher thread, so the view stays responsive.
+    The view is drawn in a screen buffer of its own, so the window is as it
+    was when the view ends.
+ */
+int topview(PortList* portlist)
+{
+    const Bool                 rates = (portlist->optXFlags & OPT_XFLAG_COUNTERS) ? True : False;
+    const unsigned             interval = portlist->interval ? portlist->interval : 1;
+    struct topstate*           state = (struct topstate*) calloc(1, sizeof(struct topstate));
+    struct topscreen           scr;
+    struct toprow*             rows = NULL;
+    struct statsworker*        worker = NULL;
+    struct stuckqueries        stuck = { NULL, 0, 0 };
+    unsigned                   count = 0;
+    unsigned                   generation = 0;
+    PortTable*                 shown = NULL;
+    HANDLE                     input = GetStdHandle(STD_INPUT_HANDLE);
+    HANDLE                     output = GetStdHandle(STD_OUTPUT_HANDLE);
+    HANDLE                     thread = NULL;
+    HANDLE                     waits[2];
+    DWORD                      inputmode;
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    CONSOLE_CURSOR_INFO        cursor;
+    LARGE_INTEGER              due;
+    LARGE_INTEGER              freq;
+    LARGE_INTEGER              now;
+    Bool                       quit = False;
+    unsigned                   i;
+
+    memset(&scr, 0, sizeof(scr));
+    if (state == NULL) {
+        errorprint(L"-top: memory allocation failed");
+        return -1;
+    }
+    if (!GetConsoleScreenBufferInfo(output, &csbi) || !GetConsoleMode(input, &inputmode)) {
+        errorprint(L"-top needs a console window, its input & output cannot be redirected");
+        free(state);
+        return -1;
+    }
+    scr.normal = csbi.wAttributes;
+
+    // the refresher has its own copy of the options, always the long form
+    state->refs = 1;
+    state->enumlist = *portlist;
+    state->enumlist.optFlags &= ~(OPT_FLAG_NAMESONLY | OPT_FLAG_STREAM | OPT_FLAG_SET_LOW_LATENCY);
+    state->enumlist.optFlags |= OPT_FLAG_LONGFORM;
+    state->enumlist.slowest = 0;
+    state->enumlist.ports = NULL;
+    state->interval = interval * 1000;
+    state->stop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (portlist->publishname) {
+        if (!shmpublishopen(&state->shm, portlist->publishname)) {
+            topstaterelease(state);
+            return -1;
+        }
+        state->publisher = &state->shm;
+    }
+
+    waits[0] = CreateWaitableTimer(NULL, FALSE, NULL);
+    waits[1] = input;
+    due.QuadPart = -1; // first frame straight away
+    if (rates) {
+        worker = statsworkerstart();
+    }
+    scr.console = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        CONSOLE_TEXTMODE_BUFFER, NULL);
+    if (scr.console == INVALID_HANDLE_VALUE) {
+        scr.console = NULL;
+    }
+    if (state->stop && waits[0] && (worker || !rates) && scr.console &&
+            SetWaitableTimer(waits[0], &due, interval * 1000, NULL, NULL, FALSE)) {
+        InterlockedIncrement(&state->refs);
+        thread = CreateThread(NULL, 0, toprefresher, state, 0, NULL);
+        if (thread == NULL) {
+            InterlockedDecrement(&state->refs);
+        }
+    }
+    if ((thread == NULL) || !SetConsoleActiveScreenBuffer(scr.console)) {
+        errorprintf(L"-top: could not start - error %#X", GetLastError());
+        return -1;
+    }
+
+    // keys (Ctrl+C included) & window size changes are read as input
+    SetConsoleMode(input, ENABLE_WINDOW_INPUT);
+    GetConsoleCursorInfo(scr.console, &cursor);
+    cursor.bVisible = FALSE;
+    SetConsoleCursorInfo(scr.console, &cursor);
+    QueryPerformanceFrequency(&freq);
+
+    while (!quit) {
+        DWORD      woken = WaitForMultipleObjects(2, waits, FALSE, INFINITE);
+        PortTable* table;
+
+        if (woken == WAIT_OBJECT_0 + 1) {
+            INPUT_RECORD events[16];
+            DWORD        n = 0;
+
+            ReadConsoleInputW(input, events, 16, &n);
+            for (i = 0; i < n; i++) {
+                if ((events[i].EventType == KEY_EVENT) && events[i].Event.KeyEvent.bKeyDown) {
+                    WCHAR c = events[i].Event.KeyEvent.uChar.UnicodeChar;
+
+                    if ((c == L'q') || (c == L'Q') || (c == 3) ||
+                            (events[i].Event.KeyEvent.wVirtualKeyCode == VK_ESCAPE)) {
+                        quit = True;
+                    }
+                }
+            }
+            if (quit) {
+                break;
+            }
+        } else if (woken != WAIT_OBJECT_0) {
+            errorprintf(L"-top: wait failed - error %#X", GetLastError());
+            break;
+        }
+        QueryPerformanceCounter(&now);
+
+        // rows point into the table shown, which is kept until the next one replaces it
+        table = porttableacquire(&state->pub);
+        if (table && (table->generation != generation)) {
+            struct toprow* merged = (struct toprow*) calloc(table->count + count + 1, sizeof(struct toprow));
+
+            if (merged) {
+                count = topmerge(rows, count, merged, table, generation ? now.QuadPart : 0,
+                    freq.QuadPart * TOP_HIGHLIGHT_MS / 1000, rates);
+                free(rows);
+                rows = merged;
+                generation = table->generation;
+                if (shown) {
+                    porttablerelease(shown);
+                }
+                shown = table;
+                table = NULL;
+            }
+        }
+        if (table) {
+            porttablerelease(table);
+        }
+
+        if (rates && (woken == WAIT_OBJECT_0)) {
+            topsample(&worker, &stuck, rows, count, now.QuadPart, freq.QuadPart);
+        }
+
+        topresize(&scr);
+        topdraw(&scr, state->enumlist.optFlags, rows, count, now.QuadPart, freq.QuadPart, rates);
+        topflush(&scr);
+    }
+
+    // stop the refresher, cutting short an enumeration in progress; if stuck in a driver it is left the state
+    InterlockedExchange(&state->enumlist.cancel, 1);
+    SetEvent(state->stop);
+    WaitForSingleObject(thread, TOP_QUIT_MS);
+    CloseHandle(thread);
+    CloseHandle(waits[0]);
+
+    // back to the window as it was
+    SetConsoleMode(input, inputmode);
+    SetConsoleActiveScreenBuffer(output);
+    CloseHandle(scr.console);
+
+    for (i = 0; i < count; i++) {
+        if (rows[i].counters.process) {
+            CloseHandle(rows[i].counters.process);
+        }
+    }
+    free(rows);
+    free(scr.chars);
+    free(scr.attrs);
+    free(scr.shownchars);
+    free(scr.shownattrs);
+    if (shown) {
+        porttablerelease(shown);
+    }
+    topstaterelease(state);
+    if (worker) {
+        worker->quit = True;
+        SetEvent(worker->wake);
+        statsworkerrelease(worker);
+    }
+    stuckqueriesfree(&stuck);
+
+    return 0;
+}
+
+
+void listports(PortList* portlist)
+{
+    const unsigned  opt_flags = portlist->optFlags;
+    PortInfo*       p;
+    unsigned        count;
+
+    if (opt_flags & OPT_FLAG_STREAM) {
+        // ports are printed by portfound() as they are found
+        if (!(opt_flags & OPT_FLAG_NAMESONLY)) {
+            printheader(opt_flags, NULL);
+            fflush(stdout);
+        }
+    }
+
+    count = portlist->runtimeout ? enumeratewithdeadline(portlist) : enumerateports(portlist);
+
+    if (opt_flags & OPT_FLAG_HISTORY) {
+        count += updatehistory(portlist);
+
+        // -x, the available ports were only kept to be logged
+        if (opt_flags & OPT_FLAG_EXCLUDE_AVAILABLE) {
+            PortInfo** link;
+
+            for (link = &portlist->ports; *link; ) {
+                p = *link;
+                if (p->isAvailable) {
+                    *link = p->next;
+                    freeportinfo(p);
+                    count--;
+                } else {
+                    link = &p->next;
+                }
+            }
+        }
+    }
+    if ((opt_flags & OPT_FLAG_OWNER) && !(opt_flags & OPT_FLAG_NAMESONLY)) {
+        findportowners(portlist->ports, False);
+    }
+
+    // print details of all the (matching) ports we found
+    if (!(opt_flags & (OPT_FLAG_NAMESONLY | OPT_FLAG_STREAM))) {
+        printheader(opt_flags, NULL);
+    }
+
+    if (opt_flags & OPT_FLAG_STREAM) {
+        // already printed
+    } else if (opt_flags & OPT_FLAG_TREE) {
+        printtree(opt_flags, portlist->ports, count);
+    } else {
+        for (p = portlist->ports; p; p = p->next) {
+            printport(opt_flags, p);
+
+            // in verbose mode, if there is another port to print add a spacing line
+            if ((opt_flags & OPT_FLAG_VERBOSE) && p->next) {
+                wprintf(L"\n");
+            }
+        }
+    }
+
+    if (!(opt_flags & OPT_FLAG_NAMESONLY)) {
+        printfooter(opt_flags, count);
+    }
+    if ((opt_flags & OPT_FLAG_VERBOSE) && !(opt_flags & (OPT_FLAG_NAMESONLY | OPT_FLAG_STREAM))) {
+        printusbbudget(portlist);
+    }
+    if (portlist->timedout) {
+        errorprintf(L"enumeration stopped after %u ms, list is incomplete", portlist->runtimeout);
+    }
+    if (opt_flags & OPT_FLAG_SET_LOW_LATENCY) {
+        wprintf(L"%u port%s set to %u ms latency timer.\n", portlist->latencyset,
+            (portlist->latencyset != 1) ? L"s" : L"", LOW_LATENCY_TIMER_MS);
+    }
+    if (portlist->slowest) {
+        printcostreport(portlist);
+        freecostreport(portlist->costs);
+        portlist->costs = NULL;
+    }
+
+    if (opt_flags & OPT_FLAG_SAVE_SNAPSHOT) {
+        savesnapshot(portlist, portlist->savefile);
+    }
+    if (portlist->exportfile) {
+        exportports(portlist->ports, portlist->exportfile);
+    }
+}
+
+
+/*
+    Asynchronous enumeration, for callers that must not block. The ports are
+    found on a worker thread, each accepted port is passed to onportfound as
+    it is found, then ondone is called with a summary. Both callbacks are
+    made on the worker thread. The ports remain in portlist->ports, which the
+    caller must leave alone until the enumeration is done.
+ */
+DWORD WINAPI enumerationworker(LPVOID param)
+{
+    AsyncEnum*  ae = (AsyncEnum*) param;
+    PortList*   portlist = ae->portlist;
+    PortInfo*   p;
+
+    ae->summary.count = enumerateports(portlist);
+
+    // topology query results are only known now
+    if (portlist->onportfound && (portlist->optFlags & (OPT_FLAG_HUBQUERY | OPT_FLAG_SIBLINGQUERY))) {
+        for (p = portlist->ports; p && !enumstopped(portlist); p = p->next) {
+            portlist->onportfound(portlist->context, p);
+        }
+    }
+
+    ae->summary.cancelled = enumstopped(portlist);
+    ae->summary.stats = portlist->stats;
+    if (ae->ondone) {
+        ae->ondone(portlist->context, &ae->summary);
+    }
+
+    return 0;
+}
+
+
+// returns NULL if the worker thread could not be started
+AsyncEnum* startenumeration(PortList* portlist, portfound_fn onportfound, enumdone_fn ondone, void* context)
+{
+    AsyncEnum* ae = (AsyncEnum*) calloc(1, sizeof(AsyncEnum));
+
+    if (ae == NULL) {
+        errorprint(L"startenumeration(): memory allocation failed");
+        return NULL;
+    }
+
+    portlist->onportfound = onportfound;
+    portlist->context = context;
+    portlist->cancel = 0;
+    ae->portlist = portlist;
+    ae->ondone = ondone;
+
+    ae->thread = CreateThread(NULL, 0, enumerationworker, ae, 0, NULL);
+    if (ae->thread == NULL) {
+        errorprintf(L"could not create enumeration thread - error %#X", GetLastError());
+        free(ae);
+        return NULL;
+    }
+
+    return ae;
+}
+
+
+// ask the enumeration to stop, it does so at the next property fetch or device
+void cancelenumeration(AsyncEnum* ae)
+{
+    InterlockedExchange(&ae->portlist->cancel, 1);
+}
+
+
+// True once the enumeration is done and ondone has returned
+Bool waitenumeration(AsyncEnum* ae, DWORD milliseconds)
+{
+    return WaitForSingleObject(ae->thread, milliseconds) == WAIT_OBJECT_0;
+}
+
+
+// wait for the enumeration to finish and free it, the ports stay in the portlist
+void closeenumeration(AsyncEnum* ae)
+{
+    if (ae) {
+        WaitForSingleObject(ae->thread, INFINITE);
+        CloseHandle(ae->thread);
+        ae->portlist->onportfound = NULL;
+        free(ae);
+    }
+}
+
+
+// make a table from a port list, the table owns the list afterwards
+PortTable* porttablebuild(PortInfo* ports)
+{
+    PortTable*  table = (PortTable*) calloc(1, sizeof(PortTable));
+    PortInfo*   p;
+    unsigned    i;
+
+    if (table == NULL) {
+        errorprint(L"porttablebuild(): memory allocation failed");
+        freeportlist(ports);
+        return NULL;
+    }
+
+    for (p = ports; p; p = p->next) {
+        table->count++;
+    }
+    table->index = (PortInfo**) calloc(table->count + 1, sizeof(PortInfo*));
+    if (table->index == NULL) {
+        errorprint(L"porttablebuild(): memory allocation failed");
+        freeportlist(ports);
+        free(table);
+        return NULL;
+    }
+
+    for (p = ports, i = 0; p; p = p->next, i++) {
+        table->index[i] = p;
+        table->buscount[p->bustype]++;
+    }
+
+    // bus indexes share one allocation
+    table->bybus[0] = (PortInfo**) calloc(table->count + 1, sizeof(PortInfo*));
+    if (table->bybus[0] == NULL) {
+        errorprint(L"porttablebuild(): memory allocation failed");
+        freeportlist(ports);
+        free(table->index);
+        free(table);
+        return NULL;
+    }
+    for (i = 1; i < PNP_BUS_TYPES; i++) {
+        table->bybus[i] = table->bybus[i - 1] + table->buscount[i - 1];
+        table->buscount[i - 1] = 0;
+    }
+    table->buscount[PNP_BUS_TYPES - 1] = 0;
+    for (p = ports; p; p = p->next) {
+        table->bybus[p->bustype][table->buscount[p->bustype]++] = p;
+    }
+    table->ports = ports;
+    table->refs = 1; // the caller's reference
+
+    return table;
+}
+
+
+void porttablerelease(PortTable* table)
+{
+    if (table && (InterlockedDecrement(&table->refs) == 0)) {
+        freeportlist(table->ports);
+        free(table->index);
+        free(table->bybus[0]);
+        free(table);
+    }
+}
+
+
+// reference to the current table, or NULL if none published yet; never waits
+PortTable* porttableacquire(struct porttablepub* pub)
+{
+    for (;;) {
+        LONG        epoch = pub->epoch;
+        PortTable*  table;
+
+        InterlockedIncrement(&pub->readers[epoch & 1]);
+        if (epoch != pub->epoch) {
+            // a publish started, announce under the new epoch instead
+            InterlockedDecrement(&pub->readers[epoch & 1]);
+            continue;
+        }
+
+        table = pub->current;
+        if (table) {
+            InterlockedIncrement(&table->refs);
+        }
+        InterlockedDecrement(&pub->readers[epoch & 1]);
+
+        return table;
+    }
+}
+
+
+/*
+    Swap in a new table, taking over the caller's reference to it. Only one
+    thread may publish at a time. Readers that may have seen the old table
+    but not yet taken their reference are waited for, which is a few
+    instructions of their time, then the publisher's reference is dropped.
+ */
+void porttablepublish(struct porttablepub* pub, PortTable* table)
+{
+    PortTable*  old;
+    LONG        epoch;
+
+    if (table) {
+        table->generation = ++pub->generation;
+    }
+    old = (PortTable*) InterlockedExchangePointer((PVOID volatile*) &pub->current, table);
+
+    epoch = InterlockedIncrement(&pub->epoch) - 1;
+    while (pub->readers[epoch & 1] != 0) {
+        YieldProcessor();
+    }
+
+    porttablerelease(old);
+}
+
+
+/*
+    -batch: read all the queries, enumerate once with everything any of
+    them needs, then answer each from the indexed port table. A query for
+    a single bus type only looks at the ports of that bus.
+ */
+#define BATCH_MAX_QUERIES   1000
+#define BATCH_MAX_ARGS      32
+#define BATCH_LINE_LEN      1024
+
+struct batchquery {
+    wchar_t*    line;           // as read, for the result label
+    wchar_t*    args;           // copy split in place, options point into it
+    PortList    query;
+};
+
+
+// split a query line at spaces & tabs, in place
+unsigned splitqueryline(wchar_t* line, wchar_t** argv, unsigned maxargs)
+{
+    unsigned argc = 0;
+
+    for (;;) {
+        while ((*line == L' ') || (*line == L'\t')) {
+            line++;
+        }
+        if ((*line == L'\0') || (argc == maxargs)) {
+            break;
+        }
+
+        argv[argc++] = line;
+        while (*line && (*line != L' ') && (*line != L'\t')) {
+            line++;
+        }
+        if (*line) {
+            *line++ = L'\0';
+        }
+    }
+
+    return argc;
+}
+
+
+// ports a query need look at, from one bus index if it only matches one bus type
+unsigned batchselect(PortTable* table, PortList* query, PortInfo*** pCandidates)
+{
+    const unsigned  match = query->optFlags & OPT_FLAG_MATCH_SPECIFIED;
+    enum pnpbus     bus = PNP_BUS_UNKNOWN;
+
+    if (match && !(match & ~(OPT_FLAG_USBMATCH_VID | OPT_FLAG_USBMATCH_PIDVID | OPT_FLAG_USBMATCH_ANY))) {
+        bus = PNP_BUS_USB;
+    } else if (match && !(match & ~(OPT_FLAG_PCIMATCH_ANY | OPT_FLAG_PCIMATCH_VENDOR | OPT_FLAG_PCIMATCH_DEVICE))) {
+        bus = PNP_BUS_PCI;
+    } else if (match == OPT_FLAG_BLUMATCH_ANY) {
+        bus = PNP_BUS_BLUETOOTH;
+    }
+
+    if (bus != PNP_BUS_UNKNOWN) {
+        *pCandidates = table->bybus[bus];
+        return table->buscount[bus];
+    }
+
+    *pCandidates = table->index;
+    return table->count;
+}
+
+
+int batchquery(PortList* portlist)
+{
+    struct batchquery*  queries = (struct batchquery*) calloc(BATCH_MAX_QUERIES, sizeof(struct batchquery));
+    unsigned            nqueries = 0;
+    unsigned            needflags = 0;
+    unsigned            q;
+    wchar_t             line[BATCH_LINE_LEN];
+    wchar_t*            argv[BATCH_MAX_ARGS];
+    FILE*               f = stdin;
+    PortTable*          table = NULL;
+    int                 errors = 0;
+
+    if (queries == NULL) {
+        errorprint(L"batchquery(): memory allocation failed");
+        return -1;
+    }
+
+    if (portlist->batchfile) {
+        f = _wfopen(portlist->batchfile, L"rt, ccs=UTF-8");
+        if (f == NULL) {
+            errorprintf(L"could not open batch file %s", portlist->batchfile);
+            free(queries);
+            return -1;
+        }
+    }
+
+    // read & check all the queries first, so one enumeration serves them all
+    while (fgetws(line, BATCH_LINE_LEN, f)) {
+        struct batchquery*  bq = &queries[nqueries];
+        size_t              len = wcslen(line);
+        unsigned            argc;
+
+        // a line that does not fit would be split into two queries
+        if ((len == BATCH_LINE_LEN - 1) && (line[len - 1] != L'\n') && !feof(f)) {
+            errorprintf(L"batch query longer than %u characters: %.40s...", BATCH_LINE_LEN - 1, line);
+            errors++;
+            while (fgetws(line, BATCH_LINE_LEN, f) && (line[wcslen(line) - 1] != L'\n')) {
+                // skip the rest of the line
+            }
+            continue;
+        }
+
+        while (len && ((line[len - 1] == L'\n') || (line[len - 1] == L'\r'))) {
+            line[--len] = L'\0';
+        }
+
+        if (nqueries == BATCH_MAX_QUERIES) {
+            const wchar_t* str = line + wcsspn(line, L" \t");
+
+            if ((*str != L'\0') && (*str != L'#')) {
+                errorprintf(L"more than %u batch queries", BATCH_MAX_QUERIES);
+                errors++;
+                break;
+            }
+            continue;
+        }
+
+        bq->line = wcs_dupsubstr(line, len);
+        bq->args = wcs_dupsubstr(line, len);
+        if ((bq->line == NULL) || (bq->args == NULL)) {
+            errorprint(L"batchquery(): memory allocation failed");
+            errors++;
+            break;
+        }
+
+        argc = splitqueryline(bq->args, argv, BATCH_MAX_ARGS);
+        if ((argc == 0) || (argv[0][0] == L'#')) {
+            // blank line or comment
+            free(bq->line);
+            free(bq->args);
+            bq->line = bq->args = NULL;
+            continue;
+        }
+
+        // the command line's -a, -l & -v are the defaults for each query
+        bq->query.optFlags = portlist->optFlags & (OPT_FLAG_ALL | OPT_FLAG_LONGFORM | OPT_FLAG_VERBOSE);
+        if (!checkoptions(&bq->query, argc, argv) || (bq->query.optFlags & ~OPT_FLAG_BATCH_QUERY)) {
+            errorprintf(L"bad or unsupported option in batch query: %s", bq->line);
+            errors++;
+        }
+        if (bq->query.portmatch && !wcsncmp(bq->query.portmatch, L"\\\\.\\", 4)) {
+            bq->query.portmatch += 4;
+        }
+
+        needflags |= bq->query.optFlags;
+        nqueries++;
+    }
+
+    if (f != stdin) {
+        fclose(f);
+    }
+
+    if (!errors) {
+        // one enumeration with all the details any query wants, unfiltered
+        PortList base = *portlist;
+
+        base.optFlags = (needflags & (OPT_FLAG_ALL | OPT_FLAG_LONGFORM | OPT_FLAG_VERBOSE)) | OPT_FLAG_BATCH;
+        base.ports = NULL;
+        if (base.runtimeout) {
+            enumeratewithdeadline(&base);
+        } else {
+            enumerateports(&base);
+        }
+
+        table = porttablebuild(base.ports);
+        if (table == NULL) {
+            errors++;
+        }
+    }
+
+    for (q = 0; !errors && (q < nqueries); q++) {
+        PortList*   query = &queries[q].query;
+        PortInfo**  candidates;
+        unsigned    ncandidates = batchselect(table, query, &candidates);
+        unsigned    i;
+        unsigned    count = 0;
+
+        wprintf(L"%s== Query %u: %s\n", q ? L"\n" : L"", q + 1, queries[q].line);
+        if (!(query->optFlags & OPT_FLAG_NAMESONLY)) {
+            printheader(query->optFlags, NULL);
+        }
+
+        for (i = 0; i < ncandidates; i++) {
+            if (checkportfilters(query, candidates[i])) {
+                if ((query->optFlags & OPT_FLAG_VERBOSE) && count) {
+                    wprintf(L"\n");
+                }
+                printport(query->optFlags, candidates[i]);
+                count++;
+            }
+        }
+
+        if (!(query->optFlags & OPT_FLAG_NAMESONLY)) {
+            printfooter(query->optFlags, count);
+        }
+    }
+
+    if (!errors) {
+        porttablerelease(table);
+    }
+    for (q = 0; q < nqueries; q++) {
+        free(queries[q].line);
+        free(queries[q].args);
+        free(queries[q].query.usbPidVidList.ulist);
+        free(queries[q].query.usbVidList.ulist);
+        free(queries[q].query.pciDeviceList.ulist);
+        free(queries[q].query.pciVendorList.ulist);
+    }
+    free(queries);
+
+    return errors ? -1 : 0;
+}
+
+
+// ports have the same -metrics labels
+Bool samemetriclabels(const PortInfo* p, const PortInfo* q)
+{
+    const Bool haveids = p->haveUSBid || p->havePCIid;
+
+    if ((q->isAvailable != p->isAvailable) || (q->bustype != p->bustype) ||
+            ((q->haveUSBid || q->havePCIid) != haveids)) {
+        return False;
+    }
+    if (haveids && ((q->vendorId != p->vendorId) || (q->productId != p->productId))) {
+        return False;
+    }
+    if (p->busname && q->busname) {
+        return wcscmp(p->busname, q->busname) == 0;
+    }
+    return p->busname == q->busname;
+}
+
+
+/*
+    -metrics output in Prometheus text exposition format, eg for the
+    node_exporter (or windows_exporter) textfile collector.
+ */
+void writemetrics(FILE* f, PortList* portlist, unsigned count)
+{
+    LARGE_INTEGER freq;
+    PortInfo*     p;
+    PortInfo*     q;
+    unsigned      phase;
+    // FILETIME is 100ns units since 1601, Prometheus timestamps are seconds since 1970
+    ULONGLONG     finished = ((ULONGLONG) portlist->stats.finished.dwHighDateTime << 32) |
+                                portlist->stats.finished.dwLowDateTime;
+
+    QueryPerformanceFrequency(&freq);
+
+    // a gauge, so not _total, which Prometheus reserves for counters
+    fprintf(f, "# HELP portlist_ports Number of ports found.\n");
+    fprintf(f, "# TYPE portlist_ports gauge\n");
+    fprintf(f, "portlist_ports %u\n", count);
+
+    fprintf(f, "# HELP portlist_ports_by_device Ports found by bus, vendor & product id and availability.\n");
+    fprintf(f, "# TYPE portlist_ports_by_device gauge\n");
+
+    // one line per distinct label set, counted at its first port in the list
+    for (p = portlist->ports; p; p = p->next) {
+        unsigned same = 0;
+
+        for (q = portlist->ports; (q != p) && !samemetriclabels(p, q); q = q->next) {
+        }
+        if (q != p) {
+            continue; // counted already
+        }
+
+        for (; q; q = q->next) {
+            if (samemetriclabels(p, q)) {
+                same++;
+            }
+        }
+
+        if (p->haveUSBid || p->havePCIid) {
+            fprintf(f, "portlist_ports_by_device{bus=\"%S\",vid=\"%04X\",pid=\"%04X\",available=\"%u\"} %u\n",
+                p->busname ? p->busname : L"", p->vendorId, p->productId, p->isAvailable ? 1 : 0, same);
+        } else {
+            fprintf(f, "portlist_ports_by_device{bus=\"%S\",vid=\"\",pid=\"\",available=\"%u\"} %u\n",
+                p->busname ? p->busname : L"", p->isAvailable ? 1 : 0, same);
+        }
+    }
+
+    fprintf(f, "# HELP portlist_enumeration_seconds Duration of each phase of the last enumeration.\n");
+    fprintf(f, "# TYPE portlist_enumeration_seconds gauge\n");
+    for (phase = 0; phase < ENUM_PHASES; phase++) {
+        fprintf(f, "portlist_enumeration_seconds{phase=\"%s\"} %.6f\n", enumphase_names[phase],
+            (double) portlist->stats.ticks[phase] / (double) freq.QuadPart);
+    }
+
+    fprintf(f, "# HELP portlist_property_errors Device property calls that failed in the last enumeration.\n");
+    fprintf(f, "# TYPE portlist_property_errors gauge\n");
+    fprintf(f, "portlist_property_errors %lu\n", portlist->stats.errors);
+
+    fprintf(f, "# HELP portlist_last_enumeration_timestamp_seconds When the last enumeration finished.\n");
+    fprintf(f, "# TYPE portlist_last_enumeration_timestamp_seconds gauge\n");
+    fprintf(f, "portlist_last_enumeration_timestamp_seconds %.3f\n",
+        (double) (finished - 116444736000000000ULL) / 1.0e7);
+}
+
+
+/*
+    Write metrics to a temporary file then rename it over the old file,
+    so the collector never reads a partly written file. "-" is stdout.
+ */
+Bool savemetrics(PortList* portlist, unsigned count)
+{
+    const wchar_t* filename = portlist->metricsfile;
+    size_t         len = wcslen(filename);
+    wchar_t*       tempname;
+    FILE*          f;
+    Bool           success;
+
+    if (!wcscmp(filename, L"-")) {
+        writemetrics(stdout, portlist, count);
+        fflush(stdout);
+        return True;
+    }
+
+    tempname = calloc(len + 5, sizeof(wchar_t));
+    if (tempname == NULL) {
+        errorprint(L"savemetrics(): memory allocation failed");
+        return False;
+    }
+    swprintf(tempname, len + 5, L"%s.tmp", filename);
+
+    f = _wfopen(tempname, L"wb"); // binary, the format needs \n line ends
+    if (f == NULL) {
+        errorprintf(L"could not create metrics file %s", tempname);
+        free(tempname);
+        return False;
+    }
+
+    writemetrics(f, portlist, count);
+    success = !ferror(f);
+    if (fclose(f) || !success) {
+        errorprintf(L"error writing metrics file %s", tempname);
+        DeleteFile(tempname);
+        free(tempname);
+        return False;
+    }
+
+    success = MoveFileEx(tempname, filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? True : False;
+    if (!success) {
+        errorprintf(L"could not replace metrics file %s - error %#X", filename, GetLastError());
+        DeleteFile(tempname);
+    }
+
+    free(tempname);
+    return success;
+}
+
+
+// -metrics mode, once or every -interval seconds until the user stops us
+int metricsloop(PortList* portlist)
+{
+    for (;;) {
+        DWORD    start = GetTickCount();
+        DWORD    elapsed;
+        unsigned count;
+        Bool     saved;
+
+        // -timeout here only stops between property fetches, enumeration stays on this thread
+        portlist->rundeadline = deadlineafter(portlist->runtimeout);
+        count = enumerateports(portlist);
+        saved = savemetrics(portlist, count);
+
+        freeportlist(portlist->ports);
+        portlist->ports = NULL;
+
+        if (portlist->interval == 0) {
+            return saved ? 0 : -1;
+        }
+
+        // keep to the interval regardless of how long enumeration took
+        elapsed = GetTickCount() - start;
+        if (elapsed < portlist->interval * 1000) {
+            Sleep(portlist->interval * 1000 - elapsed);
+        }
+    }
+}
+
+
+/*
+    Port snapshots, written by -save and read by -fleet.
+
+    A snapshot is a UTF-8 text file, a header line then one tab separated
+    record per port. Numeric fields come first, in hex except for the bus
+    type, interrupt & port index, then the strings in PortInfo order.
+    Tabs & line breaks within strings are saved as spaces.
+ */
+const wchar_t* snapshot_magic = L"portlist snapshot 1";
+
+#define SNAPSHOT_FIELDS             23
+
+// bit flags for the Bool fields of PortInfo in a snapshot record
+#define SNAPSHOT_HAVE_USBID         0x00000001
+#define SNAPSHOT_HAVE_PCIID         0x00000002
+#define SNAPSHOT_WIN_SERIAL         0x00000004
+
+
+void writesnapfield(FILE* f, const wchar_t* value)
+{
+    fputwc(L'\t', f);
+
+    if (value) {
+        for (; *value; value++) {
+            fputwc(((*value == L'\t') || (*value == L'\r') || (*value == L'\n')) ? L' ' : *value, f);
+        }
+    }
+}
+
+
+// one port, not including the line end
+void writesnaprecord(FILE* f, PortInfo* p)
+{
+    unsigned idflags = (p->haveUSBid ? SNAPSHOT_HAVE_USBID : 0) |
+        (p->havePCIid ? SNAPSHOT_HAVE_PCIID : 0) | (p->isWinSerial ? SNAPSHOT_WIN_SERIAL : 0);
+
+    fwprintf(f, L"%s\t%c\t%u\t%X\t%X\t%X\t%X\t%X\t%X\t%X\t%lX\t%lu\t%lu\t%lu",
+        p->portname, p->isAvailable ? L'A' : L'.', (unsigned) p->bustype, idflags,
+        p->vendorId, p->productId, p->pciSubsys, p->revision, p->usbInterface, p->retrieved,
+        p->portaddress, p->interrupt, p->portindex, p->indexed);
+
+    writesnapfield(f, p->busname);
+    writesnapfield(f, p->friendlyname);
+    writesnapfield(f, p->product);
+    writesnapfield(f, p->vendor);
+    writesnapfield(f, p->hardwareid);
+    writesnapfield(f, p->location);
+    writesnapfield(f, p->physdevobj);
+    writesnapfield(f, p->devclass);
+    writesnapfield(f, p->serialnumber);
+}
+
+
+Bool savesnapshot(PortList* portlist, const wchar_t* filename)
+{
+    wchar_t     host[MAX_COMPUTERNAME_LENGTH + 1];
+    DWORD       hostlen = MAX_COMPUTERNAME_LENGTH + 1;
+    PortInfo*   p;
+    Bool        success;
+    FILE*       f = _wfopen(filename, L"w, ccs=UTF-8");
+
+    if (f == NULL) {
+        errorprintf(L"could not create snapshot file %s", filename);
+        return False;
+    }
+
+    if (!GetComputerName(host, &hostlen)) {
+        host[0] = L'\0';
+    }
+
+    fputws(snapshot_magic, f);
+    writesnapfield(f, host);
+    writesnapfield(f, version_msg);
+    fputwc(L'\n', f);
+
+    for (p = portlist->ports; p; p = p->next) {
+        writesnaprecord(f, p);
+        fputwc(L'\n', f);
+    }
+
+    success = !ferror(f);
+    if (fclose(f) || !success) {
+        errorprintf(L"error writing snapshot file %s", filename);
+        return False;
+    }
+
+    return True;
+}
+
+
+/*
+    -export=<file> writes the listed ports in the binary layout of
+    portsnap.h, for other programs to map & read in place with portsnap.c.
+    The whole file is built in memory, then written with one call.
+ */
+
+// add a string to the pool, or only count its size when pool is NULL
+DWORD exportstring(BYTE* pool, size_t* used, const wchar_t* s)
+{
+    size_t bytes;
+    DWORD  offset = (DWORD) *used;
+
+    if ((s == NULL) || (*s == L'\0')) {
+        return 0;
+    }
+    bytes = (wcslen(s) + 1) * sizeof(wchar_t);
+    if (pool) {
+        memcpy(pool + offset, s, bytes);
+    }
+    *used += bytes;
+    return offset;
+}
+
+
+void exportrecord(struct portsnap_record* r, BYTE* pool, size_t* used, const PortInfo* p)
+{
+    r->lastseen = p->lastseen;
+    r->flags = (p->isAvailable ? PORTSNAP_AVAILABLE : 0) | (p->haveUSBid ? PORTSNAP_HAVE_USBID : 0) |
+        (p->havePCIid ? PORTSNAP_HAVE_PCIID : 0) | (p->isWinSerial ? PORTSNAP_WIN_SERIAL : 0) |
+        (p->isIncomplete ? PORTSNAP_INCOMPLETE : 0) | (p->isLatencySet ? PORTSNAP_LATENCY_SET : 0);
+    r->bustype = p->bustype;
+    r->portnumber = p->portnumber;
+    r->vendorid = p->vendorId;
+    r->productid = p->productId;
+    r->pcisubsys = p->pciSubsys;
+    r->revision = p->revision;
+    r->usbinterface = p->usbInterface;
+    r->retrieved = p->retrieved;
+    r->portaddress = p->portaddress;
+    r->interrupt = p->interrupt;
+    r->portindex = p->portindex;
+    r->indexed = p->indexed;
+    r->latencytimer = p->latencytimer;
+    r->hubnumber = p->hubnumber;
+    r->hubport = p->hubport;
+    r->ownerpid = p->ownerpid;
+
+    r->portname = exportstring(pool, used, p->portname);
+    r->friendlyname = exportstring(pool, used, p->friendlyname);
+    r->busname = exportstring(pool, used, p->busname);
+    r->product = exportstring(pool, used, p->product);
+    r->vendor = exportstring(pool, used, p->vendor);
+    r->hardwareid = exportstring(pool, used, p->hardwareid);
+    r->location = exportstring(pool, used, p->location);
+    r->physdevobj = exportstring(pool, used, p->physdevobj);
+    r->devclass = exportstring(pool, used, p->devclass);
+    r->serialnumber = exportstring(pool, used, p->serialnumber);
+    r->parentid = exportstring(pool, used, p->parentid);
+    r->locationpath = exportstring(pool, used, p->locationpath);
+    r->ownername = exportstring(pool, used, p->ownername);
+    r->usbspeed = p->usbspeed;
+    r->usbmaxpacket = p->usbmaxpacket;
+    r->usbhub = exportstring(pool, used, p->usbhub);
+    r->usbroothub = exportstring(pool, used, p->usbroothub);
+}
+
+
+// the ports in the portsnap.h layout, NULL on failure, caller frees
+BYTE* exportimage(PortInfo* ports, size_t* pSize)
+{
+    const size_t            recordsoffset = (sizeof(struct portsnap_header) + 7) & ~7;
+    struct portsnap_header* header;
+    struct portsnap_record  sizing;
+    struct portsnap_record* records;
+    wchar_t                 host[MAX_COMPUTERNAME_LENGTH + 1];
+    DWORD                   hostlen = MAX_COMPUTERNAME_LENGTH + 1;
+    BYTE*                   image;
+    BYTE*                   pool;
+    size_t                  used = sizeof(wchar_t);     // the empty string at offset 0
+    size_t                  stringsoffset;
+    size_t                  total;
+    unsigned                count = 0;
+    unsigned                i;
+    PortInfo*               p;
+
+    if (!GetComputerName(host, &hostlen)) {
+        host[0] = L'\0';
+    }
+
+    // first pass sizes the string pool
+    exportstring(NULL, &used, host);
+    exportstring(NULL, &used, version_msg);
+    for (p = ports; p; p = p->next) {
+        exportrecord(&sizing, NULL, &used, p);
+        count++;
+    }
+    stringsoffset = recordsoffset + (size_t) count * sizeof(struct portsnap_record);
+    total = stringsoffset + used;
+    if (total > MAXDWORD) {
+        errorprint(L"too many ports to export");
+        return NULL;
+    }
+
+    image = (BYTE*) calloc(total, 1);
+    if (image == NULL) {
+        errorprint(L"exportimage(): memory allocation failed");
+        return NULL;
+    }
+    header = (struct portsnap_header*) image;
+    records = (struct portsnap_record*) (image + recordsoffset);
+    pool = image + stringsoffset;
+
+    header->magic = PORTSNAP_MAGIC;
+    header->versionmajor = PORTSNAP_VERSION_MAJOR;
+    header->versionminor = PORTSNAP_VERSION_MINOR;
+    header->headersize = sizeof(struct portsnap_header);
+    header->recordsize = sizeof(struct portsnap_record);
+    header->count = count;
+    header->recordsoffset = (DWORD) recordsoffset;
+    header->stringsoffset = (DWORD) stringsoffset;
+    header->stringssize = (DWORD) used;
+    GetSystemTimeAsFileTime(&header->created);
+
+    used = sizeof(wchar_t);
+    header->host = exportstring(pool, &used, host);
+    header->creator = exportstring(pool, &used, version_msg);
+    for (i = 0, p = ports; p; p = p->next, i++) {
+        exportrecord(&records[i], pool, &used, p);
+    }
+
+    *pSize = total;
+    return image;
+}
+
+
+Bool exportports(PortInfo* ports, const wchar_t* filename)
+{
+    size_t size;
+    BYTE*  image = exportimage(ports, &size);
+    FILE*  f;
+    Bool   success;
+
+    if (image == NULL) {
+        return False;
+    }
+
+    f = _wfopen(filename, L"wb");
+    if (f == NULL) {
+        errorprintf(L"could not create export file %s", filename);
+        free(image);
+        return False;
+    }
+    success = (fwrite(image, 1, size, f) == size);
+    if (fclose(f) || !success) {
+        errorprintf(L"error writing export file %s", filename);
+        success = False;
+    }
+
+    free(image);
+    return success;
+}
+
+
+/*
+    -publish=<name> keeps the port table in a named shared memory segment,
+    for local programs to read with portsnapshmread(), see portsnap.h. Only
+    one portlist may publish to a segment, which a named mutex ensures.
+ */
+Bool shmpublishopen(struct shmpublisher* pub, const wchar_t* name)
+{
+    wchar_t mutexname[MAX_PATH + 8];
+    DWORD   waited;
+
+    memset(pub, 0, sizeof(struct shmpublisher));
+    portsnapshmname(pub->name, MAX_PATH, name);
+    _snwprintf(mutexname, MAX_PATH + 7, L"%s.writer", pub->name);
+    mutexname[MAX_PATH + 7] = L'\0';
+
+    pub->writer = CreateMutex(NULL, FALSE, mutexname);
+    waited = pub->writer ? WaitForSingleObject(pub->writer, 0) : WAIT_FAILED;
+    if ((waited != WAIT_OBJECT_0) && (waited != WAIT_ABANDONED)) {
+        errorprintf(L"could not publish %s, is another portlist publishing it?", pub->name);
+        shmpublishclose(pub);
+        return False;
+    }
+
+    // the segment may outlive an earlier publisher while readers have it open
+    pub->mapping = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, PORTSNAP_SHM_SIZE, pub->name);
+    pub->shm = pub->mapping ? (struct portsnap_shm*) MapViewOfFile(pub->mapping, FILE_MAP_WRITE, 0, 0, 0) : NULL;
+    if (pub->shm == NULL) {
+        errorprintf(L"could not create shared memory %s - error %#X", pub->name, GetLastError());
+        shmpublishclose(pub);
+        return False;
+    }
+    pub->shm->magic = PORTSNAP_MAGIC;
+
+    return True;
+}
+
+
+void shmpublishclose(struct shmpublisher* pub)
+{
+    if (pub->shm) {
+        UnmapViewOfFile(pub->shm);
+    }
+    if (pub->mapping) {
+        CloseHandle(pub->mapping);
+    }
+    if (pub->writer) {
+        ReleaseMutex(pub->writer);
+        CloseHandle(pub->writer);
+    }
+    memset(pub, 0, sizeof(struct shmpublisher));
+}
+
+
+// replace the published image, False if it does not fit the segment
+Bool shmpublish(struct shmpublisher* pub, const BYTE* image, size_t size)
+{
+    struct portsnap_shm* shm = pub->shm;
+
+    if (size > PORTSNAP_SHM_CAPACITY) {
+        return False;
+    }
+
+    // odd, unless a publisher that died part way through left it so
+    if (!(shm->sequence & 1)) {
+        InterlockedIncrement(&shm->sequence);
+    }
+    memcpy((BYTE*) shm + sizeof(struct portsnap_shm), image, size);
+    shm->size = (DWORD) size;
+    // even, Interlocked...() are full barriers so the image is written first
+    InterlockedIncrement(&shm->sequence);
+
+    return True;
+}
+
+
+// the ports as an image in the shared memory segment
+Bool shmpublishports(struct shmpublisher* pub, PortInfo* ports)
+{
+    size_t size;
+    BYTE*  image = exportimage(ports, &size);
+    Bool   published;
+
+    if (image == NULL) {
+        return False;
+    }
+    published = shmpublish(pub, image, size);
+    if (!published) {
+        errorprintf(L"%u KB port table is too large for shared memory %s", (unsigned) (size / 1024), pub->name);
+    }
+
+    free(image);
+    return published;
+}
+
+
+// -publish mode, every -interval seconds until the user stops us
+int publishloop(PortList* portlist)
+{
+    const unsigned      interval = portlist->interval ? portlist->interval : 1;
+    struct shmpublisher pub;
+
+    if (!shmpublishopen(&pub, portlist->publishname)) {
+        return -1;
+    }
+    // readers get the long form, whatever the listing options
+    portlist->optFlags &= ~(OPT_FLAG_NAMESONLY | OPT_FLAG_STREAM);
+    portlist->optFlags |= OPT_FLAG_LONGFORM;
+
+    wprintf(L"Publishing ports as %s every %u second%s, Ctrl+C to stop.\n", pub.name,
+        interval, (interval != 1) ? L"s" : L"");
+    fflush(stdout);
+
+    for (;;) {
+        DWORD start = GetTickCount();
+        DWORD elapsed;
+
+        portlist->rundeadline = deadlineafter(portlist->runtimeout);
+        enumerateports(portlist);
+        shmpublishports(&pub, portlist->ports);
+
+        freeportlist(portlist->ports);
+        portlist->ports = NULL;
+
+        // keep to the interval regardless of how long enumeration took
+        elapsed = GetTickCount() - start;
+        if (elapsed < interval * 1000) {
+            Sleep(interval * 1000 - elapsed);
+        }
+    }
+}
+
+
+// split next tab separated field from line, in place
+wchar_t* snapfield(wchar_t** pLine)
+{
+    wchar_t* field = *pLine;
+
+    if (field) {
+        wchar_t* tab = wcschr(field, L'\t');
+
+        if (tab) {
+            *tab = L'\0';
+            *pLine = tab + 1;
+        } else {
+            *pLine = NULL;
+        }
+    }
+    return field;
+}
+
+
+PortInfo* parsesnapshotrecord(wchar_t* line)
+{
+    wchar_t*    fields[SNAPSHOT_FIELDS];
+    unsigned    count;
+    unsigned    idflags;
+    PortInfo*   pInfo;
+
+    for (count = 0; line && (count < SNAPSHOT_FIELDS); count++) {
+        fields[count] = snapfield(&line);
+    }
+
+    if ((count != SNAPSHOT_FIELDS) || (fields[0][0] == L'\0')) {
+        return NULL; // truncated or damaged record
+    }
+
+    pInfo = (PortInfo*) calloc(1, sizeof(PortInfo));
+    if (pInfo == NULL) {
+        return NULL;
+    }
+
+    pInfo->portname = wcs_dupsubstr(fields[0], wcslen(fields[0]));
+    pInfo->isAvailable = (fields[1][0] == L'A');
+    pInfo->bustype = (enum pnpbus) wcstoul(fields[2], NULL, 10);
+    idflags = wcstoul(fields[3], NULL, 16);
+    pInfo->haveUSBid = (idflags & SNAPSHOT_HAVE_USBID) ? True : False;
+    pInfo->havePCIid = (idflags & SNAPSHOT_HAVE_PCIID) ? True : False;
+    pInfo->isWinSerial = (idflags & SNAPSHOT_WIN_SERIAL) ? True : False;
+    pInfo->vendorId = wcstoul(fields[4], NULL, 16);
+    pInfo->productId = wcstoul(fields[5], NULL, 16);
+    pInfo->pciSubsys = wcstoul(fields[6], NULL, 16);
+    pInfo->revision = wcstoul(fields[7], NULL, 16);
+    pInfo->usbInterface = wcstoul(fields[8], NULL, 16);
+    pInfo->retrieved = wcstoul(fields[9], NULL, 16);
+    pInfo->portaddress = wcstoul(fields[10], NULL, 16);
+    pInfo->interrupt = wcstoul(fields[11], NULL, 10);
+    pInfo->portindex = wcstoul(fields[12], NULL, 10);
+    pInfo->indexed = wcstoul(fields[13], NULL, 10);
+
+    pInfo->busname = wcs_dupsubstr(fields[14], wcslen(fields[14]));
+    pInfo->friendlyname = wcs_dupsubstr(fields[15], wcslen(fields[15]));
+    pInfo->product = wcs_dupsubstr(fields[16], wcslen(fields[16]));
+    pInfo->vendor = wcs_dupsubstr(fields[17], wcslen(fields[17]));
+    pInfo->hardwareid = wcs_dupsubstr(fields[18], wcslen(fields[18]));
+    pInfo->location = wcs_dupsubstr(fields[19], wcslen(fields[19]));
+    pInfo->physdevobj = wcs_dupsubstr(fields[20], wcslen(fields[20]));
+    pInfo->devclass = wcs_dupsubstr(fields[21], wcslen(fields[21]));
+    pInfo->serialnumber = wcs_dupsubstr(fields[22], wcslen(fields[22]));
+
+    if (pInfo->portname == NULL) {
+        freeportinfo(pInfo);
+        return NULL;
+    }
+
+    setportsortkey(pInfo);
+    return pInfo;
+}
+
+
+/*
+    Read a snapshot file through a memory mapped view, keeping only the ports
+    that pass the user's filters. Called from the -fleet worker threads.
+ */
+Bool loadsnapshot(PortList* portlist, struct snapshot* snap)
+{
+    HANDLE      hFile;
+    HANDLE      hMap;
+    DWORD       size;
+    const char* view;
+    const char* text;
+    const char* end;
+    wchar_t*    line = NULL;
+    int         linemax = 0;
+    Bool        sawheader = False;
+
+    hFile = CreateFile(snap->filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (hFile == INVALID_HANDLE_VALUE) {
+        errorprintf(L"could not open snapshot %s - error %#X", snap->filename, GetLastError());
+        return False;
+    }
+
+    size = GetFileSize(hFile, NULL);
+    if ((size == 0) || (size == INVALID_FILE_SIZE)) {
+        CloseHandle(hFile);
+        errorprintf(L"empty snapshot %s", snap->filename);
+        return False;
+    }
+
+    hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    view = hMap ? (const char*) MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+
+    if (view == NULL) {
+        errorprintf(L"could not map snapshot %s - error %#X", snap->filename, GetLastError());
+        if (hMap) {
+            CloseHandle(hMap);
+        }
+        CloseHandle(hFile);
+        return False;
+    }
+
+    text = view;
+    end = view + size;
+
+    // skip UTF-8 byte order mark
+    if ((size >= 3) && !memcmp(text, "\xEF\xBB\xBF", 3)) {
+        text += 3;
+    }
+
+    while (text < end) {
+        const char* eol = (const char*) memchr(text, '\n', end - text);
+        int         bytes = (int) ((eol ? eol : end) - text);
+        int         chars;
+
+        if ((bytes > 0) && (text[bytes - 1] == '\r')) {
+            bytes--;
+        }
+
+        // UTF-16 is never longer than UTF-8 in characters
+        if (bytes >= linemax) {
+            linemax = bytes + 256;
+            free(line);
+            line = (wchar_t*) calloc(linemax, sizeof(wchar_t));
+            if (line == NULL) {
+                errorprint(L"loadsnapshot(): memory allocation failed");
+                break;
+            }
+        }
+
+        chars = bytes ? MultiByteToWideChar(CP_UTF8, 0, text, bytes, line, linemax - 1) : 0;
+        line[chars] = L'\0';
+        text = eol ? (eol + 1) : end;
+
+        if (!sawheader) {
+            wchar_t* rest = line;
+
+            if (wcscmp(snapfield(&rest), snapshot_magic)) {
+                errorprintf(L"%s is not a portlist snapshot", snap->filename);
+                break;
+            }
+            sawheader = True;
+
+            rest = snapfield(&rest);
+            if (rest && *rest) {
+                free(snap->host);
+                snap->host = wcs_dupsubstr(rest, wcslen(rest));
+            }
+        } else if (chars > 0) {
+            PortInfo* pInfo = parsesnapshotrecord(line);
+
+            if (pInfo == NULL) {
+                errorprintf(L"bad record in snapshot %s", snap->filename);
+            } else if (checkportfilters(portlist, pInfo)) {
+                portlistinsert(&snap->ports, pInfo);
+                snap->count++;
+            } else {
+                freeportinfo(pInfo);
+            }
+        }
+    }
+
+    free(line);
+    UnmapViewOfFile(view);
+    CloseHandle(hMap);
+    CloseHandle(hFile);
+
+    return sawheader;
+}
+
+
+// thread pool worker, loads snapshots until there are none left to claim
+DWORD WINAPI fleetworker(LPVOID param)
+{
+    struct fleet* fleet = (struct fleet*) param;
+
+    for (;;) {
+        LONG idx = InterlockedIncrement(&fleet->next) - 1;
+
+        if (idx >= (LONG) fleet->count) {
+            break;
+        }
+        fleet->snaps[idx].loaded = loadsnapshot(fleet->portlist, &fleet->snaps[idx]);
+    }
+
+    return 0;
+}
+
+
+// -fleet mode: load every snapshot in a directory in parallel, then list matching ports by host
+int listfleet(PortList* portlist)
+{
+    const unsigned  opt_flags = portlist->optFlags;
+    struct fleet    fleet;
+    unsigned        maxsnaps = 0;
+    size_t          dirlen = wcslen(portlist->fleetdir);
+    wchar_t*        pattern = calloc(dirlen + 3, sizeof(wchar_t));
+    HANDLE          threads[MAXIMUM_WAIT_OBJECTS];
+    unsigned        nthreads = 0;
+    SYSTEM_INFO     sysinfo;
+    WIN32_FIND_DATA finddata;
+    HANDLE          hFind;
+    LARGE_INTEGER   freq;
+    LARGE_INTEGER   start;
+    LARGE_INTEGER   stop;
+    unsigned        i;
+    unsigned        portcount = 0;
+    unsigned        hostcount = 0;
+    Bool            first = True;
+
+    memset(&fleet, 0, sizeof(fleet));
+    fleet.portlist = portlist;
+
+    if (pattern == NULL) {
+        errorprint(L"listfleet(): memory allocation failed");
+        return -1;
+    }
+    swprintf(pattern, dirlen + 3, L"%s\\*", portlist->fleetdir);
+
+    // collect snapshot file names
+    hFind = FindFirstFile(pattern, &finddata);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        errorprintf(L"could not read snapshot directory %s - error %#X", portlist->fleetdir, GetLastError());
+        free(pattern);
+        return -1;
+    }
+
+    do {
+        struct snapshot* snap;
+        size_t namelen = wcslen(finddata.cFileName);
+        wchar_t* ext;
+
+        if (finddata.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            continue;
+        }
+
+        if (fleet.count == maxsnaps) {
+            maxsnaps += 256; // granularity
+            fleet.snaps = (struct snapshot*) realloc(fleet.snaps, maxsnaps * sizeof(struct snapshot));
+            if (fleet.snaps == NULL) {
+                errorprint(L"listfleet(): memory allocation failed");
+                exit(-1);
+            }
+        }
+
+        snap = &fleet.snaps[fleet.count++];
+        memset(snap, 0, sizeof(struct snapshot));
+
+        snap->filename = calloc(dirlen + namelen + 2, sizeof(wchar_t));
+        if (snap->filename) {
+            swprintf(snap->filename, dirlen + namelen + 2, L"%s\\%s", portlist->fleetdir, finddata.cFileName);
+        }
+
+        // host name defaults to the file name without extension
+        ext = wcsrchr(finddata.cFileName, L'.');
+        snap->host = wcs_dupsubstr(finddata.cFileName, ext ? (size_t) (ext - finddata.cFileName) : namelen);
+    } while (FindNextFile(hFind, &finddata));
+
+    FindClose(hFind);
+    free(pattern);
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    // thread pool, one worker per processor
+    GetSystemInfo(&sysinfo);
+    while ((nthreads < sysinfo.dwNumberOfProcessors) && (nthreads < fleet.count) && (nthreads < MAXIMUM_WAIT_OBJECTS)) {
+        threads[nthreads] = CreateThread(NULL, 0, fleetworker, &fleet, 0, NULL);
+        if (threads[nthreads] == NULL) {
+            break;
+        }
+        nthreads++;
+    }
+
+    if (nthreads) {
+        WaitForMultipleObjects(nthreads, threads, TRUE, INFINITE);
+        for (i = 0; i < nthreads; i++) {
+            CloseHandle(threads[i]);
+        }
+    } else {
+        // no threads, do the work ourselves
+        fleetworker(&fleet);
+    }
+
+    QueryPerformanceCounter(&stop);
+
+    // print matching ports, by host in file name order
+    printheader(opt_flags, L"Host");
+
+    for (i = 0; i < fleet.count; i++) {
+        struct snapshot* snap = &fleet.snaps[i];
+        PortInfo* p;
+
+        for (p = snap->ports; p; p = p->next) {
+            if ((opt_flags & OPT_FLAG_VERBOSE) && !first) {
+                wprintf(L"\n");
+            }
+            first = False;
+
+            wprintf(L"%-16s ", snap->host ? snap->host : L"");
+            printport(opt_flags, p);
+        }
+
+        if (snap->count) {
+            portcount += snap->count;
+            hostcount++;
+        }
+    }
+
+    wprintf(L"\n%u %sport%s found on %u of %u host%s.\n", portcount,
+        (opt_flags & OPT_FLAG_FILTER_SPECIFIED) ? L"matching " : L"",
+        (portcount != 1) ? L"s" : L"", hostcount, fleet.count, (fleet.count != 1) ? L"s" : L"");
+
+    if (opt_flags & OPT_FLAG_VERBOSE) {
+        double ms = (double) (stop.QuadPart - start.QuadPart) * 1000.0 / (double) freq.QuadPart;
+
+        wprintf(L"%u snapshots loaded by %u threads in %.1f ms, %.0f snapshots/s\n",
+            fleet.count, nthreads ? nthreads : 1, ms, (ms > 0.0) ? (fleet.count * 1000.0 / ms) : 0.0);
+    }
+
+    // tidy up
+    for (i = 0; i < fleet.count; i++) {
+        freeportlist(fleet.snaps[i].ports);
+        free(fleet.snaps[i].filename);
+        free(fleet.snaps[i].host);
+    }
+    free(fleet.snaps);
+
+    return 0;
+}
+
+
+/*
+    History index, built over the memory mapped log. Only the identity
+    fields are decoded when indexing, a full record is parsed only for a
+    remembered port that is to be listed, or when compacting.
+ */
+unsigned historyhash(const wchar_t* identity)
+{
+    unsigned hash = 2166136261u; // FNV-1a
+
+    for (; *identity; identity++) {
+        hash = (hash ^ (unsigned) towupper(*identity)) * 16777619u;
+    }
+    return hash;
+}
+
+
+// port name, hardware id & serial number of a record line, whose fields are split in place
+Bool historyidentity(wchar_t* line, wchar_t* identity, size_t size)
+{
+    wchar_t*    fields[SNAPSHOT_FIELDS];
+    unsigned    count;
+
+    for (count = 0; line && (count < SNAPSHOT_FIELDS); count++) {
+        fields[count] = snapfield(&line);
+    }
+    if ((count != SNAPSHOT_FIELDS) || (fields[0][0] == L'\0')) {
+        return False;
+    }
+
+    swprintf(identity, size, L"%s\t%s\t%s", fields[0], fields[18], fields[22]);
+    return True;
+}
+
+
+int historyfind(struct history* history, const wchar_t* identity)
+{
+    int idx = history->buckets[historyhash(identity) % HISTORY_BUCKETS];
+
+    for (; idx >= 0; idx = history->entries[idx].next) {
+        if (!wcsicmp(history->entries[idx].identity, identity)) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+
+// new entry, or -1 if out of memory
+int historyadd(struct history* history, const wchar_t* identity)
+{
+    struct historyentry*    entry;
+    unsigned                bucket = historyhash(identity) % HISTORY_BUCKETS;
+
+    if (history->count == history->max) {
+        unsigned             newmax = history->max ? (history->max * 2) : 64;
+        struct historyentry* newentries = realloc(history->entries, newmax * sizeof(struct historyentry));
+
+        if (newentries == NULL) {
+            return -1;
+        }
+        history->entries = newentries;
+        history->max = newmax;
+    }
+
+    entry = &history->entries[history->count];
+    memset(entry, 0, sizeof(struct historyentry));
+    entry->identity = wcs_dupsubstr(identity, wcslen(identity));
+    entry->next = history->buckets[bucket];
+    history->buckets[bucket] = history->count;
+
+    return entry->identity ? (int) history->count++ : -1;
+}
+
+
+// map & index the log, a missing log is an empty history
+Bool loadhistory(struct history* history)
+{
+    DWORD       size;
+    const char* text;
+    const char* end;
+    wchar_t*    line = NULL;
+    int         linemax = 0;
+    wchar_t     identity[1024];
+    unsigned    i;
+
+    for (i = 0; i < HISTORY_BUCKETS; i++) {
+        history->buckets[i] = -1;
+    }
+
+    history->hFile = CreateFile(history->filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (history->hFile == INVALID_HANDLE_VALUE) {
+        if (GetLastError() == ERROR_FILE_NOT_FOUND) {
+            return True;
+        }
+        errorprintf(L"could not open history %s - error %#X", history->filename, GetLastError());
+        return False;
+    }
+
+    size = GetFileSize(history->hFile, NULL);
+    if ((size == 0) || (size == INVALID_FILE_SIZE)) {
+        return True;
+    }
+
+    history->hMap = CreateFileMapping(history->hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+    history->view = history->hMap ? (const char*) MapViewOfFile(history->hMap, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (history->view == NULL) {
+        errorprintf(L"could not map history %s - error %#X", history->filename, GetLastError());
+        return False;
+    }
+
+    text = history->view;
+    end = history->view + size;
+
+    // skip UTF-8 byte order mark
+    if ((size >= 3) && !memcmp(text, "\xEF\xBB\xBF", 3)) {
+        text += 3;
+    }
+
+    while (text < end) {
+        const char* eol = (const char*) memchr(text, '\n', end - text);
+        const char* record;
+        int         bytes = (int) ((eol ? eol : end) - text);
+        int         chars;
+        int         idx;
+        ULONGLONG   lastseen;
+        wchar_t*    rest;
+
+        if ((bytes > 0) && (text[bytes - 1] == '\r')) {
+            bytes--;
+        }
+
+        if (bytes >= linemax) {
+            linemax = bytes + 256;
+            free(line);
+            line = (wchar_t*) calloc(linemax, sizeof(wchar_t));
+            if (line == NULL) {
+                errorprint(L"loadhistory(): memory allocation failed");
+                return False;
+            }
+        }
+
+        chars = bytes ? MultiByteToWideChar(CP_UTF8, 0, text, bytes, line, linemax - 1) : 0;
+        line[chars] = L'\0';
+        record = text;
+        text = eol ? (eol + 1) : end;
+
+        if (!history->exists) {
+            if (wcscmp(line, history_magic)) {
+                errorprintf(L"%s is not a portlist history", history->filename);
+                free(line);
+                return False;
+            }
+            history->exists = True;
+            continue;
+        }
+
+        // time, then the snapshot record
+        rest = line;
+        lastseen = _wcstoui64(snapfield(&rest), NULL, 16);
+        if ((chars == 0) || (rest == NULL) || !historyidentity(rest, identity, sizeof(identity) / sizeof(wchar_t))) {
+            continue; // eg partly written last line
+        }
+        history->lines++;
+
+        idx = historyfind(history, identity);
+        if (idx < 0) {
+            idx = historyadd(history, identity);
+            if (idx < 0) {
+                errorprint(L"loadhistory(): memory allocation failed");
+                free(line);
+                return False;
+            }
+        }
+
+        if (lastseen >= history->entries[idx].lastseen) {
+            const char* tab = (const char*) memchr(record, '\t', bytes);
+
+            history->entries[idx].lastseen = lastseen;
+            history->entries[idx].record = tab + 1;
+            history->entries[idx].length = bytes - (unsigned) (tab + 1 - record);
+        }
+    }
+
+    free(line);
+    return True;
+}
+
+
+void closehistory(struct history* history)
+{
+    unsigned i;
+
+    if (history->view) {
+        UnmapViewOfFile(history->view);
+        history->view = NULL;
+    }
+    if (history->hMap) {
+        CloseHandle(history->hMap);
+        history->hMap = NULL;
+    }
+    if (history->hFile != INVALID_HANDLE_VALUE) {
+        CloseHandle(history->hFile);
+        history->hFile = INVALID_HANDLE_VALUE;
+    }
+
+    for (i = 0; i < history->count; i++) {
+        free(history->entries[i].identity);
+    }
+    free(history->entries);
+    history->entries = NULL;
+    history->count = history->max = 0;
+}
+
+
+// parse the latest record of a remembered port
+PortInfo* historyrecord(struct historyentry* entry)
+{
+    wchar_t*    line;
+    int         chars;
+    PortInfo*   pInfo = NULL;
+
+    if (entry->record == NULL) {
+        return NULL;
+    }
+
+    line = (wchar_t*) calloc(entry->length + 1, sizeof(wchar_t));
+    if (line) {
+        chars = entry->length ? MultiByteToWideChar(CP_UTF8, 0, entry->record, entry->length, line, entry->length) : 0;
+        line[chars] = L'\0';
+        pInfo = parsesnapshotrecord(line);
+        free(line);
+    }
+
+    if (pInfo) {
+        pInfo->isAvailable = False;
+        pInfo->lastseen = entry->lastseen;
+    }
+    return pInfo;
+}
+
+
+/*
+    Rewrite the log with one line per port, to a temporary file that then
+    replaces the log. ports are the ports just found, those available are
+    logged with the new time, everything else keeps its latest record.
+ */
+Bool compacthistory(struct history* history, PortInfo* ports, ULONGLONG now)
+{
+    size_t      len = wcslen(history->filename);
+    wchar_t*    tempname = calloc(len + 5, sizeof(wchar_t));
+    FILE*       f;
+    PortInfo*   p;
+    unsigned    i;
+    Bool        success;
+
+    if (tempname == NULL) {
+        errorprint(L"compacthistory(): memory allocation failed");
+        return False;
+    }
+    swprintf(tempname, len + 5, L"%s.tmp", history->filename);
+
+    f = _wfopen(tempname, L"w, ccs=UTF-8");
+    if (f == NULL) {
+        errorprintf(L"could not create history file %s", tempname);
+        free(tempname);
+        return False;
+    }
+
+    fwprintf(f, L"%s\n", history_magic);
+    for (p = ports; p; p = p->next) {
+        if (p->isAvailable && !p->lastseen) {
+            fwprintf(f, L"%016I64X\t", now);
+            writesnaprecord(f, p);
+            fputwc(L'\n', f);
+        }
+    }
+    for (i = 0; i < history->count; i++) {
+        if (!history->entries[i].updated) {
+            PortInfo* pInfo = historyrecord(&history->entries[i]);
+
+            if (pInfo) {
+                fwprintf(f, L"%016I64X\t", history->entries[i].lastseen);
+                writesnaprecord(f, pInfo);
+                fputwc(L'\n', f);
+                freeportinfo(pInfo);
+            }
+        }
+    }
+
+    success = !ferror(f);
+    if (fclose(f) || !success) {
+        errorprintf(L"error writing history file %s", tempname);
+        DeleteFile(tempname);
+        free(tempname);
+        return False;
+    }
+
+    // the log must be unmapped & closed before it can be replaced
+    closehistory(history);
+    success = MoveFileEx(tempname, history->filename, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) ? True : False;
+    if (!success) {
+        errorprintf(L"could not replace history file %s - error %#X", history->filename, GetLastError());
+        DeleteFile(tempname);
+    }
+
+    free(tempname);
+    return success;
+}
+
+
+/*
+    Runs sharing a log take turns, so that a sighting appended by one is not
+    lost to another's compaction. The mutex is named after the log's full
+    path, Global so that a scheduled task & a user's runs are serialized.
+    Returns NULL if another run held the log too long.
+ */
+HANDLE historylock(const wchar_t* filename)
+{
+    wchar_t path[MAX_PATH];
+    wchar_t name[64];
+    HANDLE  mutex;
+    DWORD   waited;
+
+    if (!GetFullPathName(filename, MAX_PATH, path, NULL)) {
+        wcsncpy(path, filename, MAX_PATH - 1);
+        path[MAX_PATH - 1] = L'\0';
+    }
+    swprintf(name, sizeof(name) / sizeof(wchar_t), L"Global\\portlist.history.%08X", historyhash(path));
+
+    mutex = CreateMutex(NULL, FALSE, name);
+    waited = mutex ? WaitForSingleObject(mutex, HISTORY_LOCK_MS) : WAIT_FAILED;
+    if ((waited != WAIT_OBJECT_0) && (waited != WAIT_ABANDONED)) {
+        errorprintf(L"history %s is in use by another portlist", filename);
+        if (mutex) {
+            CloseHandle(mutex);
+        }
+        return NULL;
+    }
+    return mutex;
+}
+
+
+/*
+    Record the available ports found by this run, and with -a or -x add the
+    remembered ports that Windows no longer knows about. Returns the number
+    of ports added to the list.
+ */
+unsigned updatehistory(PortList* portlist)
+{
+    struct history  history;
+    PortInfo*       p;
+    unsigned        added = 0;
+    unsigned        seen = 0;
+    unsigned        i;
+    FILETIME        ft;
+    ULONGLONG       now;
+    wchar_t         identity[1024];
+    HANDLE          lock;
+
+    memset(&history, 0, sizeof(history));
+    history.filename = portlist->historyfile;
+    history.hFile = INVALID_HANDLE_VALUE;
+
+    lock = historylock(portlist->historyfile);
+    if (lock == NULL) {
+        return 0;
+    }
+    if (!loadhistory(&history)) {
+        closehistory(&history);
+        ReleaseMutex(lock);
+        CloseHandle(lock);
+        return 0;
+    }
+
+    GetSystemTimeAsFileTime(&ft);
+    now = ((ULONGLONG) ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+    // ports Windows knows about, present or not, are not listed from the history
+    for (p = portlist->ports; p; p = p->next) {
+        int idx;
+
+        swprintf(identity, sizeof(identity) / sizeof(wchar_t), L"%s\t%s\t%s", p->portname,
+            p->hardwareid ? p->hardwareid : L"", p->serialnumber ? p->serialnumber : L"");
+        idx = historyfind(&history, identity);
+        if (idx >= 0) {
+            history.entries[idx].present = True;
+            history.entries[idx].updated = p->isAvailable;
+        } else if (p->isAvailable) {
+            seen++; // new to the history
+        }
+    }
+
+    if (portlist->optFlags & OPT_FLAG_ALL) {
+        for (i = 0; i < history.count; i++) {
+            if (!history.entries[i].present) {
+                PortInfo* pInfo = historyrecord(&history.entries[i]);
+
+                if (pInfo && checkportfilters(portlist, pInfo)) {
+                    portlistinsert(&portlist->ports, pInfo);
+                    added++;
+                } else if (pInfo) {
+                    freeportinfo(pInfo);
+                }
+            }
+        }
+    }
+
+    // log the sightings, appending unless the log is due to be compacted
+    for (p = portlist->ports; p; p = p->next) {
+        if (p->isAvailable && !p->lastseen) {
+            history.lines++;
+        }
+    }
+
+    if ((history.lines >= HISTORY_COMPACT_MIN) && (history.lines > HISTORY_COMPACT_RATIO * (history.count + seen))) {
+        compacthistory(&history, portlist->ports, now);
+    } else {
+        Bool  exists = history.exists;
+        Bool  success;
+        FILE* f;
+
+        closehistory(&history);
+        f = _wfopen(portlist->historyfile, L"a, ccs=UTF-8");
+        if (f == NULL) {
+            errorprintf(L"could not open history file %s", portlist->historyfile);
+        } else {
+            if (!exists) {
+                fwprintf(f, L"%s\n", history_magic);
+            }
+            for (p = portlist->ports; p; p = p->next) {
+                if (p->isAvailable && !p->lastseen) {
+                    fwprintf(f, L"%016I64X\t", now);
+                    writesnaprecord(f, p);
+                    fputwc(L'\n', f);
+                }
+            }
+            success = !ferror(f);
+            if (fclose(f) || !success) {
+                errorprintf(L"error writing history file %s", portlist->historyfile);
+            }
+        }
+    }
+    closehistory(&history);
+    ReleaseMutex(lock);
+    CloseHandle(lock);
+
+    return added;
+}
+
+
+#if defined(PORTLIST_BENCH)
+/*
+    Microbenchmarks of the port list helpers, over a generated device set
+    so that results do not depend on the hardware of the PC running them.
+
+    getdeviceinfo() itself needs SetupAPI, the "getdeviceinfo" benchmark times
+    everything it does after the OS calls: hardware id parsing, filtering
+    and sorted insertion. The device key benchmarks read a volatile registry
+    key laid out like a port's device key, one value at a time vs one pass.
+
+    Before anything is timed, checks compare the results of helpers that
+    the benchmarks cannot see with what they should be. A failed check
+    fails the run.
+
+    Results are printed as JSON, save them to use as a later baseline.
+    With a baseline any benchmark that is more than BENCH_REGRESSION_PCT
+    slower fails the run.
+ */
+#define BENCH_DEVICES           1000
+#define BENCH_REGKEY            L"Software\\portlist_bench"
+#define BENCH_SNAPSHOT_PORTS    100000  // in the -export file for the portsnap reader benchmarks
+#define BENCH_MIN_MS            100     // minimum duration of each timed batch
+#define BENCH_BATCHES           5       // report the best of this many batches
+#define BENCH_REGRESSION_PCT    10
+
+struct bench_data {
+    PortList    filters;        // USB & PCI lists for checkpidandvidlists()
+    PortInfo*   devices;        // array of generated devices
+    unsigned    count;
+    HKEY        devkey;         // generated device key, or NULL
+    wchar_t     snapfile[MAX_PATH]; // exported snapshot, or empty
+};
+
+// a benchmark does one pass over the device set, returns the number of operations
+typedef unsigned (*bench_fn)(struct bench_data* data);
+
+struct bench_info {
+    const char* name;
+    bench_fn    fn;
+    double      ns_per_op;      // result
+};
+
+// a check runs once, prints what is wrong & returns the number of failures
+typedef unsigned (*bench_checkfn)(struct bench_data* data);
+
+struct bench_check {
+    const char*     name;
+    bench_checkfn   fn;
+};
+
+// defeats the optimiser discarding benchmarked calls
+volatile unsigned bench_sink;
+
+
+// small deterministic pseudo random generator, so device sets are repeatable
+unsigned benchrand(unsigned* seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+
+void benchgeneratedevices(struct bench_data* data, unsigned count)
+{
+    static const unsigned vids[] = { 0x0403, 0x2341, 0x04D8, 0x10C4, 0x067B, 0x1D50, 0x1A86 };
+    unsigned seed = 12345;
+    unsigned i;
+    wchar_t  buff[128];
+
+    memset(data, 0, sizeof(struct bench_data));
+    data->devices = (PortInfo*) calloc(count, sizeof(PortInfo));
+    if (data->devices == NULL) {
+        errorprint(L"benchgeneratedevices(): memory allocation failed");
+        exit(-1);
+    }
+    data->count = count;
+
+    for (i = 0; i < count; i++) {
+        PortInfo* p = &data->devices[i];
+        unsigned  vid = vids[benchrand(&seed) % (sizeof(vids) / sizeof(vids[0]))];
+        unsigned  pid = benchrand(&seed) & 0xFF;
+
+        swprintf(buff, 128, (i % 50) ? L"COM%u" : L"LPT%u", (i % 50) ? (benchrand(&seed) % 256) + 1 : (i / 50) + 1);
+        p->portname = wcs_dupsubstr(buff, 128);
+        setportsortkey(p);
+
+        if (i % 10) {
+            swprintf(buff, 128, L"USB\\VID_%04X&PID_%04X&REV_%04X&MI_%02X", vid, pid, benchrand(&seed), i % 4);
+        } else {
+            swprintf(buff, 128, L"PCI\\VEN_%04X&DEV_%04X&SUBSYS_%08X&REV_%02X", vid, pid, (vid << 16) | pid, i % 256);
+        }
+        p->hardwareid = wcs_dupsubstr(buff, 128);
+        parsehardwareid(p);
+
+        swprintf(buff, 128, L"USB Serial Port (%s)", p->portname);
+        p->friendlyname = wcs_dupsubstr(buff, 128);
+        p->product = wcs_dupsubstr(L"USB Serial Port", 128);
+        p->vendor = wcs_dupsubstr(L"FTDI", 128);
+        p->devclass = wcs_dupsubstr(L"Ports", 128);
+        swprintf(buff, 128, L"Port_#%04u.Hub_#%04u", (i % 7) + 1, (i / 7) + 1);
+        p->location = wcs_dupsubstr(buff, 128);
+        swprintf(buff, 128, L"A%07X", benchrand(&seed) * benchrand(&seed));
+        p->serialnumber = wcs_dupsubstr(buff, 128);
+        p->isAvailable = (i % 3) ? True : False;
+    }
+
+    // filters, a few Vendor Ids and Vendor:Device pairs that mostly do not match
+    data->filters.optFlags = OPT_FLAG_USBMATCH_VID | OPT_FLAG_USBMATCH_PIDVID | OPT_FLAG_PCIMATCH_DEVICE | OPT_FLAG_ALL;
+    for (i = 0; i < 10; i++) {
+        vendorlistadd(&data->filters, PNP_BUS_USB, 0x1000 + i);
+        devicelistadd(&data->filters, PNP_BUS_USB, 0x0403, 0x6000 + i);
+        devicelistadd(&data->filters, PNP_BUS_PCI, 0x10C4, 0xEA60 + i);
+    }
+}
+
+
+unsigned bench_portcmp(struct bench_data* data)
+{
+    unsigned i;
+    unsigned n = data->count;
+
+    for (i = 0; i < n; i++) {
+        bench_sink += portcmp(&data->devices[i], &data->devices[(i * 7 + 3) % n]);
+    }
+    return n;
+}
+
+
+unsigned bench_wcs_istr_tou(struct bench_data* data)
+{
+    unsigned i;
+    unsigned value;
+
+    for (i = 0; i < data->count; i++) {
+        wchar_t* str = data->devices[i].hardwareid;
+
+        if (wcs_istr_tou(&str, L"\\VID_", &value, 16) || wcs_istr_tou(&str, L"VEN_", &value, 16)) {
+            bench_sink += value;
+        }
+    }
+    return data->count;
+}
+
+
+unsigned bench_wcs_dupsubstr(struct bench_data* data)
+{
+    unsigned i;
+
+    for (i = 0; i < data->count; i++) {
+        wchar_t* dup = wcs_dupsubstr(data->devices[i].hardwareid, 256);
+
+        bench_sink += dup[0];
+        free(dup);
+    }
+    return data->count;
+}
+
+
+unsigned bench_checkpidandvidlists(struct bench_data* data)
+{
+    unsigned i;
+
+    for (i = 0; i < data->count; i++) {
+        bench_sink += checkpidandvidlists(&data->filters, &data->devices[i]);
+    }
+    return data->count;
+}
+
+
+unsigned bench_getdeviceinfo(struct bench_data* data)
+{
+    PortInfo* ports = NULL;
+    unsigned  i;
+
+    for (i = 0; i < data->count; i++) {
+        PortInfo* pInfo = (PortInfo*) calloc(1, sizeof(PortInfo));
+
+        if (pInfo == NULL) {
+            errorprint(L"bench_getdeviceinfo(): memory allocation failed");
+            break;
+        }
+        pInfo->portname = wcs_dupsubstr(data->devices[i].portname, 16);
+        pInfo->hardwareid = wcs_dupsubstr(data->devices[i].hardwareid, 256);
+        pInfo->isAvailable = data->devices[i].isAvailable;
+        setportsortkey(pInfo);
+        parsehardwareid(pInfo);
+
+        // sort everything, as if there were no filters
+        bench_sink += checkportfilters(&data->filters, pInfo);
+        portlistinsert(&ports, pInfo);
+    }
+    freeportlist(ports);
+
+    return i;
+}
+
+
+// create a volatile key with the values of a typical multi-port card device key
+HKEY benchcreatedevkey(void)
+{
+    static const struct {
+        const wchar_t* name;
+        DWORD          value;
+    } dwords[] = {
+        { L"PollingPeriod", 0 }, { L"PortAddress", 0x3F8 }, { L"Interrupt", 4 },
+        { L"PortIndex", 2 }, { L"Indexed", 1 }, { L"ForceFifoEnable", 1 },
+        { L"RxFIFO", 14 }, { L"TxFIFO", 16 }, { L"MaskInverted", 0 }
+    };
+    static const wchar_t portname[] = L"COM12";
+    HKEY     devkey = NULL;
+    unsigned i;
+
+    if (RegCreateKeyEx(HKEY_CURRENT_USER, BENCH_REGKEY, 0, NULL, REG_OPTION_VOLATILE,
+            KEY_QUERY_VALUE | KEY_SET_VALUE, NULL, &devkey, NULL) != ERROR_SUCCESS) {
+        return NULL;
+    }
+
+    RegSetValueEx(devkey, L"PortName", 0, REG_SZ, (const BYTE*) portname, sizeof(portname));
+    for (i = 0; i < sizeof(dwords) / sizeof(dwords[0]); i++) {
+        RegSetValueEx(devkey, dwords[i].name, 0, REG_DWORD, (const BYTE*) &dwords[i].value, sizeof(DWORD));
+    }
+
+    return devkey;
+}
+
+
+unsigned bench_devkey_single(struct bench_data* data)
+{
+    unsigned i;
+
+    for (i = 0; i < data->count; i++) {
+        PortInfo info;
+
+        memset(&info, 0, sizeof(PortInfo));
+        info.portname = getportname(data->devkey);
+        getverboseportreginfo(data->devkey, &info);
+        bench_sink += info.retrieved;
+        free(info.portname);
+    }
+    return data->count;
+}
+
+
+unsigned bench_devkey_onepass(struct bench_data* data)
+{
+    unsigned i;
+
+    for (i = 0; i < data->count; i++) {
+        PortInfo info;
+
+        memset(&info, 0, sizeof(PortInfo));
+        bench_sink += getdevkeyvalues(data->devkey, &info) + info.retrieved;
+        free(info.portname);
+    }
+    return data->count;
+}
+
+
+// the present devices of the port classes, a set per class as listclass() does
+unsigned bench_classes_separate(struct bench_data* data)
+{
+    SP_DEVINFO_DATA DeviceInfoData;
+    unsigned        c;
+    DWORD           dev;
+
+    UNREFERENCED_PARAMETER(data);
+
+    DeviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+    for (c = 0; c < PORT_CLASSES; c++) {
+        HDEVINFO hDevInfo = SetupDiGetClassDevs(portclasses[c].guid, 0, 0, DIGCF_PRESENT);
+
+        if (hDevInfo != INVALID_HANDLE_VALUE) {
+            for (dev = 0; SetupDiEnumDeviceInfo(hDevInfo, dev, &DeviceInfoData); dev++) {
+                bench_sink += DeviceInfoData.DevInst;
+            }
+            SetupDiDestroyDeviceInfoList(hDevInfo);
+        }
+    }
+    return 1;
+}
+
+
+// the same devices from one combined set, as listclasses() does
+unsigned bench_classes_combined(struct bench_data* data)
+{
+    SP_DEVINFO_DATA   DeviceInfoData;
+    PortList          portlist;
+    HDEVINFO          hDevInfo;
+    DWORD             dev;
+
+    UNREFERENCED_PARAMETER(data);
+
+    memset(&portlist, 0, sizeof(PortList));
+    DeviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+    hDevInfo = portclassdevices(&portlist, portclasses, PORT_CLASSES);
+    if (hDevInfo != INVALID_HANDLE_VALUE) {
+        for (dev = 0; SetupDiEnumDeviceInfo(hDevInfo, dev, &DeviceInfoData); dev++) {
+            bench_sink += DeviceInfoData.DevInst;
+        }
+        SetupDiDestroyDeviceInfoList(hDevInfo);
+    }
+    return 1;
+}
+
+
+// DevInsts of the devices in a set of one class, or of any class if guid is NULL
+unsigned benchclassdevinsts(HDEVINFO hDevInfo, const GUID* guid, DEVINST** pDevInsts)
+{
+    SP_DEVINFO_DATA DeviceInfoData;
+    DEVINST*        devinsts = NULL;
+    unsigned        count = 0;
+    unsigned        size = 0;
+    DWORD           dev;
+
+    DeviceInfoData.cbSize = sizeof(SP_DEVINFO_DATA);
+    for (dev = 0; SetupDiEnumDeviceInfo(hDevInfo, dev, &DeviceInfoData); dev++) {
+        if (guid && !IsEqualGUID(&DeviceInfoData.ClassGuid, guid)) {
+            continue;
+        }
+        if (count == size) {
+            DEVINST* grown = (DEVINST*) realloc(devinsts, (size + 64) * sizeof(DEVINST));
+
+            if (grown == NULL) {
+                errorprint(L"benchclassdevinsts(): memory allocation failed");
+                break;
+            }
+            devinsts = grown;
+            size += 64;
+        }
+        devinsts[count++] = DeviceInfoData.DevInst;
+    }
+
+    *pDevInsts = devinsts;
+    return count;
+}
+
+
+Bool benchsamedevinsts(const DEVINST* a, unsigned na, const DEVINST* b, unsigned nb)
+{
+    unsigned i;
+    unsigned j;
+
+    if (na != nb) {
+        return False;
+    }
+    for (i = 0; i < na; i++) {
+        for (j = 0; (j < nb) && (b[j] != a[i]); j++) {
+        }
+        if (j == nb) {
+            return False;
+        }
+    }
+    return True;
+}
+
+
+/*
+    The combined set that listclasses() walks should hold the same devices
+    of each class as that class's own set, present only & with -a, and no
+    device twice. Fails if devices arrive or leave during the check.
+ */
+unsigned benchcheckclasses(struct bench_data* data)
+{
+    static const unsigned flags[2] = { 0, OPT_FLAG_ALL };
+    PortList        portlist;
+    HDEVINFO        combined;
+    DEVINST*        all;
+    unsigned        nall;
+    unsigned        matched;
+    unsigned        f;
+    unsigned        c;
+    unsigned        i;
+    unsigned        j;
+    unsigned        failed = 0;
+
+    UNREFERENCED_PARAMETER(data);
+
+    for (f = 0; f < 2; f++) {
+        memset(&portlist, 0, sizeof(PortList));
+        portlist.optFlags = flags[f];
+        combined = portclassdevices(&portlist, portclasses, PORT_CLASSES);
+        if (combined == INVALID_HANDLE_VALUE) {
+            errorprintf(L"classes check: error calling SetupDiCreateDeviceInfoList - 0x%X", GetLastError());
+            failed++;
+            continue;
+        }
+
+        nall = benchclassdevinsts(combined, NULL, &all);
+        for (i = 0; i < nall; i++) {
+            for (j = i + 1; (j < nall) && (all[j] != all[i]); j++) {
+            }
+            if (j < nall) {
+                errorprintf(L"classes check: device %lu is in the combined set twice", all[i]);
+                failed++;
+                break;
+            }
+        }
+
+        matched = 0;
+        for (c = 0; c < PORT_CLASSES; c++) {
+            HDEVINFO  separate = SetupDiGetClassDevs(portclasses[c].guid, 0, 0, flags[f] ? 0 : DIGCF_PRESENT);
+            DEVINST*  expected = NULL;
+            DEVINST*  inclass = NULL;
+            unsigned  nexpected = 0;
+            unsigned  ninclass;
+
+            if (separate != INVALID_HANDLE_VALUE) {
+                nexpected = benchclassdevinsts(separate, NULL, &expected);
+                SetupDiDestroyDeviceInfoList(separate);
+            }
+            ninclass = benchclassdevinsts(combined, portclasses[c].guid, &inclass);
+            if (!benchsamedevinsts(inclass, ninclass, expected, nexpected)) {
+                errorprintf(L"classes check: %S class%s has %u devices in the combined set, %u in its own",
+                    enumphase_names[portclasses[c].phase], flags[f] ? L" with -a" : L"", ninclass, nexpected);
+                failed++;
+            }
+            matched += ninclass;
+            free(expected);
+            free(inclass);
+        }
+        if (matched != nall) {
+            errorprintf(L"classes check: %u devices of other classes in the combined set", nall - matched);
+            failed++;
+        }
+
+        free(all);
+        SetupDiDestroyDeviceInfoList(combined);
+    }
+
+    return failed;
+}
+
+
+/*
+    usbbudget() over a hand built set of adapters: on an xHCI root hub a
+    SuperSpeed, a high speed & three full speed adapters, two of them behind
+    the same high speed hub's transaction translator, one a chain of hubs
+    further down, & one on a root port without a translator. A USB 1.1 root
+    hub has one more full speed adapter. At 3 Mbaud only the translator,
+    shared by two adapters, is over budget.
+ */
+#define BENCH_USB_ADAPTERS  7
+
+const struct usbbus* benchfindbus(const struct usbbus* buses, unsigned count, const wchar_t* id,
+    Bool isTranslated, unsigned speed)
+{
+    unsigned i;
+
+    for (i = 0; i < count; i++) {
+        if ((buses[i].isTranslated == isTranslated) && (buses[i].speed == speed) && !wcscmp(buses[i].id, id)) {
+            return &buses[i];
+        }
+    }
+    return NULL;
+}
+
+
+unsigned benchcheckusbbudget(struct bench_data* data)
+{
+    static const struct {
+        const wchar_t*  roothub;
+        const wchar_t*  tthub;
+        unsigned        speed;
+        Bool            linked;
+    } adapters[BENCH_USB_ADAPTERS] = {
+        { L"USB\\ROOT_HUB30\\4&1", NULL, USB_SPEED_SUPER, True },
+        { L"USB\\ROOT_HUB30\\4&1", NULL, USB_SPEED_HIGH, True },
+        { L"USB\\ROOT_HUB30\\4&1", L"USB\\VID_05E3&PID_0610\\5&1", USB_SPEED_FULL, True },
+        { L"USB\\ROOT_HUB30\\4&1", L"USB\\VID_05E3&PID_0610\\5&1", USB_SPEED_FULL, True },
+        { L"USB\\ROOT_HUB30\\4&1", NULL, USB_SPEED_FULL, True },
+        { L"USB\\ROOT_HUB\\4&2", NULL, USB_SPEED_FULL, True },
+        { L"USB\\ROOT_HUB\\4&2", NULL, USB_SPEED_FULL, False }     // link not known, not counted
+    };
+    static const struct {
+        const wchar_t*  id;
+        Bool            isTranslated;
+        unsigned        speed;
+        unsigned        count;
+        Bool            over;
+    } expected[] = {
+        { L"USB\\ROOT_HUB30\\4&1", False, USB_SPEED_SUPER, 1, False },
+        { L"USB\\ROOT_HUB30\\4&1", False, USB_SPEED_HIGH, 4, False },
+        { L"USB\\VID_05E3&PID_0610\\5&1", True, USB_SPEED_FULL, 2, True },
+        { L"USB\\ROOT_HUB\\4&2", False, USB_SPEED_FULL, 1, False }
+    };
+    const unsigned       nexpected = sizeof(expected) / sizeof(expected[0]);
+    PortInfo             ports[BENCH_USB_ADAPTERS];
+    struct usbbus        buses[2 * BENCH_USB_ADAPTERS];
+    const struct usbbus* bus;
+    unsigned             count;
+    unsigned             i;
+    unsigned             failed = 0;
+
+    UNREFERENCED_PARAMETER(data);
+
+    memset(ports, 0, sizeof(ports));
+    for (i = 0; i < BENCH_USB_ADAPTERS; i++) {
+        ports[i].portname = L"COM";
+        ports[i].usbroothub = (wchar_t*) adapters[i].roothub;
+        ports[i].usbtthub = (wchar_t*) adapters[i].tthub;
+        ports[i].usbspeed = adapters[i].speed;
+        ports[i].retrieved = adapters[i].linked ? RETRIEVED_USB_LINK : 0;
+        ports[i].next = (i + 1 < BENCH_USB_ADAPTERS) ? &ports[i + 1] : NULL;
+    }
+
+    count = usbbudget(ports, 3000000, buses);
+    if (count != nexpected) {
+        errorprintf(L"usbbudget check: %u buses, not %u", count, nexpected);
+        failed++;
+    }
+    for (i = 0; i < nexpected; i++) {
+        bus = benchfindbus(buses, count, expected[i].id, expected[i].isTranslated, expected[i].speed);
+        if (bus == NULL) {
+            errorprintf(L"usbbudget check: no %s bus %s", usbspeed_names[expected[i].speed], expected[i].id);
+            failed++;
+        } else if ((bus->count != expected[i].count) || (usbbusover(bus) != expected[i].over)) {
+            errorprintf(L"usbbudget check: %s bus %s has %u adapters%s, not %u%s", usbspeed_names[expected[i].speed],
+                expected[i].id, bus->count, usbbusover(bus) ? L" over budget" : L"", expected[i].count,
+                expected[i].over ? L" over budget" : L"");
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+
+/*
+    -irq's formatting & shared line tests over a hand built device array:
+    COM1 interrupts through its multiport board on IRQ 17, shared with an
+    SMBus controller but not with the board itself, & has an MSI that a GPU
+    also reports. COM2's IRQ 4 is its own.
+ */
+#define BENCH_IRQ_DEVICES   6
+
+unsigned benchcheckirq(struct bench_data* data)
+{
+    static const struct {
+        ULONG_PTR       mask;
+        const wchar_t*  text;
+    } masks[] = {
+        { 0, L"any" }, { 0x1, L"0" }, { 0x5, L"0,2" }, { 0x4F, L"0-3,6" }, { 0xF0F, L"0-3,8-11" }
+    };
+    static const struct {
+        unsigned        i;
+        unsigned        k;
+        unsigned        irq;        // index in devices[i].irqs
+        Bool            shared;
+    } pairs[] = {
+        { 0, 0, 0, False },     // itself
+        { 0, 1, 0, False },     // its own board
+        { 0, 2, 0, True },      // SMBus on IRQ 17
+        { 0, 3, 1, False },     // MSI
+        { 0, 4, 0, False },     // another port on another line
+        { 4, 5, 0, False }
+    };
+    PortInfo         ports[2];
+    struct irqdevice devices[BENCH_IRQ_DEVICES];
+    wchar_t          text[IRQ_TEXT_MAX];
+    wchar_t          expected[IRQ_TEXT_MAX];
+    unsigned         i;
+    unsigned         failed = 0;
+
+    UNREFERENCED_PARAMETER(data);
+
+    memset(ports, 0, sizeof(ports));
+    memset(devices, 0, sizeof(devices));
+    ports[0].portname = L"COM1";
+    ports[1].portname = L"COM2";
+
+    devices[0].port = &ports[0];
+    devices[0].devinst = 100;
+    devices[0].via = L"Multiport board";
+    devices[0].count = 2;
+    devices[0].irqs[0].irq = 17;
+    devices[0].irqs[0].flags = fIRQD_Share;
+    devices[0].irqs[1].irq = (ULONG) -5;
+    devices[0].irqs[1].flags = fIRQD_Edge;
+    devices[1].name = L"Multiport board";
+    devices[1].devinst = 100;
+    devices[1].count = 1;
+    devices[1].irqs[0].irq = 17;
+    devices[2].name = L"SMBus controller";
+    devices[2].devinst = 200;
+    devices[2].count = 1;
+    devices[2].irqs[0].irq = 17;
+    devices[3].name = L"GPU";
+    devices[3].devinst = 300;
+    devices[3].count = 1;
+    devices[3].irqs[0].irq = (ULONG) -5;
+    devices[4].port = &ports[1];
+    devices[4].devinst = 400;
+    devices[4].count = 1;
+    devices[4].irqs[0].irq = 4;
+    devices[5].name = L"Keyboard";
+    devices[5].devinst = 500;
+    devices[5].count = 1;
+    devices[5].irqs[0].irq = 1;
+
+    irqname(text, IRQ_TEXT_MAX, &devices[0].irqs[0]);
+    if (wcscmp(text, L"IRQ 17")) {
+        errorprintf(L"irq check: IRQ 17 named \"%s\"", text);
+        failed++;
+    }
+    irqname(text, IRQ_TEXT_MAX, &devices[0].irqs[1]);
+    if (wcscmp(text, L"MSI -5")) {
+        errorprintf(L"irq check: MSI -5 named \"%s\"", text);
+        failed++;
+    }
+
+    for (i = 0; i < sizeof(masks) / sizeof(masks[0]); i++) {
+        cpulist(text, IRQ_TEXT_MAX, masks[i].mask);
+        if (wcscmp(text, masks[i].text)) {
+            errorprintf(L"irq check: affinity %#X listed as \"%s\", not \"%s\"", (unsigned) masks[i].mask, text, masks[i].text);
+            failed++;
+        }
+    }
+    // the last two processors of the group
+    cpulist(text, IRQ_TEXT_MAX, ((ULONG_PTR) 3) << (IRQ_CPUS_MAX - 2));
+    _snwprintf(expected, IRQ_TEXT_MAX - 1, L"%u-%u", (unsigned) IRQ_CPUS_MAX - 2, (unsigned) IRQ_CPUS_MAX - 1);
+    expected[IRQ_TEXT_MAX - 1] = L'\0';
+    if (wcscmp(text, expected)) {
+        errorprintf(L"irq check: last processors listed as \"%s\", not \"%s\"", text, expected);
+        failed++;
+    }
+
+    for (i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        const struct irqdevice* d = &devices[pairs[i].i];
+        const struct irqdevice* other = &devices[pairs[i].k];
+
+        if (irqshared(devices, pairs[i].i, pairs[i].k, &d->irqs[pairs[i].irq]) != pairs[i].shared) {
+            errorprintf(L"irq check: %s %s %ld with %s", d->port->portname,
+                pairs[i].shared ? L"does not share" : L"shares", (LONG) d->irqs[pairs[i].irq].irq,
+                other->port ? other->port->portname : other->name);
+            failed++;
+        }
+    }
+
+    return failed;
+}
+
+
+// a -export file of many generated ports
+Bool benchcreatesnapshot(wchar_t* filename)
+{
+    struct bench_data big;
+    wchar_t           dir[MAX_PATH];
+    unsigned          i;
+
+    filename[0] = L'\0';
+    if (!GetTempPath(MAX_PATH, dir) || !GetTempFileName(dir, L"psn", 0, filename)) {
+        filename[0] = L'\0';
+        return False;
+    }
+
+    // the generated devices are left for the end of the run, as are the other benchmark devices
+    benchgeneratedevices(&big, BENCH_SNAPSHOT_PORTS);
+    for (i = 0; i + 1 < big.count; i++) {
+        big.devices[i].next = &big.devices[i + 1];
+    }
+    if (!exportports(big.devices, filename)) {
+        DeleteFile(filename);
+        filename[0] = L'\0';
+        return False;
+    }
+    return True;
+}
+
+
+Bool benchsamestring(const wchar_t* a, const wchar_t* b)
+{
+    return !wcscmp(a ? a : L"", b ? b : L"");
+}
+
+
+Bool benchsameport(const PortInfo* a, const PortInfo* b)
+{
+    return benchsamestring(a->portname, b->portname) && benchsamestring(a->serialnumber, b->serialnumber) &&
+        benchsamestring(a->hardwareid, b->hardwareid) && benchsamestring(a->friendlyname, b->friendlyname) &&
+        benchsamestring(a->location, b->location) && (a->vendorId == b->vendorId) &&
+        (a->productId == b->productId) && (a->haveUSBid == b->haveUSBid) && (a->isAvailable == b->isAvailable);
+}
+
+
+// -save the generated ports & load them as -fleet does, each should come back unchanged
+unsigned benchchecksnapshot(struct bench_data* data)
+{
+    PortList        portlist;
+    struct snapshot snap;
+    wchar_t         dir[MAX_PATH];
+    wchar_t         filename[MAX_PATH];
+    PortInfo*       p;
+    unsigned        i;
+    unsigned        failed = 0;
+
+    if (!GetTempPath(MAX_PATH, dir) || !GetTempFileName(dir, L"pls", 0, filename)) {
+        errorprint(L"snapshot check: could not create a temporary file");
+        return 1;
+    }
+
+    memset(&portlist, 0, sizeof(PortList));
+    portlist.optFlags = OPT_FLAG_ALL;
+    for (i = 0; i + 1 < data->count; i++) {
+        data->devices[i].next = &data->devices[i + 1];
+    }
+    portlist.ports = data->devices;
+
+    memset(&snap, 0, sizeof(struct snapshot));
+    snap.filename = filename;
+    if (!savesnapshot(&portlist, filename) || !loadsnapshot(&portlist, &snap)) {
+        failed++;
+    } else {
+        if (snap.count != data->count) {
+            errorprintf(L"snapshot check: saved %u ports, loaded %u", data->count, snap.count);
+            failed++;
+        }
+        for (p = snap.ports; p; p = p->next) {
+            for (i = 0; (i < data->count) && !benchsameport(p, &data->devices[i]); i++) {
+            }
+            if ((i == data->count) && (failed++ == 0)) {
+                errorprintf(L"snapshot check: loaded %s serial number %s does not match a saved port",
+                    p->portname, p->serialnumber ? p->serialnumber : L"");
+            }
+        }
+    }
+
+    for (i = 0; i < data->count; i++) {
+        data->devices[i].next = NULL;
+    }
+    freeportlist(snap.ports);
+    free(snap.host);
+    DeleteFile(filename);
+
+    return failed;
+}
+
+
+// map & check the snapshot, which should take the same time for any number of ports
+unsigned bench_portsnap_open(struct bench_data* data)
+{
+    PortSnap snap;
+
+    if (portsnapopen(&snap, data->snapfile) == ERROR_SUCCESS) {
+        bench_sink += portsnapcount(&snap);
+        portsnapclose(&snap);
+    }
+    return 1;
+}
+
+
+// read every record of the snapshot where it lies, per record
+unsigned bench_portsnap_walk(struct bench_data* data)
+{
+    PortSnap snap;
+    unsigned count = 0;
+    unsigned i;
+
+    if (portsnapopen(&snap, data->snapfile) == ERROR_SUCCESS) {
+        count = portsnapcount(&snap);
+        for (i = 0; i < count; i++) {
+            const struct portsnap_record* r = portsnaprecord(&snap, i);
+            const wchar_t*                name = portsnapstring(&snap, r->portname);
+
+            bench_sink += r->vendorid + r->productid + (name ? name[3] : 0);
+        }
+        portsnapclose(&snap);
+    }
+    return count ? count : 1;
+}
+
+
+unsigned bench_listports(struct bench_data* data)
+{
+    unsigned i;
+
+    for (i = 0; i < data->count; i++) {
+        printport(OPT_FLAG_ALL | OPT_FLAG_LONGFORM | OPT_FLAG_VERBOSE, &data->devices[i]);
+    }
+    return data->count;
+}
+
+
+/*
+    -top's frame diff, drawn into a screen buffer that is never shown. The
+    second frame changes 6 cells: one on its own, two 9 columns apart that
+    are written separately, & two 1 column apart written as one run of 3.
+ */
+unsigned benchchecktop(struct bench_data* data)
+{
+    static const wchar_t* first[] = { L"abcdefghijklmnop", L"COM1 A", L"0123456789" };
+    static const wchar_t* second[] = { L"Xbcdefghij.lmnop", L"COM2 A", L"01234x6y89" };
+    const WORD            attr = FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE;
+    struct topscreen      scr;
+    wchar_t               text[TOP_LINE_MAX];
+    unsigned              written;
+    unsigned              row;
+    unsigned              failed = 0;
+
+    UNREFERENCED_PARAMETER(data);
+
+    memset(&scr, 0, sizeof(struct topscreen));
+    scr.console = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+        CONSOLE_TEXTMODE_BUFFER, NULL);
+    if (scr.console == INVALID_HANDLE_VALUE) {
+        fwprintf(stderr, L"top check skipped, no console\n");
+        return 0;
+    }
+    topresize(&scr);
+    if ((scr.width < 16) || (scr.height < 3) || (scr.width >= TOP_LINE_MAX)) {
+        fwprintf(stderr, L"top check skipped, %ux%u console window\n", scr.width, scr.height);
+        CloseHandle(scr.console);
+        free(scr.chars);
+        free(scr.attrs);
+        free(scr.shownchars);
+        free(scr.shownattrs);
+        return 0;
+    }
+
+    for (row = 0; row < scr.height; row++) {
+        topline(&scr, row, attr, (row < 3) ? first[row] : L"");
+    }
+    written = topflush(&scr);
+    if (written != scr.width * scr.height) {
+        errorprintf(L"top check: first frame wrote %u cells, not %u", written, scr.width * scr.height);
+        failed++;
+    }
+
+    for (row = 0; row < 3; row++) {
+        topline(&scr, row, attr, second[row]);
+    }
+    written = topflush(&scr);
+    if (written != 6) {
+        errorprintf(L"top check: second frame wrote %u cells, not 6", written);
+        failed++;
+    }
+
+    for (row = 0; row < 3; row++) {
+        COORD at;
+        DWORD count = 0;
+
+        at.X = scr.origin.X;
+        at.Y = (SHORT) (scr.origin.Y + row);
+        if (!ReadConsoleOutputCharacter(scr.console, text, scr.width, at, &count) || (count != scr.width)) {
+            errorprintf(L"top check: could not read row %u back - error %#X", row, GetLastError());
+            failed++;
+            continue;
+        }
+        text[count] = L'\0';
+        if (wcsncmp(text, second[row], wcslen(second[row])) ||
+                (wcsspn(text + wcslen(second[row]), L" ") != count - wcslen(second[row]))) {
+            errorprintf(L"top check: row %u shows \"%s\"", row, text);
+            failed++;
+        }
+    }
+
+    CloseHandle(scr.console);
+    free(scr.chars);
+    free(scr.attrs);
+    free(scr.shownchars);
+    free(scr.shownattrs);
+
+    return failed;
+}
+
+
+// time batches of repeated passes, result is the best nanoseconds per operation
+double benchrun(bench_fn fn, struct bench_data* data)
+{
+    LARGE_INTEGER freq;
+    LARGE_INTEGER start;
+    LARGE_INTEGER stop;
+    unsigned      reps = 1;
+    unsigned      batch;
+    unsigned      r;
+    unsigned      ops = 0;
+    double        ms = 0.0;
+    double        best = 0.0;
+
+    QueryPerformanceFrequency(&freq);
+
+    // calibrate the number of passes per batch
+    for (;;) {
+        QueryPerformanceCounter(&start);
+        for (r = 0, ops = 0; r < reps; r++) {
+            ops += fn(data);
+        }
+        QueryPerformanceCounter(&stop);
+
+        ms = (double) (stop.QuadPart - start.QuadPart) * 1000.0 / (double) freq.QuadPart;
+        if ((ms >= BENCH_MIN_MS) || (reps >= 0x10000000)) {
+            break;
+        }
+        reps *= 2;
+    }
 
-    /* Create a HDEVINFO with devices matching GUID & user choise of -a or -p
-     * MSDN example code I've seen for this API includes DIGCF_DEVICEINTERFACE,
-     * but for me this stops any COM ports from being found.
-     */
-    hDevInfo = SetupDiGetClassDevs(guid, 0, 0, devflags);
+    best = ms * 1.0e6 / ops;
 
-    if (hDevInfo == INVALID_HANDLE_VALUE)
-    {
-        // unrecoverable error
-        wchar_t guid_string[40];
-        swprintf(guid_string, sizeof(guid_string) / sizeof(wchar_t),
-            L"{%08x-%04x-%04x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
-            guid->Data1, guid->Data2, guid->Data3,
-            guid->Data4[0], guid->Data4[1], guid->Data4[2],
-            guid->Data4[3], guid->Data4[4], guid->Data4[5],
-            guid->Data4[6], guid->Data4[7]);
+    for (batch = 1; batch < BENCH_BATCHES; batch++) {
+        double ns;
 
-        errorprintf(L"error calling SetupDiGetClassDevs with %s - 0x%X", guid_string, GetLastError());
-        exit(-1);
-    } else {
-        // Enumerate through all devices in Set
-        count = listdevices(portlist, hDevInfo);
-        
-        //  Cleanup
-        SetupDiDestroyDeviceInfoList(hDevInfo);
+        QueryPerformanceCounter(&start);
+        for (r = 0, ops = 0; r < reps; r++) {
+            ops += fn(data);
+        }
+        QueryPerformanceCounter(&stop);
+
+        ns = (double) (stop.QuadPart - start.QuadPart) * 1.0e9 / (double) freq.QuadPart / ops;
+        if (ns < best) {
+            best = ns;
+        }
     }
 
-    return count;
+    return best;
 }
 
 
-void listports(PortList* portlist)
+// find "ns_per_op" for a named benchmark in baseline JSON text, or return 0.0
+double benchbaselinevalue(const char* json, const char* name)
 {
-    /* device setup GUIDs to look for are:
-       GUID_DEVCLASS_PORTS single COM / LPT ports
-       GUID_DEVCLASS_MODEM modem ports are not included in GUID_DEVCLASS_PORTS
-       GUID_DEVCLASS_MULTIPORTSERIAL multiple COM ports on single (PCI) card
-    */
-    const unsigned opt_flags = portlist->optFlags;
-    PortInfo*       p;
-    // get info about ports
-    unsigned count = listclass(portlist, &GUID_DEVCLASS_PORTS);
+    char        key[80];
+    const char* found;
+
+    sprintf(key, "\"name\": \"%.60s\"", name);
+    found = strstr(json, key);
+    if (found) {
+        found = strstr(found, "\"ns_per_op\":");
+        if (found) {
+            return strtod(found + 12, NULL);
+        }
+    }
+    return 0.0;
+}
 
-    // add modems & multiport serial ports, unless COM ports are excluded
-    if ((opt_flags & OPT_FLAG_EXCLUDE_COM) == 0) {
-        count += listclass(portlist, &GUID_DEVCLASS_MODEM);
-        count += listclass(portlist, &GUID_DEVCLASS_MULTIPORTSERIAL);
+
+int microbench(PortList* portlist)
+{
+    struct bench_info benchmarks[] = {
+        { "portcmp",                bench_portcmp },
+        { "wcs_istr_tou",           bench_wcs_istr_tou },
+        { "wcs_dupsubstr",          bench_wcs_dupsubstr },
+        { "checkpidandvidlists",    bench_checkpidandvidlists },
+        { "getdeviceinfo",          bench_getdeviceinfo },
+        { "devkey_single",          bench_devkey_single },
+        { "devkey_onepass",         bench_devkey_onepass },
+        { "classes_separate",       bench_classes_separate },
+        { "classes_combined",       bench_classes_combined },
+        { "listports",              bench_listports },
+        { "portsnap_open",          bench_portsnap_open },
+        { "portsnap_walk",          bench_portsnap_walk },
+        { NULL }
+    };
+    struct bench_check checks[] = {
+        { "snapshot",               benchchecksnapshot },
+        { "top",                    benchchecktop },
+        { "classes",                benchcheckclasses },
+        { "usbbudget",              benchcheckusbbudget },
+        { "irq",                    benchcheckirq },
+        { NULL }
+    };
+    struct bench_data   data;
+    struct bench_info*  b;
+    struct bench_check* c;
+    char*               baseline = NULL;
+    int                 regressions = 0;
+    unsigned            failures = 0;
+
+    // load baseline first, to fail early if it is missing
+    if (portlist->benchbaseline) {
+        FILE* f = _wfopen(portlist->benchbaseline, L"rb");
+        long  size = -1;
+
+        if (f && !fseek(f, 0, SEEK_END)) {
+            size = ftell(f);
+            rewind(f);
+        }
+        baseline = (size > 0) ? (char*) calloc(size + 1, 1) : NULL;
+        if ((baseline == NULL) || (fread(baseline, 1, size, f) != (size_t) size)) {
+            errorprintf(L"could not read benchmark baseline %s", portlist->benchbaseline);
+            if (f) {
+                fclose(f);
+            }
+            free(baseline);
+            return -1;
+        }
+        fclose(f);
     }
 
-    // print details of all the (matching) ports we found
-    p = portlist->ports;       // linked list of port info
+    benchgeneratedevices(&data, BENCH_DEVICES);
+    data.devkey = benchcreatedevkey();
+    benchcreatesnapshot(data.snapfile);
 
-    if (opt_flags & OPT_FLAG_LONGFORM) {
-        wprintf(L"Port   %sVID  PID  Rev  Friendly name\n",
-            portlist->optFlags & (OPT_FLAG_ALL | OPT_FLAG_VERBOSE) ? L"A " : L"");
+    for (c = checks; c->name; c++) {
+        if (c->fn(&data)) {
+            errorprintf(L"check %S failed", c->name);
+            failures++;
+        }
+    }
+
+    for (b = benchmarks; b->name; b++) {
+        if (((b->fn == bench_devkey_single) || (b->fn == bench_devkey_onepass)) && (data.devkey == NULL)) {
+            b->ns_per_op = 0.0; // could not create the key, skip
+        } else if (((b->fn == bench_portsnap_open) || (b->fn == bench_portsnap_walk)) && !data.snapfile[0]) {
+            b->ns_per_op = 0.0; // could not write the snapshot, skip
+        } else if (b->fn == bench_listports) {
+            // discard the formatted output
+            int saved_stdout;
+            int nul = _open("NUL", _O_WRONLY);
+
+            fflush(stdout);
+            saved_stdout = _dup(1);
+            _dup2(nul, 1);
+            b->ns_per_op = benchrun(b->fn, &data);
+            fflush(stdout);
+            _dup2(saved_stdout, 1);
+            _close(saved_stdout);
+            _close(nul);
+        } else {
+            b->ns_per_op = benchrun(b->fn, &data);
+        }
+    }
 
-        for (; p; p = p->next) {
-            wprintf(L"%-6s ", p->portname);
+    if (data.devkey) {
+        RegCloseKey(data.devkey);
+        RegDeleteKey(HKEY_CURRENT_USER, BENCH_REGKEY);
+    }
+    if (data.snapfile[0]) {
+        DeleteFile(data.snapfile);
+    }
 
-            // device availability only for Verbose or All listings
-            if (opt_flags & (OPT_FLAG_ALL | OPT_FLAG_VERBOSE) ) {
-                wprintf(p->isAvailable ? L"A " : L". ");
+    wprintf(L"{\n  \"portlist_bench\": 1,\n  \"devices\": %u,\n  \"results\": [\n", data.count);
+    for (b = benchmarks; b->name; b++) {
+        wprintf(L"    {\"name\": \"%S\", \"ns_per_op\": %.2f}%s\n", b->name, b->ns_per_op, b[1].name ? L"," : L"");
+    }
+    wprintf(L"  ]\n}\n");
+    fflush(stdout);
+
+    if (baseline) {
+        for (b = benchmarks; b->name; b++) {
+            double base = benchbaselinevalue(baseline, b->name);
+            double change = (base > 0.0) ? ((b->ns_per_op - base) * 100.0 / base) : 0.0;
+            Bool   regressed = (change > BENCH_REGRESSION_PCT);
+
+            fwprintf(stderr, L"%-20S %10.2f ns/op, baseline %10.2f, %+6.1f%%%s\n", b->name,
+                b->ns_per_op, base, change, regressed ? L" REGRESSED" : (base > 0.0) ? L"" : L" (new)");
+            if (regressed) {
+                regressions++;
             }
+        }
+        free(baseline);
+
+        if (regressions) {
+            errorprintf(L"%d benchmark%s regressed more than %d%%", regressions,
+                (regressions != 1) ? L"s" : L"", BENCH_REGRESSION_PCT);
+            return 1;
+        }
+    }
+
+    return failures ? 1 : 0;
+}
 
-            if (p->haveUSBid || p->havePCIid) {
-                const wchar_t* fmt_4hex = L"%04lX ";
-                const wchar_t* spaces5  = L"     ";
 
-                // at least Vendor Id & Product Id were extracted
-                wprintf(fmt_4hex, p->vendorId);
-                wprintf(fmt_4hex, p->productId);
-                wprintf(p->retrieved & RETRIEVED_USB_REV ? fmt_4hex : spaces5, p->revision);
-            } else {
-                wprintf(L"               ");
+/*
+    -latency: time asynchronous enumeration of this PC's ports, using the
+    other options given. Reports the time to the first port and to the end,
+    then cancels at the first port and reports how long stopping took.
+ */
+#define LATENCY_RUNS            5
+
+struct latency_state {
+    PortList*       portlist;
+    LARGE_INTEGER   first;      // time first port arrived
+    LARGE_INTEGER   done;
+    unsigned        found;
+    Bool            cancelfirst;
+};
+
+
+void latencyportfound(void* context, const PortInfo* pInfo)
+{
+    struct latency_state* state = (struct latency_state*) context;
+
+    UNREFERENCED_PARAMETER(pInfo);
+
+    if (state->found++ == 0) {
+        QueryPerformanceCounter(&state->first);
+        if (state->cancelfirst) {
+            // as cancelenumeration(), which may not have its AsyncEnum yet
+            InterlockedExchange(&state->portlist->cancel, 1);
+        }
+    }
+}
+
+
+void latencydone(void* context, const struct enumsummary* summary)
+{
+    struct latency_state* state = (struct latency_state*) context;
+
+    UNREFERENCED_PARAMETER(summary);
+
+    QueryPerformanceCounter(&state->done);
+}
+
+
+int latencytest(PortList* portlist)
+{
+    struct latency_state    state;
+    AsyncEnum*              ae;
+    LARGE_INTEGER           freq;
+    LARGE_INTEGER           start;
+    double                  firstms = 0.0;
+    double                  totalms = 0.0;
+    double                  cancelms = 0.0;
+    unsigned                run;
+    unsigned                found = 0;
+
+    QueryPerformanceFrequency(&freq);
+
+    for (run = 0; run < 2 * LATENCY_RUNS; run++) {
+        double first;
+        double done;
+
+        memset(&state, 0, sizeof(state));
+        state.portlist = portlist;
+        state.cancelfirst = (run >= LATENCY_RUNS);
+
+        QueryPerformanceCounter(&start);
+        ae = startenumeration(portlist, latencyportfound, latencydone, &state);
+        if (ae == NULL) {
+            return -1;
+        }
+        closeenumeration(ae);
+        freeportlist(portlist->ports);
+        portlist->ports = NULL;
+
+        if (state.found == 0) {
+            errorprint(L"no ports found, nothing to time");
+            return -1;
+        }
+
+        // best of the runs
+        first = (double) (state.first.QuadPart - start.QuadPart) * 1000.0 / (double) freq.QuadPart;
+        done = (double) (state.done.QuadPart - start.QuadPart) * 1000.0 / (double) freq.QuadPart;
+        if (!state.cancelfirst) {
+            if ((run == 0) || (first < firstms)) {
+                firstms = first;
             }
+            if ((run == 0) || (done < totalms)) {
+                totalms = done;
+            }
+            found = state.found;
+        } else {
+            double stopping = (double) (state.done.QuadPart - state.first.QuadPart) * 1000.0 / (double) freq.QuadPart;
 
-            if (p->friendlyname) {
-                wprintf(L"%s\n", p->friendlyname);
-            } else {
-                wprintf(L"\n");
+            if ((run == LATENCY_RUNS) || (stopping < cancelms)) {
+                cancelms = stopping;
             }
+        }
+    }
 
-            // extra info for verbose mode
-            if (opt_flags & OPT_FLAG_VERBOSE) {
-                wchar_t* indent = L"         ";
+    wprintf(L"{\n  \"portlist_latency\": 1,\n  \"ports\": %u,\n  \"runs\": %u,\n", found, LATENCY_RUNS);
+    wprintf(L"  \"first_port_ms\": %.3f,\n  \"complete_ms\": %.3f,\n  \"cancel_ms\": %.3f\n}\n",
+        firstms, totalms, cancelms);
 
-                if (p->vendor) {
-                    wprintf(L"%sVendor: %s\n", indent, p->vendor);
-                }
-                if (p->product) {
-                    wprintf(L"%sProduct: %s\n", indent, p->product);
-                }
+    return 0;
+}
 
-                if(p->busname) {
-                    wprintf(L"%sBus: %s\n", indent, p->busname);
-                }
 
-                // details specific to underlying bus
-                if (p->haveUSBid) {
-                    wprintf(L"%sUSB VendorId 0x%04lX, ProductId 0x%04lX", indent, p->vendorId, p->productId);
-                    wprintf( p->retrieved & RETRIEVED_USB_REV ? L", Revision 0x%04lX\n" : L"\n", p->revision);
-                    if (p->retrieved & RETRIEVED_USB_MI) {
-                        wprintf(L"%sUSB Interface %lu of composite device\n", indent, p->usbInterface);
-                    }
-                } else if (p->havePCIid) {
-                    wprintf(L"%sPCI VendorId 0x%04lX, DeviceId 0x%04lX\n", indent, p->vendorId, p->productId);
-                    wprintf(L"%sPCI SubSystem VendorId 0x%04lX, DeviceId 0x%04lX, Revision 0x%02lX\n",
-                        indent, p->pciSubsys >> 16, p->pciSubsys & 0xFFFFL, p->revision);
-                }
+/*
+    -stress: reader threads repeatedly take the current port table, check it
+    and let it go, while a refresh thread builds & publishes new tables as
+    fast as it can. Each table's ports carry its generation in portaddress,
+    so a reader can tell if it is looking at a freed or mixed up table.
+    Reports reader throughput & refresh rate, fails if any check fails.
+ */
+#define STRESS_READERS          4
+#define STRESS_MS               3000
+#define STRESS_PORTS            64
+
+struct stress_state {
+    struct porttablepub pub;
+    struct bench_data*  data;
+    LONG volatile       stop;
+    LONG volatile       failures;
+    LONG volatile       refreshes;
+    LONG volatile       reads[STRESS_READERS];
+};
 
-                if (p->serialnumber) {
-                    wprintf(L"%s%s Serial number: %s\n", indent, 
-                        p->isWinSerial ? L"Windows generated" : L"Device",  p->serialnumber);
-                }
-                if (p->devclass) {
-                    wprintf(L"%sDevice Class: %s\n", indent, p->devclass);
-                }
-                if (p->hardwareid) {
-                    wprintf(L"%sHardware Id: %s\n", indent, p->hardwareid);
-                }
-                if (p->physdevobj) {
-                    wprintf(L"%sPhysical Device Object: %s\n", indent, p->physdevobj);
-                }
-                if (p->location) {
-                    wprintf(L"%sLocation Info: %s\n", indent, p->location);
-                }
+struct stress_reader {
+    struct stress_state* state;
+    unsigned             id;
+};
 
-                // ISA legacy hardware port
-                if ((p->retrieved & (RETRIEVED_PORTADDRESS | RETRIEVED_INTERRUPT)) == (RETRIEVED_PORTADDRESS | RETRIEVED_INTERRUPT)) {
-                    wprintf(L"%sLegacy port -- address %04lX, interrupt %lu\n", indent, p->portaddress, p->interrupt);
-                }
 
-                // multiport device
-                if ((p->retrieved & (RETRIEVED_PORTINDEX | RETRIEVED_INDEXED)) == (RETRIEVED_PORTINDEX | RETRIEVED_INDEXED)) {
-                    wprintf(L"%sMulti-port device -- port ", indent);
-                        
-                    wprintf(p->indexed ? L"index %lu\n" : L"%bitmap 0x%04lX\n", p->portindex);
-                }
+PortTable* stressbuildtable(struct bench_data* data, unsigned generation)
+{
+    PortInfo* ports = NULL;
+    unsigned  i;
 
-                // if there is another port to print add a spacing line
-                if (p->next) {
-                    wprintf(L"\n");
-                }
-            }
+    for (i = 0; i < STRESS_PORTS; i++) {
+        const PortInfo* src = &data->devices[(generation * 7 + i) % data->count];
+        PortInfo*       pInfo = (PortInfo*) calloc(1, sizeof(PortInfo));
+
+        if (pInfo == NULL) {
+            break;
         }
-    } else {
-        wprintf(L"Port   %sFriendly name\n", portlist->optFlags & OPT_FLAG_ALL ? L"A " : L"");
+        pInfo->portname = wcs_dupsubstr(src->portname, 16);
+        pInfo->hardwareid = wcs_dupsubstr(src->hardwareid, 256);
+        pInfo->portaddress = generation;
+        setportsortkey(pInfo);
+        parsehardwareid(pInfo);
+        portlistinsert(&ports, pInfo);
+    }
 
-        for (; p; p = p->next) {
-            wprintf(L"%-6s ", p->portname);
+    return porttablebuild(ports);
+}
 
-            if (opt_flags & OPT_FLAG_ALL) {
-                wprintf(p->isAvailable ? L"A " : L". ");
-            }
 
-            if (p->friendlyname) {
-                wprintf(L"%s\n", p->friendlyname);
-            } else {
-                wprintf(L"\n");
+DWORD WINAPI stressreader(LPVOID param)
+{
+    struct stress_reader*   reader = (struct stress_reader*) param;
+    struct stress_state*    state = reader->state;
+    unsigned                lastgeneration = 0;
+
+    while (!state->stop) {
+        PortTable* table = porttableacquire(&state->pub);
+        unsigned   i;
+
+        if (table) {
+            Bool ok = (table->generation >= lastgeneration) && (table->count == STRESS_PORTS);
+
+            for (i = 0; ok && (i < table->count); i++) {
+                ok = (table->index[i]->portaddress == table->generation - 1) && table->index[i]->portname;
+            }
+            if (!ok) {
+                InterlockedIncrement(&state->failures);
             }
+            lastgeneration = table->generation;
+            porttablerelease(table);
         }
+        state->reads[reader->id]++; // only this thread writes it
     }
 
-    wprintf(L"\n%u %sport%s found.\n", count, 
-        (opt_flags & OPT_FLAG_MATCH_SPECIFIED) ? L"matching " : L"",
-        (count != 1) ? L"s" : L"");
+    return 0;
+}
+
+
+DWORD WINAPI stressrefresher(LPVOID param)
+{
+    struct stress_state* state = (struct stress_state*) param;
+
+    while (!state->stop) {
+        // generations are numbered from 1 as they are published
+        PortTable* table = stressbuildtable(state->data, state->pub.generation);
+
+        if (table) {
+            porttablepublish(&state->pub, table);
+            InterlockedIncrement(&state->refreshes);
+        }
+    }
+
+    return 0;
+}
+
+
+int stresstest(PortList* portlist)
+{
+    struct stress_state     state;
+    struct stress_reader    readers[STRESS_READERS];
+    struct bench_data       data;
+    HANDLE                  threads[STRESS_READERS + 1];
+    LARGE_INTEGER           freq;
+    LARGE_INTEGER           start;
+    LARGE_INTEGER           stop;
+    double                  seconds;
+    LONG                    reads = 0;
+    unsigned                i;
+
+    UNREFERENCED_PARAMETER(portlist);
+
+    memset(&state, 0, sizeof(state));
+    benchgeneratedevices(&data, BENCH_DEVICES);
+    state.data = &data;
+    porttablepublish(&state.pub, stressbuildtable(&data, 0));
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    for (i = 0; i < STRESS_READERS; i++) {
+        readers[i].state = &state;
+        readers[i].id = i;
+        threads[i] = CreateThread(NULL, 0, stressreader, &readers[i], 0, NULL);
+    }
+    threads[STRESS_READERS] = CreateThread(NULL, 0, stressrefresher, &state, 0, NULL);
+
+    for (i = 0; i <= STRESS_READERS; i++) {
+        if (threads[i] == NULL) {
+            errorprintf(L"could not create stress test thread - error %#X", GetLastError());
+            InterlockedExchange(&state.stop, 1);
+            break;
+        }
+    }
+
+    if (!state.stop) {
+        Sleep(STRESS_MS);
+        InterlockedExchange(&state.stop, 1);
+    }
+
+    for (i = 0; i <= STRESS_READERS; i++) {
+        if (threads[i]) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+    }
+    QueryPerformanceCounter(&stop);
+    porttablepublish(&state.pub, NULL);
+
+    seconds = (double) (stop.QuadPart - start.QuadPart) / (double) freq.QuadPart;
+    for (i = 0; i < STRESS_READERS; i++) {
+        reads += state.reads[i];
+    }
+
+    wprintf(L"{\n  \"portlist_stress\": 1,\n  \"readers\": %u,\n  \"seconds\": %.2f,\n", STRESS_READERS, seconds);
+    wprintf(L"  \"reads_per_sec\": %.0f,\n  \"refreshes_per_sec\": %.0f,\n  \"failures\": %ld\n}\n",
+        reads / seconds, state.refreshes / seconds, state.failures);
+
+    if (state.failures) {
+        errorprintf(L"%ld port table checks failed", state.failures);
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+    -shmstress: reader threads copy the port table from a -publish shared
+    memory segment & check it, while a publisher thread replaces it as fast
+    as it can. The images differ in size & each port of image k carries k in
+    portaddress, so a torn copy that got past the sequence lock would show
+    up as mixed or miscounted ports. Fails if any check fails.
+ */
+#define SHMSTRESS_READERS       4
+#define SHMSTRESS_IMAGES        8
+
+struct shmstress_state {
+    struct shmpublisher pub;
+    BYTE*               images[SHMSTRESS_IMAGES];
+    size_t              sizes[SHMSTRESS_IMAGES];
+    LONG volatile       stop;
+    LONG volatile       failures;
+    LONG volatile       busy;           // reads that gave up on the publisher
+    LONG volatile       publishes;
+    LONG volatile       reads[SHMSTRESS_READERS];
+};
+
+struct shmstress_reader {
+    struct shmstress_state* state;
+    unsigned                id;
+};
+
+
+// image k has fewer ports than image k - 1, all with portaddress k + 1
+BYTE* shmstressimage(struct bench_data* data, unsigned k, size_t* pSize)
+{
+    PortInfo* ports = NULL;
+    BYTE*     image;
+    unsigned  i;
+
+    for (i = 0; i < STRESS_PORTS - 4 * k; i++) {
+        const PortInfo* src = &data->devices[(k * 7 + i) % data->count];
+        PortInfo*       pInfo = (PortInfo*) calloc(1, sizeof(PortInfo));
+
+        if (pInfo == NULL) {
+            break;
+        }
+        pInfo->portname = wcs_dupsubstr(src->portname, 16);
+        pInfo->hardwareid = wcs_dupsubstr(src->hardwareid, 256);
+        pInfo->friendlyname = wcs_dupsubstr(src->friendlyname, 256);
+        pInfo->portaddress = k + 1;
+        setportsortkey(pInfo);
+        parsehardwareid(pInfo);
+        portlistinsert(&ports, pInfo);
+    }
+
+    image = exportimage(ports, pSize);
+    freeportlist(ports);
+    return image;
+}
+
+
+Bool shmstresscheck(const void* image, DWORD size)
+{
+    PortSnap snap;
+    unsigned count;
+    unsigned i;
+    DWORD    k;
+
+    if (portsnapload(&snap, image, size) != ERROR_SUCCESS) {
+        return False;
+    }
+    count = portsnapcount(&snap);
+    k = count ? portsnaprecord(&snap, 0)->portaddress : 0;
+    if ((k == 0) || (k > SHMSTRESS_IMAGES) || (count != STRESS_PORTS - 4 * (k - 1))) {
+        return False;
+    }
+
+    for (i = 0; i < count; i++) {
+        const struct portsnap_record* r = portsnaprecord(&snap, i);
+        const wchar_t*                name = portsnapstring(&snap, r->portname);
+
+        if ((r->portaddress != k) || (name == NULL) || (wcsncmp(name, L"COM", 3) && wcsncmp(name, L"LPT", 3))) {
+            return False;
+        }
+    }
+    return True;
+}
+
+
+DWORD WINAPI shmstressreader(LPVOID param)
+{
+    struct shmstress_reader* reader = (struct shmstress_reader*) param;
+    struct shmstress_state*  state = reader->state;
+    PortSnapShm              shm;
+    BYTE*                    buffer = (BYTE*) malloc(PORTSNAP_SHM_CAPACITY);
+
+    // as another process would
+    if ((buffer == NULL) || (portsnapshmopen(&shm, state->pub.name) != ERROR_SUCCESS)) {
+        InterlockedIncrement(&state->failures);
+        free(buffer);
+        return 0;
+    }
+
+    while (!state->stop) {
+        DWORD size = 0;
+        DWORD result = portsnapshmread(&shm, buffer, PORTSNAP_SHM_CAPACITY, &size, NULL);
+
+        if (result == ERROR_BUSY) {
+            InterlockedIncrement(&state->busy);
+        } else if ((result != ERROR_SUCCESS) || !shmstresscheck(buffer, size)) {
+            InterlockedIncrement(&state->failures);
+        }
+        state->reads[reader->id]++; // only this thread writes it
+    }
+
+    portsnapshmclose(&shm);
+    free(buffer);
+    return 0;
+}
+
+
+DWORD WINAPI shmstresspublisher(LPVOID param)
+{
+    struct shmstress_state* state = (struct shmstress_state*) param;
+    unsigned                n;
+
+    for (n = 0; !state->stop; n++) {
+        shmpublish(&state->pub, state->images[n % SHMSTRESS_IMAGES], state->sizes[n % SHMSTRESS_IMAGES]);
+        InterlockedIncrement(&state->publishes);
+    }
+
+    return 0;
+}
+
+
+int shmstresstest(PortList* portlist)
+{
+    struct shmstress_state  state;
+    struct shmstress_reader readers[SHMSTRESS_READERS];
+    struct bench_data       data;
+    HANDLE                  threads[SHMSTRESS_READERS + 1];
+    wchar_t                 name[32];
+    LARGE_INTEGER           freq;
+    LARGE_INTEGER           start;
+    LARGE_INTEGER           stop;
+    double                  seconds;
+    LONG                    reads = 0;
+    unsigned                i;
+
+    UNREFERENCED_PARAMETER(portlist);
+
+    memset(&state, 0, sizeof(state));
+    benchgeneratedevices(&data, BENCH_DEVICES);
+    for (i = 0; i < SHMSTRESS_IMAGES; i++) {
+        state.images[i] = shmstressimage(&data, i, &state.sizes[i]);
+        if (state.images[i] == NULL) {
+            return -1;
+        }
+    }
+
+    swprintf(name, 32, L"shmstress.%lu", GetCurrentProcessId());
+    if (!shmpublishopen(&state.pub, name)) {
+        return -1;
+    }
+    shmpublish(&state.pub, state.images[0], state.sizes[0]);
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    for (i = 0; i < SHMSTRESS_READERS; i++) {
+        readers[i].state = &state;
+        readers[i].id = i;
+        threads[i] = CreateThread(NULL, 0, shmstressreader, &readers[i], 0, NULL);
+    }
+    threads[SHMSTRESS_READERS] = CreateThread(NULL, 0, shmstresspublisher, &state, 0, NULL);
+
+    for (i = 0; i <= SHMSTRESS_READERS; i++) {
+        if (threads[i] == NULL) {
+            errorprintf(L"could not create stress test thread - error %#X", GetLastError());
+            InterlockedExchange(&state.stop, 1);
+            break;
+        }
+    }
+
+    if (!state.stop) {
+        Sleep(STRESS_MS);
+        InterlockedExchange(&state.stop, 1);
+    }
+
+    for (i = 0; i <= SHMSTRESS_READERS; i++) {
+        if (threads[i]) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+    }
+    QueryPerformanceCounter(&stop);
+    shmpublishclose(&state.pub);
+    for (i = 0; i < SHMSTRESS_IMAGES; i++) {
+        free(state.images[i]);
+    }
+
+    seconds = (double) (stop.QuadPart - start.QuadPart) / (double) freq.QuadPart;
+    for (i = 0; i < SHMSTRESS_READERS; i++) {
+        reads += state.reads[i];
+    }
+
+    wprintf(L"{\n  \"portlist_shmstress\": 1,\n  \"readers\": %u,\n  \"seconds\": %.2f,\n", SHMSTRESS_READERS, seconds);
+    wprintf(L"  \"reads_per_sec\": %.0f,\n  \"publishes_per_sec\": %.0f,\n  \"busy\": %ld,\n  \"failures\": %ld\n}\n",
+        reads / seconds, state.publishes / seconds, state.busy, state.failures);
+
+    if (state.failures) {
+        errorprintf(L"%ld shared memory port table checks failed", state.failures);
+        return 1;
+    }
+    return 0;
 }
+#endif
 
 
 // Unicode argv[] version of main()
@@ -1453,14 +10066,72 @@ int wmain(int argc, wchar_t* argv[])
         }
     }
 
+    if ((portlist.optFlags & OPT_FLAG_STREAM) && ((portlist.optFlags & OPT_FLAG_NEED_PORTLIST) || portlist.exportfile)) {
+        errorprint(L"-stream cannot be combined with options that need the whole list, eg -tree or -save=");
+        usage(False, False);
+        return -1;
+    }
+
+    // the loops use -interval in ms, which must fit a DWORD & a waitable timer's LONG period
+    if (portlist.interval > INTERVAL_MAX) {
+        portlist.interval = INTERVAL_MAX;
+    }
+
+    // allow -port=\\.\COM7, the form used to open ports above COM9
+    if (portlist.portmatch && !wcsncmp(portlist.portmatch, L"\\\\.\\", 4)) {
+        portlist.portmatch += 4;
+    }
+
+    if (portlist.tracefile && !tracestart()) {
+        return -1;
+    }
+
     if (portlist.optFlags & (OPT_FLAG_HELP | OPT_FLAG_HELP_COPYRIGHT)) {
         // verbose help and or copyright text
         usage(portlist.optFlags & OPT_FLAG_HELP, portlist.optFlags & OPT_FLAG_HELP_COPYRIGHT); 
+#if defined(PORTLIST_BENCH)
+    } else if (portlist.optFlags & OPT_FLAG_MICROBENCH) {
+        return microbench(&portlist);
+    } else if (portlist.optFlags & OPT_FLAG_STRESS) {
+        return stresstest(&portlist);
+    } else if (portlist.optXFlags & OPT_XFLAG_SHMSTRESS) {
+        return shmstresstest(&portlist);
+    } else if (portlist.optFlags & OPT_FLAG_LATENCY) {
+        return latencytest(&portlist);
+#endif
+    } else if (portlist.optXFlags & OPT_XFLAG_TOP) {
+        // live view, until the user quits
+        return topview(&portlist);
+    } else if (portlist.optXFlags & OPT_XFLAG_COUNTERS) {
+        // traffic & line error counters, until the user stops us
+        return counterloop(&portlist);
+    } else if (portlist.optXFlags & OPT_XFLAG_IRQ) {
+        // port interrupts & processor interrupt rates, until the user stops us
+        return irqloop(&portlist);
+    } else if (portlist.optXFlags & OPT_XFLAG_BENCH) {
+        // loopback plug throughput & latency
+        return loopbackbench(&portlist);
+    } else if (portlist.publishname) {
+        // port table in shared memory, until the user stops us
+        return publishloop(&portlist);
+    } else if (portlist.optFlags & OPT_FLAG_METRICS) {
+        // Prometheus metrics, optionally repeated
+        return metricsloop(&portlist);
+    } else if (portlist.optFlags & OPT_FLAG_BATCH) {
+        // many queries, one enumeration
+        return batchquery(&portlist);
+    } else if (portlist.optFlags & OPT_FLAG_FLEET) {
+        // list ports from saved snapshots
+        return listfleet(&portlist);
     } else {
         // make & print port list
         listports(&portlist);
     }
 
+    if (portlist.tracefile && !tracewrite(portlist.tracefile)) {
+        return -1;
+    }
+
     return 0;
 }
 
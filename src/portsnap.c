@@ -0,0 +1,266 @@
+/*
+    portsnap.c - read binary port snapshots written by portlist -export=<file>,
+    or published by portlist -publish=<name> in shared memory.
+
+    The snapshot is mapped read only and its records & strings are used where
+    they lie, nothing is copied or converted. Only the header is checked on
+    open, each record & string is bounds checked as it is fetched.
+
+    Project home https://github.com/tonynaggs/portlist
+
+    Copyright (c) 2013, 2014 Anthony Naggs. All rights reserved.
+
+    Licensed under the GNU General Public License version 2 or later,
+    see portlist.c for details.
+*/
+
+/* MS VC whines about _snwprintf even when used safely
+ * This define suppresses the messages and is needed before #include of header files
+ */
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+
+#include "portsnap.h"
+
+
+// header fields describe a file this reader can use in place
+static BOOL portsnapvalid(const PortSnap* snap)
+{
+    const struct portsnap_header* h = snap->header;
+    const wchar_t*                last;
+
+    if ((snap->size < sizeof(struct portsnap_header)) || (h->magic != PORTSNAP_MAGIC) ||
+            (h->versionmajor != PORTSNAP_VERSION_MAJOR) || (h->headersize < sizeof(struct portsnap_header)) ||
+            (h->headersize > snap->size)) {
+        return FALSE;
+    }
+
+    // records are aligned for their 64 bit fields
+    if ((h->recordsize < PORTSNAP_RECORD_SIZE_1_0) || (h->recordsize % 8) || (h->recordsoffset % 8) ||
+            (h->recordsoffset < h->headersize) ||
+            ((ULONGLONG) h->recordsoffset + (ULONGLONG) h->count * h->recordsize > snap->size)) {
+        return FALSE;
+    }
+
+    // pool starts with the empty string & ends with a NUL
+    if ((h->stringsoffset % sizeof(wchar_t)) || (h->stringssize < sizeof(wchar_t)) ||
+            (h->stringssize % sizeof(wchar_t)) || ((ULONGLONG) h->stringsoffset + h->stringssize > snap->size)) {
+        return FALSE;
+    }
+    last = (const wchar_t*) (snap->base + h->stringsoffset + h->stringssize) - 1;
+    if ((*(const wchar_t*) (snap->base + h->stringsoffset) != L'\0') || (*last != L'\0')) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+DWORD portsnapopen(PortSnap* snap, const wchar_t* filename)
+{
+    LARGE_INTEGER size;
+    DWORD         error;
+
+    memset(snap, 0, sizeof(PortSnap));
+    snap->file = CreateFileW(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (snap->file == INVALID_HANDLE_VALUE) {
+        snap->file = NULL;
+        return GetLastError();
+    }
+
+    if (!GetFileSizeEx(snap->file, &size)) {
+        error = GetLastError();
+        portsnapclose(snap);
+        return error;
+    }
+    if (size.QuadPart < (LONGLONG) sizeof(struct portsnap_header)) {
+        // also a mapping cannot be made of an empty file
+        portsnapclose(snap);
+        return ERROR_BAD_FORMAT;
+    }
+    snap->size = (ULONGLONG) size.QuadPart;
+
+    snap->mapping = CreateFileMappingW(snap->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    snap->base = snap->mapping ? (const BYTE*) MapViewOfFile(snap->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (snap->base == NULL) {
+        error = GetLastError();
+        portsnapclose(snap);
+        return error;
+    }
+
+    snap->header = (const struct portsnap_header*) snap->base;
+    if (!portsnapvalid(snap)) {
+        portsnapclose(snap);
+        return ERROR_BAD_FORMAT;
+    }
+    snap->strings = (const wchar_t*) (snap->base + snap->header->stringsoffset);
+
+    return ERROR_SUCCESS;
+}
+
+
+DWORD portsnapload(PortSnap* snap, const void* image, ULONGLONG size)
+{
+    memset(snap, 0, sizeof(PortSnap));
+    snap->base = (const BYTE*) image;
+    snap->size = size;
+    snap->header = (const struct portsnap_header*) image;
+    if (!portsnapvalid(snap)) {
+        memset(snap, 0, sizeof(PortSnap));
+        return ERROR_BAD_FORMAT;
+    }
+    snap->strings = (const wchar_t*) (snap->base + snap->header->stringsoffset);
+
+    return ERROR_SUCCESS;
+}
+
+
+// also for snapshots from portsnapload(), the image stays the caller's
+void portsnapclose(PortSnap* snap)
+{
+    if (snap->mapping) {
+        if (snap->base) {
+            UnmapViewOfFile(snap->base);
+        }
+        CloseHandle(snap->mapping);
+    }
+    if (snap->file) {
+        CloseHandle(snap->file);
+    }
+    memset(snap, 0, sizeof(PortSnap));
+}
+
+
+unsigned portsnapcount(const PortSnap* snap)
+{
+    return snap->header ? snap->header->count : 0;
+}
+
+
+const struct portsnap_record* portsnaprecord(const PortSnap* snap, unsigned index)
+{
+    if ((snap->header == NULL) || (index >= snap->header->count)) {
+        return NULL;
+    }
+    return (const struct portsnap_record*)
+        (snap->base + snap->header->recordsoffset + (size_t) index * snap->header->recordsize);
+}
+
+
+const wchar_t* portsnapstring(const PortSnap* snap, DWORD offset)
+{
+    if ((snap->header == NULL) || (offset == 0) || (offset % sizeof(wchar_t)) ||
+            (offset >= snap->header->stringssize)) {
+        return NULL;
+    }
+    return (const wchar_t*) ((const BYTE*) snap->strings + offset);
+}
+
+
+void portsnapshmname(wchar_t* fullname, size_t size, const wchar_t* name)
+{
+    _snwprintf(fullname, size - 1, wcschr(name, L'\\') ? L"%s" : PORTSNAP_SHM_PREFIX L"%s", name);
+    fullname[size - 1] = L'\0';
+}
+
+
+DWORD portsnapshmopen(PortSnapShm* reader, const wchar_t* name)
+{
+    wchar_t fullname[MAX_PATH];
+    DWORD   error;
+
+    memset(reader, 0, sizeof(PortSnapShm));
+    portsnapshmname(fullname, MAX_PATH, name);
+    reader->mapping = OpenFileMappingW(FILE_MAP_READ, FALSE, fullname);
+    if (reader->mapping == NULL) {
+        return GetLastError();
+    }
+
+    // fails if the segment is smaller, so the image can be read without checking its size again
+    reader->shm = (const volatile struct portsnap_shm*) MapViewOfFile(reader->mapping, FILE_MAP_READ, 0, 0,
+        PORTSNAP_SHM_SIZE);
+    if (reader->shm == NULL) {
+        error = GetLastError();
+        CloseHandle(reader->mapping);
+        reader->mapping = NULL;
+        return error;
+    }
+
+    return ERROR_SUCCESS;
+}
+
+
+void portsnapshmclose(PortSnapShm* reader)
+{
+    if (reader->shm) {
+        UnmapViewOfFile((LPCVOID) reader->shm);
+    }
+    if (reader->mapping) {
+        CloseHandle(reader->mapping);
+    }
+    memset(reader, 0, sizeof(PortSnapShm));
+}
+
+
+LONG portsnapshmsequence(const PortSnapShm* reader)
+{
+    return reader->shm->sequence;
+}
+
+
+DWORD portsnapshmread(const PortSnapShm* reader, void* buffer, DWORD buffersize, DWORD* pSize, LONG* pSequence)
+{
+    const volatile struct portsnap_shm* shm = reader->shm;
+    const BYTE*                         image = (const BYTE*) shm + sizeof(struct portsnap_shm);
+    const DWORD                         start = GetTickCount();
+
+    // GetTickCount reads shared memory, so retrying stays free of system calls
+    while ((GetTickCount() - start) <= PORTSNAP_SHM_WAIT_MS) {
+        LONG  sequence = shm->sequence;
+        DWORD size;
+
+        if (sequence == 0) {
+            return ERROR_NO_DATA;
+        }
+        if (sequence & 1) {
+            // being written
+            YieldProcessor();
+            continue;
+        }
+
+        // image loads must not move before the first sequence load, nor after the second
+        MemoryBarrier();
+        size = shm->size;
+        if ((shm->magic != PORTSNAP_MAGIC) || (size > PORTSNAP_SHM_CAPACITY)) {
+            MemoryBarrier();
+            if (shm->sequence == sequence) {
+                return ERROR_BAD_FORMAT;
+            }
+            continue;
+        }
+        if (size > buffersize) {
+            MemoryBarrier();
+            if (shm->sequence == sequence) {
+                *pSize = size;
+                return ERROR_INSUFFICIENT_BUFFER;
+            }
+            continue;
+        }
+
+        memcpy(buffer, image, size);
+        MemoryBarrier();
+        if (shm->sequence == sequence) {
+            *pSize = size;
+            if (pSequence) {
+                *pSequence = sequence;
+            }
+            return ERROR_SUCCESS;
+        }
+    }
+
+    return ERROR_BUSY;
+}
@@ -0,0 +1,189 @@
+/*
+    portsnap.h - binary port snapshot format written by portlist -export=<file>,
+    and a reader that walks a memory mapped snapshot in place.
+
+    Project home https://github.com/tonynaggs/portlist
+
+    Copyright (c) 2013, 2014 Anthony Naggs. All rights reserved.
+
+    Licensed under the GNU General Public License version 2 or later,
+    see portlist.c for details.
+*/
+
+#ifndef PORTSNAP_H
+#define PORTSNAP_H
+
+#include <windows.h>
+
+/*
+    File layout, all values little endian:
+        header      struct portsnap_header, headersize bytes
+        records     count records of recordsize bytes each, at recordsoffset
+        strings     pool of NUL terminated UTF-16 strings, at stringsoffset
+
+    Strings are referred to by their byte offset in the pool, offset 0 is
+    always an empty string and means "no value". The pool ends with a NUL so
+    every string in it is terminated.
+
+    The records start on an 8 byte boundary & are a multiple of 8 bytes, so
+    they can be used in place.
+
+    Fields are only added to the end of the header & records, with a new
+    minor version. Readers step through records by recordsize, so they can
+    read files written by later minor versions. Fields added by a minor
+    version are only present when recordsize covers them, so check recordsize
+    before using them in files from earlier minor versions. A new major
+    version is not compatible.
+ */
+#define PORTSNAP_MAGIC          0x50414E53      // "SNAP"
+#define PORTSNAP_VERSION_MAJOR  1
+#define PORTSNAP_VERSION_MINOR  1           // 1.1 added the USB link fields
+
+struct portsnap_header {
+    DWORD       magic;              // PORTSNAP_MAGIC
+    WORD        versionmajor;
+    WORD        versionminor;
+    DWORD       headersize;         // sizeof(struct portsnap_header) when written
+    DWORD       recordsize;         // sizeof(struct portsnap_record) when written
+    DWORD       count;              // of records
+    DWORD       recordsoffset;      // file offsets
+    DWORD       stringsoffset;
+    DWORD       stringssize;        // bytes
+    DWORD       host;               // strings, computer & portlist version
+    DWORD       creator;
+    FILETIME    created;            // UTC
+};
+
+// record flags
+#define PORTSNAP_AVAILABLE      0x0001
+#define PORTSNAP_HAVE_USBID     0x0002
+#define PORTSNAP_HAVE_PCIID     0x0004
+#define PORTSNAP_WIN_SERIAL     0x0008      // Windows generated serial number
+#define PORTSNAP_INCOMPLETE     0x0010      // -devtimeout expired
+#define PORTSNAP_LATENCY_SET    0x0020      // -set-low-latency changed the latency timer
+
+// one port, in the order listed
+struct portsnap_record {
+    ULONGLONG   lastseen;           // FILETIME, -history
+    DWORD       flags;              // PORTSNAP_...
+    DWORD       bustype;            // enum pnpbus in portlist.c
+    DWORD       portnumber;         // following COM or LPT
+    DWORD       vendorid;
+    DWORD       productid;
+    DWORD       pcisubsys;
+    DWORD       revision;
+    DWORD       usbinterface;
+    DWORD       retrieved;          // RETRIEVED_... bits in portlist.c
+    DWORD       portaddress;
+    DWORD       interrupt;
+    DWORD       portindex;
+    DWORD       indexed;
+    DWORD       latencytimer;       // ms
+    DWORD       hubnumber;
+    DWORD       hubport;
+    DWORD       ownerpid;
+
+    // strings
+    DWORD       portname;
+    DWORD       friendlyname;
+    DWORD       busname;
+    DWORD       product;
+    DWORD       vendor;
+    DWORD       hardwareid;
+    DWORD       location;
+    DWORD       physdevobj;
+    DWORD       devclass;
+    DWORD       serialnumber;
+    DWORD       parentid;
+    DWORD       locationpath;
+    DWORD       ownername;
+
+    // 1.1, USB link from -v, if retrieved has RETRIEVED_USB_LINK
+    DWORD       usbspeed;           // 0 low, 1 full, 2 high, 3 SuperSpeed
+    DWORD       usbmaxpacket;       // bytes
+    DWORD       usbhub;             // strings, device instance ids
+    DWORD       usbroothub;
+};
+
+// records written by 1.0 end after ownername
+#define PORTSNAP_RECORD_SIZE_1_0    128
+
+
+// an open snapshot, the header & records are used straight from the mapped file
+typedef struct portsnap {
+    HANDLE                          file;
+    HANDLE                          mapping;
+    const BYTE*                     base;
+    ULONGLONG                       size;
+    const struct portsnap_header*   header;
+    const wchar_t*                  strings;
+} PortSnap;
+
+/*
+    Map a snapshot & check its header, which takes the same time whatever
+    the number of ports. Returns ERROR_SUCCESS, a Win32 error, or
+    ERROR_BAD_FORMAT if the file is not a snapshot this reader can read.
+ */
+DWORD portsnapopen(PortSnap* snap, const wchar_t* filename);
+void portsnapclose(PortSnap* snap);
+
+unsigned portsnapcount(const PortSnap* snap);
+
+// NULL if index is out of range
+const struct portsnap_record* portsnaprecord(const PortSnap* snap, unsigned index);
+
+// a string of the snapshot, NULL for offset 0 or a bad offset
+const wchar_t* portsnapstring(const PortSnap* snap, DWORD offset);
+
+// check a snapshot image in memory, eg from portsnapshmread(), it is used in place
+DWORD portsnapload(PortSnap* snap, const void* image, ULONGLONG size);
+
+
+/*
+    portlist -publish=<name> keeps the current snapshot image in a named
+    shared memory segment, "Local\portlist.<name>", or <name> as given if
+    it has a backslash (eg Global\rig). The image follows the segment header.
+
+    The image is guarded by a sequence lock. The publisher makes sequence
+    odd, writes the image, then makes it even again. A reader copies the
+    image between two reads of an even sequence, and tries again if the
+    sequence changed. So readers never make system calls or wait on a lock,
+    and the publisher never waits for readers.
+ */
+#define PORTSNAP_SHM_PREFIX     L"Local\\portlist."
+#define PORTSNAP_SHM_SIZE       (4 * 1024 * 1024)   // whole segment
+#define PORTSNAP_SHM_WAIT_MS    100                 // read retries before giving up on a stuck publisher
+
+struct portsnap_shm {
+    LONG volatile   sequence;       // 0 before the first image, odd while one is written
+    DWORD           magic;          // PORTSNAP_MAGIC
+    DWORD           size;           // of the image
+    DWORD           reserved;
+};
+
+#define PORTSNAP_SHM_CAPACITY   (PORTSNAP_SHM_SIZE - sizeof(struct portsnap_shm))
+
+typedef struct portsnapshm {
+    HANDLE                              mapping;
+    const volatile struct portsnap_shm* shm;
+} PortSnapShm;
+
+// full name of the segment, name as for -publish=
+void portsnapshmname(wchar_t* fullname, size_t size, const wchar_t* name);
+
+DWORD portsnapshmopen(PortSnapShm* reader, const wchar_t* name);
+void portsnapshmclose(PortSnapShm* reader);
+
+// changes each time an image is published, one load for readers polling for changes
+LONG portsnapshmsequence(const PortSnapShm* reader);
+
+/*
+    Copy a consistent image into buffer. Returns ERROR_SUCCESS with the size
+    in *pSize, ERROR_INSUFFICIENT_BUFFER with the size needed in *pSize,
+    ERROR_NO_DATA if nothing has been published yet, or ERROR_BUSY if the
+    publisher was writing throughout PORTSNAP_SHM_WAIT_MS, eg it stopped
+    part way through.
+ */
+DWORD portsnapshmread(const PortSnapShm* reader, void* buffer, DWORD buffersize, DWORD* pSize, LONG* pSequence);
+
+#endif